@@ -235,6 +235,7 @@ int Assemble(struct supertype *st, char *mddev,
 	int trustworthy;
 	char chosen_name[1024];
 	struct domainlist *domains = NULL;
+	struct probe_set *probes;
 
 	if (get_linux_version() < 2004000)
 		old_linux = 1;
@@ -285,6 +286,11 @@ int Assemble(struct supertype *st, char *mddev,
 	    fprintf(stderr, Name ": looking for devices for %s\n",
 		    mddev ? mddev : "further assembly");
 
+	/* Read all the superblocks at once rather than one device
+	 * after another; the loop below then picks up the results.
+	 */
+	probes = probe_devices(devlist, ident->devices, st, 0);
+
 	/* first walk the list of devices to find a consistent set
 	 * that match the criterea, if that is possible.
 	 * We flag the ones we like with 'used'.
@@ -358,12 +364,14 @@ int Assemble(struct supertype *st, char *mddev,
 			} else
 				found_container = 1;
 		} else {
-			if (!tst && (tst = guess_super(dfd)) == NULL) {
+			int rv = probe_load(probes, tmpdev, &tst, dfd, 0, NULL);
+
+			if (rv == 1) {
 				if (report_missmatch)
 					fprintf(stderr, Name ": no recogniseable superblock on %s\n",
 						devname);
 				tmpdev->used = 2;
-			} else if (tst->ss->load_super(tst,dfd, NULL)) {
+			} else if (rv) {
 				if (report_missmatch)
 					fprintf(stderr, Name ": no RAID superblock on %s\n",
 						devname);
@@ -401,6 +409,7 @@ int Assemble(struct supertype *st, char *mddev,
 				st->ss->free_super(st);
 			dev_policy_free(pol);
 			domain_free(domains);
+			probe_free(probes);
 			return 1;
 		}
 
@@ -484,6 +493,7 @@ int Assemble(struct supertype *st, char *mddev,
 				st->ss->free_super(st);
 				dev_policy_free(pol);
 				domain_free(domains);
+				probe_free(probes);
 				return 1;
 			}
 			if (verbose > 0)
@@ -571,6 +581,7 @@ int Assemble(struct supertype *st, char *mddev,
 				st->ss->free_super(st);
 				dev_policy_free(pol);
 				domain_free(domains);
+				probe_free(probes);
 				return 1;
 			}
 			tmpdev->used = 1;
@@ -587,6 +598,7 @@ int Assemble(struct supertype *st, char *mddev,
 		if (tst)
 			tst->ss->free_super(tst);
 	}
+	probe_free(probes);
 
 	/* Check if we found some imsm spares but no members */
 	if ((auto_assem ||
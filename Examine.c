@@ -61,6 +61,13 @@ int Examine(struct mddev_dev *devlist, int brief, int export, int scan,
 		struct array *next;
 		int spares;
 	} *arrays = NULL;
+	struct probe_set *probes = NULL;
+
+	if (brief || scan)
+		/* Nothing is reported per-device, so the superblocks
+		 * can all be read at once.
+		 */
+		probes = probe_devices(devlist, NULL, forcest, 1);
 
 	for (; devlist ; devlist=devlist->next) {
 		struct supertype *st;
@@ -77,6 +84,7 @@ int Examine(struct mddev_dev *devlist, int brief, int export, int scan,
 		}
 		else {
 			int container = 0;
+			err = 1;
 			if (forcest)
 				st = dup_super(forcest);
 			else if (must_be_container(fd)) {
@@ -84,14 +92,15 @@ int Examine(struct mddev_dev *devlist, int brief, int export, int scan,
 				st = super_by_fd(fd, NULL);
 				container = 1;
 			} else
-				st = guess_super(fd);
+				st = NULL;
+			if (!container) {
+				if (probe_load(probes, devlist, &st, fd, 1,
+					       (brief||scan) ? NULL
+					       :devlist->devname) == 0)
+					err = 0;
+			}
 			if (st) {
-				err = 1;
 				st->ignore_hw_compat = 1;
-				if (!container)
-					err = st->ss->load_super(st, fd,
-								 (brief||scan) ? NULL
-								 :devlist->devname);
 				if (err && st->ss->load_container) {
 					err = st->ss->load_container(st, fd,
 								 (brief||scan) ? NULL
@@ -105,7 +114,6 @@ int Examine(struct mddev_dev *devlist, int brief, int export, int scan,
 					fprintf(stderr, Name ": No md superblock detected on %s.\n", devlist->devname);
 					rv = 1;
 				}
-				err = 1;
 			}
 			close(fd);
 		}
@@ -182,5 +190,6 @@ int Examine(struct mddev_dev *devlist, int brief, int export, int scan,
 				printf("\n");
 		}
 	}
+	probe_free(probes);
 	return rv;
 }
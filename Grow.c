@@ -269,6 +269,152 @@ int Grow_Add_device(char *devname, int fd, char *newdev)
 	return 0;
 }
 
+/* Sectors of each device that a bitmap for this array must cover */
+static unsigned long long bitmap_size(int fd, mdu_array_info_t *array)
+{
+	unsigned long long bitmapsize, array_size;
+
+	bitmapsize = array->size;
+	bitmapsize <<= 1;
+	if (get_dev_size(fd, NULL, &array_size) &&
+	    array_size > (0x7fffffffULL<<9)) {
+		/* Array is big enough that we cannot trust array.size
+		 * try other approaches
+		 */
+		bitmapsize = get_component_size(fd);
+	}
+	if (bitmapsize == 0)
+		return 0;
+
+	if (array->level == 10) {
+		int ncopies = (array->layout&255)*((array->layout>>8)&255);
+		bitmapsize = bitmapsize * array->raid_disks / ncopies;
+	}
+	return bitmapsize;
+}
+
+/* Name of an in-sync member device of the array, or NULL */
+static char *bitmap_member(int fd, struct supertype *st)
+{
+	int d;
+
+	for (d = 0; d < st->max_devs; d++) {
+		mdu_disk_info_t disk;
+
+		disk.number = d;
+		if (ioctl(fd, GET_DISK_INFO, &disk) < 0)
+			continue;
+		if (disk.major == 0 && disk.minor == 0)
+			continue;
+		if ((disk.state & (1<<MD_DISK_SYNC)) == 0)
+			continue;
+		return map_dev(disk.major, disk.minor, 1);
+	}
+	return NULL;
+}
+
+/* The smallest bitmap chunk there is room for.  For an internal bitmap
+ * we ask the metadata, trying each size on a member's superblock in
+ * memory; nothing is written.  A bitmap file can be any size, but is
+ * kept to 2^21 chunks as CreateBitmap would by default.
+ */
+static unsigned long bitmap_min_chunk(int fd, struct supertype *st,
+				      char *file, unsigned long long bitmapsize,
+				      int may_change, int major,
+				      int delay, int write_behind)
+{
+	unsigned long chunk = 4096;
+	char *dv;
+	int fd2;
+
+	if (file && strcmp(file, "internal") != 0) {
+		while ((bitmapsize * 512) / chunk > (1ULL << 21))
+			chunk <<= 1;
+		return chunk;
+	}
+	if (!st->ss->add_internal_bitmap)
+		return 0;
+	dv = bitmap_member(fd, st);
+	if (!dv)
+		return 0;
+	fd2 = dev_open(dv, O_RDONLY);
+	if (fd2 < 0)
+		return 0;
+	if (st->ss->load_super(st, fd2, NULL) != 0) {
+		close(fd2);
+		return 0;
+	}
+	close(fd2);
+	for (; chunk <= (1UL << 30); chunk <<= 1) {
+		int c = chunk;
+
+		if (st->ss->add_internal_bitmap(st, &c, delay, write_behind,
+						bitmapsize, may_change, major))
+			break;
+	}
+	st->ss->free_super(st);
+	return chunk <= (1UL << 30) ? chunk : 0;
+}
+
+/* How long --bitmap-chunk=auto watches the array */
+#define BITMAP_ADVISE_SECS 30
+
+/* --grow --bitmap-chunk=auto without --bitmap: just report what
+ * chunk size would suit the array.
+ */
+int Grow_bitmap_advise(char *devname, int fd, int delay, int verbose)
+{
+	mdu_bitmap_file_t bmf;
+	mdu_array_info_t array;
+	struct supertype *st;
+	char *subarray = NULL;
+	char *bitmap_dev = NULL;
+	char *file = NULL;
+	unsigned long long bitmapsize;
+	unsigned long min_chunk;
+	int chunk;
+
+	if (ioctl(fd, GET_ARRAY_INFO, &array) != 0) {
+		fprintf(stderr, Name ": cannot get array status for %s\n", devname);
+		return 1;
+	}
+	if (array.level <= 0) {
+		fprintf(stderr, Name ": Bitmaps not meaningful with level %s\n",
+			map_num(pers, array.level)?:"of this array");
+		return 1;
+	}
+	bitmapsize = bitmap_size(fd, &array);
+	if (bitmapsize == 0) {
+		fprintf(stderr, Name ": Cannot reliably determine size of array to create bitmap - sorry.\n");
+		return 1;
+	}
+	st = super_by_fd(fd, &subarray);
+	if (!st) {
+		fprintf(stderr, Name ": Cannot understand version %d.%d\n",
+			array.major_version, array.minor_version);
+		return 1;
+	}
+	free(subarray);
+
+	/* If there is already a bitmap, we can watch it */
+	if (ioctl(fd, GET_BITMAP_FILE, &bmf) == 0 && bmf.pathname[0])
+		bitmap_dev = file = bmf.pathname;
+	else if (array.state & (1<<MD_SB_BITMAP_PRESENT))
+		bitmap_dev = bitmap_member(fd, st);
+
+	min_chunk = bitmap_min_chunk(fd, st, file,
+				     bitmapsize, 1, BITMAP_MAJOR_HI,
+				     delay, 0);
+	if (!min_chunk)
+		/* no internal bitmap possible; a file would do */
+		min_chunk = bitmap_min_chunk(fd, st, "/", bitmapsize, 1,
+					     BITMAP_MAJOR_HI, delay, 0);
+	chunk = bitmap_advise_chunk(fd, bitmapsize, min_chunk, delay,
+				    BITMAP_ADVISE_SECS, bitmap_dev, verbose);
+	free(st);
+	return chunk < 0;
+}
+
 int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int write_behind, int force)
 {
 	/*
@@ -286,7 +432,7 @@ int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int
 	char *subarray = NULL;
 	int major = BITMAP_MAJOR_HI;
 	int vers = md_get_version(fd);
-	unsigned long long bitmapsize, array_size;
+	unsigned long long bitmapsize;
 
 	if (vers < 9003) {
 		major = BITMAP_MAJOR_HOSTENDIAN;
@@ -343,25 +489,12 @@ int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int
 			map_num(pers, array.level)?:"of this array");
 		return 1;
 	}
-	bitmapsize = array.size;
-	bitmapsize <<= 1;
-	if (get_dev_size(fd, NULL, &array_size) &&
-	    array_size > (0x7fffffffULL<<9)) {
-		/* Array is big enough that we cannot trust array.size
-		 * try other approaches
-		 */
-		bitmapsize = get_component_size(fd);
-	}
+	bitmapsize = bitmap_size(fd, &array);
 	if (bitmapsize == 0) {
 		fprintf(stderr, Name ": Cannot reliably determine size of array to create bitmap - sorry.\n");
 		return 1;
 	}
 
-	if (array.level == 10) {
-		int ncopies = (array.layout&255)*((array.layout>>8)&255);
-		bitmapsize = bitmapsize * array.raid_disks / ncopies;
-	}
-
 	st = super_by_fd(fd, &subarray);
 	if (!st) {
 		fprintf(stderr, Name ": Cannot understand version %d.%d\n",
@@ -374,6 +507,25 @@ int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int
 		free(st);
 		return 1;
 	}
+	if (chunk == BitmapChunkAuto) {
+		struct mdinfo *mdi = sysfs_read(fd, -1, GET_BITMAP_LOCATION);
+		int may_change = mdi != NULL;
+		unsigned long min_chunk;
+
+		sysfs_free(mdi);
+		min_chunk = bitmap_min_chunk(fd, st, file, bitmapsize,
+					     may_change, major,
+					     delay, write_behind);
+		if (!min_chunk) {
+			fprintf(stderr, Name ": no room for an internal bitmap on %s\n",
+				devname);
+			return 1;
+		}
+		chunk = bitmap_advise_chunk(fd, bitmapsize, min_chunk, delay,
+					    BITMAP_ADVISE_SECS, NULL, 1);
+		if (chunk < 0)
+			return 1;
+	}
 	if (strcmp(file, "internal") == 0) {
 		int rv;
 		int d;
@@ -539,11 +691,12 @@ static int check_idle(struct supertype *st)
 	int container_dev = (st->container_dev != NoMdDev
 			     ? st->container_dev : st->devnum);
 	char container[40];
+	static struct mdstat_arena arena;
 	struct mdstat_ent *ent, *e;
 	int is_idle = 1;
 
 	fmt_devname(container, container_dev);
-	ent = mdstat_read(0, 0);
+	ent = mdstat_read_arena(&arena, 0, 0);
 	for (e = ent ; e; e = e->next) {
 		if (!is_container_member(e, container))
 			continue;
@@ -552,7 +705,6 @@ static int check_idle(struct supertype *st)
 			break;
 		}
 	}
-	free_mdstat(ent);
 	return is_idle;
 }
 
@@ -896,10 +1048,10 @@ int reshape_open_backup_file(char *backup_file,
 {
 	/* Return 1 on success, 0 on any form of failure */
 	/* need to check backup file is large enough */
-	char buf[512];
+	char buf[64*1024];
 	struct stat stb;
 	unsigned int dev;
-	int i;
+	long i;
 
 	*fdlist = open(backup_file, O_RDWR|O_CREAT|(restart ? O_TRUNC : O_EXCL),
 		       S_IRUSR | S_IWUSR);
@@ -924,9 +1076,12 @@ int reshape_open_backup_file(char *backup_file,
 		return 0;
 	}
 
-	memset(buf, 0, 512);
-	for (i=0; i < blocks + 8 ; i++) {
-		if (write(*fdlist, buf, 512) != 512) {
+	memset(buf, 0, sizeof(buf));
+	for (i=0; i < blocks + 8 ; i += sizeof(buf)/512) {
+		int len = sizeof(buf);
+		if (blocks + 8 - i < len/512)
+			len = (blocks + 8 - i) * 512;
+		if (write(*fdlist, buf, len) != len) {
 			fprintf(stderr, Name ": %s: cannot create"
 				" backup file %s: %s\n",
 				devname, backup_file, strerror(errno));
@@ -3202,13 +3357,81 @@ check_progress:
 	}
 }
 
-/* FIXME return status is never checked */
+/* Make everything written to the backup destinations durable.
+ * Writeback is started on all of them before waiting for any, so
+ * several spares flush in parallel rather than one after another.
+ */
+static int sync_backup(int dests, int *destfd)
+{
+	int i;
+	int rv = 0;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	for (i = 0; i < dests; i++)
+		sync_file_range(destfd[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	for (i = 0; i < dests; i++)
+		if (fdatasync(destfd[i]) != 0)
+			rv = -1;
+	return rv;
+}
+
+/* Backup data is written once and only read back after a crash, so
+ * there is no point in it filling the page cache.  If the destination
+ * supports it, return a second descriptor opened with O_DIRECT for
+ * writing the data, otherwise just return 'fd'.
+ * The backup superblock is still written through 'fd'.  It is in the
+ * 4K before 'offset' (and just after the data), so requiring 'offset'
+ * to be 4K aligned keeps it out of any page the data is in.
+ */
+static int open_backup_direct(int fd, unsigned long long offset, char *buf)
+{
+	char path[50];
+	int dfd;
+
+	if (offset % 4096)
+		return fd;
+	sprintf(path, "/proc/self/fd/%d", fd);
+	dfd = open(path, O_RDWR|O_DIRECT);
+	if (dfd < 0)
+		return fd;
+	/* Make sure the device or filesystem accepts our alignment by
+	 * rewriting the first block of the backup area with itself.
+	 */
+	if (lseek64(dfd, offset, 0) < 0 ||
+	    read(dfd, buf, 4096) != 4096 ||
+	    lseek64(dfd, offset, 0) < 0 ||
+	    write(dfd, buf, 4096) != 4096) {
+		close(dfd);
+		return fd;
+	}
+	return dfd;
+}
+
+/* Stop using O_DIRECT for the backup data.  Returns 1 if it was in
+ * use on any destination, so the failed backup is worth trying again.
+ */
+static int buffered_backup(int dests, int *destfd, int *datafd)
+{
+	int i;
+	int rv = 0;
+
+	for (i = 0; i < dests; i++)
+		if (datafd[i] != destfd[i]) {
+			close(datafd[i]);
+			datafd[i] = destfd[i];
+			rv = 1;
+		}
+	return rv;
+}
+
 static int grow_backup(struct mdinfo *sra,
 		unsigned long long offset, /* per device */
 		unsigned long stripes, /* per device, in old chunks */
 		int *sources, unsigned long long *offsets,
 		int disks, int chunk, int level, int layout,
-		int dests, int *destfd, unsigned long long *destoffsets,
+		int dests, int *destfd, int *datafd,
+		unsigned long long *destoffsets,
 		int part, int *degraded,
 		char *buf)
 {
@@ -3231,7 +3454,7 @@ static int grow_backup(struct mdinfo *sra,
 
 	/* Check that array hasn't become degraded, else we might backup the wrong data */
 	if (sysfs_get_ll(sra, NULL, "degraded", &ll) < 0)
-		return -1; /* FIXME this error is ignored */
+		return -1;
 	new_degraded = (int)ll;
 	if (new_degraded != *degraded) {
 		/* check each device to ensure it is still working */
@@ -3267,13 +3490,13 @@ static int grow_backup(struct mdinfo *sra,
 		bsb.magic[15] = '2';
 	for (i = 0; i < dests; i++)
 		if (part)
-			lseek64(destfd[i], destoffsets[i] + __le64_to_cpu(bsb.devstart2)*512, 0);
+			lseek64(datafd[i], destoffsets[i] + __le64_to_cpu(bsb.devstart2)*512, 0);
 		else
-			lseek64(destfd[i], destoffsets[i], 0);
+			lseek64(datafd[i], destoffsets[i], 0);
 
 	rv = save_stripes(sources, offsets,
 			  disks, chunk, level, layout,
-			  dests, destfd,
+			  dests, datafd,
 			  offset*512*odata, stripes * chunk * odata,
 			  buf);
 
@@ -3301,9 +3524,10 @@ static int grow_backup(struct mdinfo *sra,
 			if (write(destfd[i], &bsb, 512) != 512)
 				break;
 		}
-		fsync(destfd[i]);
 		rv = 0;
 	}
+	if (sync_backup(dests, destfd) != 0)
+		rv = -1;
 
 	return rv;
 }
@@ -3350,8 +3574,9 @@ static int forget_backup(int dests, int *destfd,
 		if (rv == 0 &&
 		    write(destfd[i], &bsb, 512) != 512)
 			rv = -1;
-		fsync(destfd[i]);
 	}
+	if (sync_backup(dests, destfd) != 0)
+		rv = -1;
 	return rv;
 }
 
@@ -3395,6 +3620,7 @@ static void validate(int afd, int bfd, unsigned long long offset)
 		if (abuflen < len) {
 			free(abuf);
 			free(bbuf);
+			abuf = bbuf = NULL;
 			abuflen = len;
 			if (posix_memalign((void**)&abuf, 4096, abuflen) ||
 			    posix_memalign((void**)&bbuf, 4096, abuflen)) {
@@ -3432,9 +3658,13 @@ static void validate(int afd, int bfd, unsigned long long offset)
 		if (abuflen < len) {
 			free(abuf);
 			free(bbuf);
+			abuf = bbuf = NULL;
 			abuflen = len;
-			abuf = malloc(abuflen);
-			bbuf = malloc(abuflen);
+			if (posix_memalign((void**)&abuf, 4096, abuflen) ||
+			    posix_memalign((void**)&bbuf, 4096, abuflen)) {
+				abuflen = 0;
+				return;
+			}
 		}
 
 		lseek64(bfd, offset+__le64_to_cpu(bsb2.devstart2)*512, 0);
@@ -3448,6 +3678,144 @@ static void validate(int afd, int bfd, unsigned long long offset)
 	}
 }
 
+/* The amount backed up at each step is adapted to how fast the kernel
+ * is reshaping.  If the kernel catches up with the backup and has to
+ * wait, each backup step is made larger so fixed costs (the sync, the
+ * backup superblock) are spread over more data.  If backups comfortably
+ * out-pace the reshape, the step is made smaller again so that less of
+ * the array is suspended at a time.
+ * The step is always a multiple of 'unit' stripes (the smallest amount
+ * which is a whole number of both old and new stripes) and never more
+ * than fits in half of the backup area.
+ */
+struct backup_window {
+	unsigned long unit, max;	/* stripes */
+	unsigned long stripes;		/* current step */
+	int quiet;		/* backups in a row without a stall */
+	struct timeval start, last;
+	unsigned long long last_completed;
+	unsigned long long reshaped, backed_up;	/* sectors */
+	double reshape_ms;	/* time the kernel was not waiting for us */
+	double backup_ms, stall_ms;
+	double reshape_rate, backup_rate;	/* sectors per ms, smoothed */
+	unsigned long backups, stalls;
+	int report;
+};
+
+static double ms_since(struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000.0 +
+		(now.tv_usec - tv->tv_usec) / 1000.0;
+}
+
+static void window_init(struct backup_window *w, unsigned long unit,
+			unsigned long max, unsigned long long completed)
+{
+	memset(w, 0, sizeof(*w));
+	if (unit == 0 || unit > max)
+		unit = max;
+	w->unit = unit;
+	w->max = max - max % unit;
+	w->stripes = w->max;
+	w->last_completed = completed;
+	gettimeofday(&w->start, NULL);
+	w->last = w->start;
+	w->report = check_env("MDADM_GROW_STATS");
+}
+
+static void smooth(double *rate, double sample)
+{
+	if (*rate == 0)
+		*rate = sample;
+	else
+		*rate = (*rate * 3 + sample) / 4;
+}
+
+/* Record how far the reshape got since we last looked */
+static void window_progress(struct backup_window *w,
+			    unsigned long long completed)
+{
+	unsigned long long delta;
+	double ms = ms_since(&w->last);
+
+	gettimeofday(&w->last, NULL);
+	if (completed >= w->last_completed)
+		delta = completed - w->last_completed;
+	else
+		delta = w->last_completed - completed;
+	w->last_completed = completed;
+	if (delta == 0 || ms <= 0)
+		return;
+	w->reshaped += delta;
+	w->reshape_ms += ms;
+	smooth(&w->reshape_rate, delta / ms);
+}
+
+static void window_backup(struct backup_window *w, char *devname,
+			  unsigned long long sectors, double ms, int stalled)
+{
+	unsigned long old = w->stripes;
+
+	w->backups++;
+	w->backed_up += sectors;
+	w->backup_ms += ms;
+	if (ms > 0)
+		smooth(&w->backup_rate, sectors / ms);
+	if (stalled) {
+		/* The kernel had nothing to do while we were busy, so
+		 * don't count this time against the reshape speed.
+		 */
+		w->stalls++;
+		w->stall_ms += ms;
+		gettimeofday(&w->last, NULL);
+		w->quiet = 0;
+		if (w->stripes < w->max) {
+			w->stripes *= 2;
+			if (w->stripes > w->max)
+				w->stripes = w->max;
+		}
+	} else if (++w->quiet >= 4 &&
+		   w->backup_rate > 2 * w->reshape_rate &&
+		   w->reshape_rate > 0 &&
+		   w->stripes > w->unit) {
+		w->quiet = 0;
+		w->stripes /= 2;
+		w->stripes -= w->stripes % w->unit;
+		if (w->stripes < w->unit)
+			w->stripes = w->unit;
+	}
+	if (w->stripes != old)
+		dprintf("%s: backup window %lu -> %lu stripes"
+			" (reshape %.0fK/s, backup %.0fK/s)\n",
+			devname, old, w->stripes,
+			w->reshape_rate * 500, w->backup_rate * 500);
+	if (w->report && w->stripes != old)
+		fprintf(stderr, Name ": %s: backup window now %lu stripes"
+			" (reshape %.0fK/s, backup %.0fK/s)\n",
+			devname, w->stripes,
+			w->reshape_rate * 500, w->backup_rate * 500);
+}
+
+static void window_report(struct backup_window *w, char *devname)
+{
+	double total = ms_since(&w->start);
+
+	if (!w->report)
+		return;
+	fprintf(stderr, Name ": %s: reshaped %lluK in %.1fs:"
+		" reshape %.0fK/s, backup %.0fK/s\n",
+		devname, w->reshaped/2, total / 1000,
+		w->reshape_ms > 0 ? w->reshaped / w->reshape_ms * 500 : 0.0,
+		w->backup_ms > 0 ? w->backed_up / w->backup_ms * 500 : 0.0);
+	fprintf(stderr, Name ": %s: %lu backups, reshape waited for %lu"
+		" of them (%.1fs), final window %lu stripes\n",
+		devname, w->backups, w->stalls, w->stall_ms / 1000,
+		w->stripes);
+}
+
 int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		  struct supertype *st, unsigned long blocks,
 		  int *fds, unsigned long long *offsets,
@@ -3475,6 +3843,10 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	struct mdinfo *sd;
 	unsigned long stripes;
 	int uuid[4];
+	int *datafd;
+	int i;
+	int err = 0;
+	struct backup_window win;
 
 	/* set up the backup-super-block.  This requires the
 	 * uuid from the array.
@@ -3513,6 +3885,13 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 	if (posix_memalign((void**)&buf, 4096, disks * chunk))
 		/* Don't start the 'reshape' */
 		return 0;
+	datafd = malloc(dests * sizeof(*datafd));
+	if (!datafd) {
+		free(buf);
+		return 0;
+	}
+	for (i = 0; i < dests; i++)
+		datafd[i] = open_backup_direct(destfd[i], destoffsets[i], buf);
 	if (reshape->before.data_disks == reshape->after.data_disks) {
 		sysfs_get_ll(sra, NULL, "sync_speed_min", &speed);
 		sysfs_set_num(sra, NULL, "sync_speed_min", 200000);
@@ -3527,6 +3906,8 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		backup_point = reshape->backup_blocks;
 		suspend_point = array_size;
 	}
+	window_init(&win, reshape->backup_blocks / (chunk/512) / data,
+		    stripes, sra->reshape_progress);
 
 	while (!done) {
 		int rv;
@@ -3557,6 +3938,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 				      &suspend_point, &reshape_completed);
 		/* external metadata would need to ping_monitor here */
 		sra->reshape_progress = reshape_completed;
+		window_progress(&win, reshape_completed);
 
 		/* Clear any backup region that is before 'here' */
 		if (increasing) {
@@ -3595,6 +3977,8 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 		while (rv) {
 			unsigned long long offset;
 			unsigned long actual_stripes;
+			struct timeval tv;
+			int stalled;
 			/* Need to backup some data.
 			 * If 'part' is not used and the desired
 			 * backup size is suspended, do a backup,
@@ -3607,7 +3991,7 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 				break;
 
 			offset = backup_point / data;
-			actual_stripes = stripes;
+			actual_stripes = win.stripes;
 			if (increasing) {
 				if (offset + actual_stripes * (chunk/512) >
 				    sra->component_size)
@@ -3625,11 +4009,32 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			}
 			if (actual_stripes == 0)
 				break;
-			grow_backup(sra, offset, actual_stripes,
-				    fds, offsets,
-				    disks, chunk, level, layout,
-				    dests, destfd, destoffsets,
-				    part, &degraded, buf);
+			/* If the reshape has caught up with everything
+			 * backed up so far, it is waiting for this one.
+			 */
+			if (increasing)
+				stalled = reshape_completed >= backup_point;
+			else
+				stalled = reshape_completed <= backup_point;
+			gettimeofday(&tv, NULL);
+			while ((err = grow_backup(sra, offset, actual_stripes,
+						  fds, offsets,
+						  disks, chunk, level, layout,
+						  dests, destfd, datafd,
+						  destoffsets,
+						  part, &degraded, buf)) != 0 &&
+			       buffered_backup(dests, destfd, datafd))
+				;
+			if (err) {
+				fprintf(stderr, Name ": Cannot write backup "
+					"for reshape of %s - aborting\n",
+					sra->sys_name);
+				break;
+			}
+			window_backup(&win, sra->sys_name,
+				      (unsigned long long)actual_stripes
+				      * (chunk/512) * data,
+				      ms_since(&tv), stalled);
 			validate(afd, destfd[0], destoffsets[0]);
 			/* record where 'part' is up to */
 			part = !part;
@@ -3638,12 +4043,20 @@ int child_monitor(int afd, struct mdinfo *sra, struct reshape *reshape,
 			else
 				backup_point -= actual_stripes * (chunk/512) * data;
 		}
+		/* Without a good backup the reshape must not go on */
+		if (err)
+			break;
 	}
 
+	window_report(&win, sra->sys_name);
 	/* FIXME maybe call progress_reshape one more time instead */
 	abort_reshape(sra); /* remove any remaining suspension */
 	if (reshape->before.data_disks == reshape->after.data_disks)
 		sysfs_set_num(sra, NULL, "sync_speed_min", speed);
+	for (i = 0; i < dests; i++)
+		if (datafd[i] != destfd[i])
+			close(datafd[i]);
+	free(datafd);
 	free(buf);
 	return done;
 }
@@ -182,7 +182,7 @@ int Incremental(char *devname, int verbose, int runstop,
 	policy = disk_policy(&dinfo);
 	have_target = policy_check_path(&dinfo, &target_array);
 
-	if (st == NULL && (st = guess_super(dfd)) == NULL) {
+	if (st == NULL && (st = guess_super_cached(dfd)) == NULL) {
 		if (verbose >= 0)
 			fprintf(stderr, Name
 				": no recognisable superblock on %s.\n",
@@ -203,6 +203,7 @@ int Incremental(char *devname, int verbose, int runstop,
 		free(st);
 		goto out;
 	}
+	sbcache_store(dfd, st);
 	close (dfd); dfd = -1;
 
 	st->ss->getinfo_super(st, &info, NULL);
@@ -815,6 +816,7 @@ static int array_try_spare(char *devname, int *dfdp, struct dev_policy *pol,
 			"mapfile\n");
 		return 1;
 	}
+	map_read(&map);
 	for (mp = map ; mp ; mp = mp->next) {
 		struct supertype *st2;
 		struct domainlist *dl = NULL;
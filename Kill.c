@@ -51,6 +51,7 @@ int Kill(char *dev, struct supertype *st, int force, int quiet, int noexcl)
 				dev);
 		return 2;
 	}
+	sbcache_forget(fd);
 	if (st == NULL)
 		st = guess_super(fd);
 	if (st == NULL || st->ss->init_super == NULL) {
@@ -75,6 +75,7 @@ static int add_new_arrays(struct mdstat_ent *mdstat, struct state **statelist,
 			  int test, struct alert_info *info);
 static void try_spare_migration(struct state *statelist, struct alert_info *info);
 static void link_containers_with_subarrays(struct state *list);
+static int array_unchanged(struct state *st, struct mdstat_ent *mdstat);
 
 int Monitor(struct mddev_dev *devlist,
 	    char *mailaddr, char *alert_cmd,
@@ -127,7 +128,12 @@ int Monitor(struct mddev_dev *devlist,
 	struct state *statelist = NULL;
 	struct state *st2;
 	int finished = 0;
-	struct mdstat_ent *mdstat = NULL;
+	struct mdstat_ent *mdstat = NULL, *prev;
+	/* Alternate between two arenas so the previous mdstat is
+	 * still there to compare against.
+	 */
+	struct mdstat_arena arena[2];
+	int cycle = 0;
 	char *mailfrom = NULL;
 	struct alert_info info;
 
@@ -153,6 +159,7 @@ int Monitor(struct mddev_dev *devlist,
 	info.mailaddr = mailaddr;
 	info.mailfrom = mailfrom;
 	info.dosyslog = dosyslog;
+	memset(arena, 0, sizeof(arena));
 
 	if (daemonise) {
 		int rv = make_daemon(pidfile);
@@ -218,14 +225,21 @@ int Monitor(struct mddev_dev *devlist,
 		struct state *st;
 		int anydegraded = 0;
 
-		if (mdstat)
-			free_mdstat(mdstat);
-		mdstat = mdstat_read(oneshot?0:1, 0);
+		prev = mdstat;
+		mdstat = mdstat_read_arena(&arena[cycle++ & 1],
+					   oneshot?0:1, 0);
+		mdstat_diff(prev, mdstat);
 
-		for (st=statelist; st; st=st->next)
+		for (st=statelist; st; st=st->next) {
+			if (!test && array_unchanged(st, mdstat)) {
+				if ((st->active < st->raid) && st->spare == 0)
+					anydegraded = 1;
+				continue;
+			}
 			if (check_array(st, mdstat, test, &info,
 					increments, prefer))
 				anydegraded = 1;
+		}
 		
 		/* now check if there are any new devices found in mdstat */
 		if (scan)
@@ -250,6 +264,8 @@ int Monitor(struct mddev_dev *devlist,
 		statelist = st2->next;
 		free(st2);
 	}
+	mdstat_arena_free(&arena[0]);
+	mdstat_arena_free(&arena[1]);
 
 	if (pidfile)
 		unlink(pidfile);
@@ -446,6 +462,32 @@ static void alert(char *event, char *dev, char *disc, struct alert_info *info)
 	}
 }
 
+static int array_unchanged(struct state *st, struct mdstat_ent *mdstat)
+{
+	/* If the entry in /proc/mdstat for an array we already know
+	 * about has not changed, there is nothing new to report, so
+	 * check_array can be skipped.  Mark the entry as "used" just as
+	 * check_array would.
+	 */
+	struct mdstat_ent *mse;
+	int found = 0;
+
+	if (st->err || st->utime == 0 || st->devnum == INT_MAX)
+		return 0;
+	for (mse = mdstat; mse; mse = mse->next)
+		if (mse->devnum == st->devnum) {
+			if (mse->changed)
+				return 0;
+			found = 1;
+		}
+	if (!found)
+		return 0;
+	for (mse = mdstat; mse; mse = mse->next)
+		if (mse->devnum == st->devnum)
+			mse->devnum = INT_MAX;
+	return 1;
+}
+
 static int check_array(struct state *st, struct mdstat_ent *mdstat,
 		       int test, struct alert_info *ainfo,
 		       int increments, char *prefer)
@@ -967,6 +1009,7 @@ int Wait(char *dev)
 	struct stat stb;
 	int devnum;
 	int rv = 1;
+	struct mdstat_arena arena;
 
 	if (stat(dev, &stb) != 0) {
 		fprintf(stderr, Name ": Cannot find %s: %s\n", dev,
@@ -974,9 +1017,10 @@ int Wait(char *dev)
 		return 2;
 	}
 	devnum = stat2devnum(&stb);
+	memset(&arena, 0, sizeof(arena));
 
 	while(1) {
-		struct mdstat_ent *ms = mdstat_read(1, 0);
+		struct mdstat_ent *ms = mdstat_read_arena(&arena, 1, 0);
 		struct mdstat_ent *e;
 
 		for (e=ms ; e; e=e->next)
@@ -991,10 +1035,9 @@ int Wait(char *dev)
 				else
 					ping_monitor_by_id(devnum);
 			}
-			free_mdstat(ms);
+			mdstat_arena_free(&arena);
 			return rv;
 		}
-		free_mdstat(ms);
 		rv = 0;
 		mdstat_wait(5);
 	}
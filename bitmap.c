@@ -19,6 +19,7 @@
  */
 
 #include "mdadm.h"
+#include <dirent.h>
 
 inline void sb_le_to_cpu(bitmap_super_t *sb)
 {
@@ -67,45 +68,295 @@ const char *human_chunksize(unsigned long bytes)
 	return buf;
 }
 
+#define BITMAP_HIST_BUCKETS 64
+
 typedef struct bitmap_info_s {
 	bitmap_super_t sb;
 	unsigned long long total_bits;
 	unsigned long long dirty_bits;
+	/* runs of dirty bits, i.e. regions a resync will cover */
+	unsigned long long dirty_regions;
+	unsigned long long largest_region;	/* in chunks */
+	/* regions of up to 2^i chunks, and more than half that */
+	unsigned long long region_hist[BITMAP_HIST_BUCKETS];
+	unsigned long long dirty_sectors;	/* of the array to resync */
 } bitmap_info_t;
 
-/* count the dirty bits in the first num_bits of byte */
-inline int count_dirty_bits_byte(char byte, int num_bits)
+/* Counting dirty bits.  A fully dirty bitmap for a large array with
+ * small chunks runs to many megabytes, so count a word (or a vector)
+ * at a time rather than a bit at a time.
+ */
+static unsigned long long popcount_int(const unsigned char *buf, size_t len)
 {
-	int num = 0;
+	unsigned long long num = 0;
+	size_t i;
 
-	switch (num_bits) { /* fall through... */
-		case 8:	if (byte & 128) num++;
-		case 7:	if (byte &  64) num++;
-		case 6:	if (byte &  32) num++;
-		case 5:	if (byte &  16) num++;
-		case 4:	if (byte &   8) num++;
-		case 3: if (byte &   4) num++;
-		case 2:	if (byte &   2) num++;
-		case 1:	if (byte &   1) num++;
-		default: break;
+	for (i = 0; i + 8 <= len; i += 8) {
+		__u64 w;
+
+		memcpy(&w, buf + i, 8);
+		w = w - ((w >> 1) & 0x5555555555555555ULL);
+		w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+		w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		num += (w * 0x0101010101010101ULL) >> 56;
 	}
+	for (; i < len; i++) {
+		unsigned char b = buf[i];
 
+		b = b - ((b >> 1) & 0x55);
+		b = (b & 0x33) + ((b >> 2) & 0x33);
+		num += (b + (b >> 4)) & 0x0f;
+	}
 	return num;
 }
 
-int count_dirty_bits(char *buf, int num_bits)
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_X86_POPCNT
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static unsigned long long popcount_popcnt(const unsigned char *buf, size_t len)
+{
+	unsigned long long num = 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		unsigned long long w;
+
+		memcpy(&w, buf + i, 8);
+		num += __builtin_popcountll(w);
+	}
+	return num + popcount_int(buf + i, len - i);
+}
+
+/* Look up the count for each nibble with a byte shuffle, and sum the
+ * bytes with SAD before they can overflow (31 rounds of at most 8).
+ */
+__attribute__((target("avx2")))
+static unsigned long long popcount_avx2(const unsigned char *buf, size_t len)
 {
-	int i, num = 0;
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	unsigned long long lanes[4];
+	size_t i = 0;
+
+	while (i + 32 <= len) {
+		__m256i sum = zero;
+		int k;
 
-	for (i=0; i < num_bits / 8; i++)
-		num += count_dirty_bits_byte(buf[i], 8);
+		for (k = 0; k < 31 && i + 32 <= len; k++, i += 32) {
+			__m256i v = _mm256_loadu_si256((__m256i*)(buf + i));
+			__m256i lo = _mm256_and_si256(v, low);
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+						      low);
 
-	if (num_bits % 8) /* not an even byte boundary */
-		num += count_dirty_bits_byte(buf[i], num_bits % 8);
+			sum = _mm256_add_epi8(sum,
+				_mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+						_mm256_shuffle_epi8(lookup, hi)));
+		}
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(sum, zero));
+	}
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+		popcount_int(buf + i, len - i);
+}
+
+static int have_popcnt(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("popcnt");
+}
+
+static int have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* HAVE_X86_POPCNT */
+
+static const struct popcount_call {
+	const char *name;
+	int (*valid)(void);
+	unsigned long long (*count)(const unsigned char *buf, size_t len);
+} popcount_algos[] = {
+#ifdef HAVE_X86_POPCNT
+	{ "avx2", have_avx2, popcount_avx2 },
+	{ "popcnt", have_popcnt, popcount_popcnt },
+#endif
+	{ "int", NULL, popcount_int },
+};
+
+/* As with raid6_select_algo(), $MDADM_POPCOUNT_ALGO can force a choice */
+static unsigned long long popcount(const unsigned char *buf, size_t len)
+{
+	static const struct popcount_call *call;
 
+	if (!call) {
+		const char *want = getenv("MDADM_POPCOUNT_ALGO");
+		unsigned int i;
+
+		for (i = 0; i < sizeof(popcount_algos)/sizeof(popcount_algos[0]); i++) {
+			const struct popcount_call *c = &popcount_algos[i];
+			if (want && strcmp(want, c->name) != 0)
+				continue;
+			if (c->valid && !c->valid())
+				continue;
+			call = c;
+			break;
+		}
+		if (!call)
+			call = &popcount_algos[i-1];
+		dprintf("bitmap: using %s to count dirty bits\n", call->name);
+	}
+	return call->count(buf, len);
+}
+
+unsigned long long count_dirty_bits(char *buf, unsigned long long num_bits)
+{
+	unsigned long long num;
+
+	num = popcount((unsigned char *)buf, num_bits / 8);
+	if (num_bits % 8) { /* not an even byte boundary */
+		unsigned char last = buf[num_bits / 8];
+
+		last &= (1 << (num_bits % 8)) - 1;
+		num += popcount(&last, 1);
+	}
 	return num;
 }
 
+/* Finding the dirty regions.  The bitmap is streamed through
+ * bitmap_scan() a buffer at a time, and each run of dirty bits is
+ * handed to end_region() once its end is seen.  Clean and fully dirty
+ * words are skipped whole; others are walked one run at a time.
+ * Nothing is kept per region, so any size of bitmap can be scanned;
+ * a caller wanting the regions themselves gets each one passed to
+ * 'region' (in chunks) as it is found.
+ */
+typedef void (*bitmap_region_fn)(bitmap_info_t *info, void *arg,
+				 unsigned long long start,
+				 unsigned long long len);
+
+struct bitmap_scan {
+	unsigned long long bits;	/* bits scanned so far */
+	int in_region;
+	unsigned long long region_start;
+	bitmap_info_t *info;
+	bitmap_region_fn region;
+	void *region_arg;
+};
+
+/* The sectors of the array covered by 'len' chunks from 'start' */
+static unsigned long long region_sectors(bitmap_info_t *info,
+					 unsigned long long start,
+					 unsigned long long len)
+{
+	unsigned long long secs = info->sb.chunksize >> 9;
+	unsigned long long offset = start * secs;
+
+	/* the last chunk may reach past the end of the array */
+	if (offset >= info->sb.sync_size)
+		return 0;
+	if (offset + len * secs > info->sb.sync_size)
+		return info->sb.sync_size - offset;
+	return len * secs;
+}
+
+static void end_region(struct bitmap_scan *s, unsigned long long end)
+{
+	bitmap_info_t *info = s->info;
+	unsigned long long len = end - s->region_start;
+	int b = 0;
+
+	while (b < BITMAP_HIST_BUCKETS - 1 && (1ULL << b) < len)
+		b++;
+	info->region_hist[b]++;
+	info->dirty_regions++;
+	if (len > info->largest_region)
+		info->largest_region = len;
+	info->dirty_sectors += region_sectors(info, s->region_start, len);
+	if (s->region)
+		s->region(info, s->region_arg, s->region_start, len);
+	s->in_region = 0;
+}
+
+static void scan_word(struct bitmap_scan *s, __u64 w, int nb)
+{
+	unsigned long long pos = s->bits;
+	int i = 0;
+
+	if (nb < 64)
+		w &= (1ULL << nb) - 1;
+	s->bits += nb;
+	if (w == 0) {
+		if (s->in_region)
+			end_region(s, pos);
+		return;
+	}
+	if (nb == 64 && w == ~0ULL) {
+		if (!s->in_region) {
+			s->in_region = 1;
+			s->region_start = pos;
+		}
+		return;
+	}
+	while (i < nb) {
+		if (s->in_region) {
+			/* bits above nb in ~w are set, so this stops there */
+			__u64 clean = ~w >> i;
+
+			if (clean == 0)
+				break;
+			i += __builtin_ctzll(clean);
+			if (i >= nb)
+				break;
+			end_region(s, pos + i);
+		} else {
+			__u64 dirty = w >> i;
+
+			if (dirty == 0)
+				break;
+			i += __builtin_ctzll(dirty);
+			s->in_region = 1;
+			s->region_start = pos + i;
+		}
+	}
+}
+
+/* Scan the next num_bits of the bitmap, which start at buf */
+static void bitmap_scan(struct bitmap_scan *s, char *buf,
+			unsigned long long num_bits)
+{
+	unsigned long long i;
+
+	for (i = 0; i + 64 <= num_bits; i += 64) {
+		__u64 w;
+
+		/* bit n of the bitmap is bit n%8 of byte n/8 */
+		memcpy(&w, buf + i / 8, 8);
+		scan_word(s, __le64_to_cpu(w), 64);
+	}
+	if (i < num_bits) {
+		__u64 w = 0;
+		int nb = num_bits - i;
+
+		memcpy(&w, buf + i / 8, (nb + 7) / 8);
+		scan_word(s, __le64_to_cpu(w), nb);
+	}
+}
+
+static void bitmap_scan_done(struct bitmap_scan *s)
+{
+	if (s->in_region)
+		end_region(s, s->bits);
+}
+
 /* calculate the size of the bitmap given the array size and bitmap chunksize */
 unsigned long long bitmap_bits(unsigned long long array_size,
 				unsigned long chunksize)
@@ -122,23 +373,34 @@ unsigned long bitmap_sectors(struct bitmap_super_s *bsb)
 }
 
 
-bitmap_info_t *bitmap_fd_read(int fd, int brief)
+/* Read the bitmap this much at a time */
+#define BITMAP_READ_SIZE (1024*1024)
+
+bitmap_info_t *bitmap_fd_read(int fd, int brief,
+			      bitmap_region_fn region, void *region_arg)
 {
 	/* Note: fd might be open O_DIRECT, so we must be
 	 * careful to align reads properly
 	 */
 	unsigned long long total_bits = 0, read_bits = 0, dirty_bits = 0;
 	bitmap_info_t *info;
+	struct bitmap_scan scan;
 	void *buf;
-	unsigned int n, skip;
+	int n;
+	unsigned int skip;
+	size_t want;
 
-	if (posix_memalign(&buf, 4096, 8192) != 0) {
-		fprintf(stderr, Name ": failed to allocate 8192 bytes\n");
+	if (posix_memalign(&buf, 4096, BITMAP_READ_SIZE) != 0) {
+		fprintf(stderr, Name ": failed to allocate %d bytes\n",
+			BITMAP_READ_SIZE);
 		return NULL;
 	}
+	/* Just the superblock and the start of the bitmap until we
+	 * know how much there is.
+	 */
 	n = read(fd, buf, 8192);
 
-	info = malloc(sizeof(*info));
+	info = calloc(1, sizeof(*info));
 	if (info == NULL) {
 #if __GNUC__ < 3
 		fprintf(stderr, Name ": failed to allocate %d bytes\n",
@@ -151,7 +413,7 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 		return NULL;
 	}
 
-	if (n < sizeof(info->sb)) {
+	if (n < (int)sizeof(info->sb)) {
 		fprintf(stderr, Name ": failed to read superblock of bitmap "
 			"file: %s\n", strerror(errno));
 		free(info);
@@ -174,24 +436,36 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	 *    data in the file
 	 */
 	total_bits = bitmap_bits(info->sb.sync_size, info->sb.chunksize);
+	memset(&scan, 0, sizeof(scan));
+	scan.info = info;
+	scan.region = region;
+	scan.region_arg = region_arg;
 
 	while(read_bits < total_bits) {
 		unsigned long long remaining = total_bits - read_bits;
 
 		if (n == 0) {
-			n = read(fd, buf, 8192);
+			/* Only read as far as the bitmap goes, in whole
+			 * pages for O_DIRECT.
+			 */
+			want = BITMAP_READ_SIZE;
+			if ((remaining + 7) / 8 < want)
+				want = ROUND_UP((remaining + 7) / 8, 4096);
+			n = read(fd, buf, want);
 			skip = 0;
 			if (n <= 0)
 				break;
 		}
-		if (remaining > (n-skip) * 8) /* we want the full buffer */
-			remaining = (n-skip) * 8;
+		if (remaining > (unsigned long long)(n-skip) * 8) /* we want the full buffer */
+			remaining = (unsigned long long)(n-skip) * 8;
 
 		dirty_bits += count_dirty_bits(buf+skip, remaining);
+		bitmap_scan(&scan, buf+skip, remaining);
 
 		read_bits += remaining;
 		n = 0;
 	}
+	bitmap_scan_done(&scan);
 
 	if (read_bits < total_bits) { /* file truncated... */
 		fprintf(stderr, Name ": WARNING: bitmap file is not large "
@@ -206,7 +480,8 @@ out:
 	return info;
 }
 
-bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **stp)
+bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **stp,
+				bitmap_region_fn region, void *region_arg)
 {
 	int fd;
 	bitmap_info_t *info;
@@ -248,7 +523,7 @@ bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **st
 		}
 	}
 
-	info = bitmap_fd_read(fd, brief);
+	info = bitmap_fd_read(fd, brief, region, region_arg);
 	close(fd);
 	return info;
 }
@@ -265,7 +540,133 @@ __u32 swapl(__u32 l)
 	c[2] = t;
 	return l;
 }
-int ExamineBitmap(char *filename, int brief, struct supertype *st)
+/* The resync speed limits, in K/sec, for the array using the bitmap
+ * on 'filename' if it is a member device of a running array, else
+ * the system-wide ones.
+ */
+static void bitmap_sync_speed(char *filename, int *minp, int *maxp)
+{
+	struct stat stb;
+	char path[300], buf[1024];
+	DIR *dir;
+	struct dirent *de;
+
+	*minp = *maxp = 0;
+	if (load_sys("/proc/sys/dev/raid/speed_limit_min", buf) == 0)
+		*minp = atoi(buf);
+	if (load_sys("/proc/sys/dev/raid/speed_limit_max", buf) == 0)
+		*maxp = atoi(buf);
+
+	if (stat(filename, &stb) != 0 || !S_ISBLK(stb.st_mode))
+		return;
+	sprintf(path, "/sys/dev/block/%d:%d/holders",
+		major(stb.st_rdev), minor(stb.st_rdev));
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "md", 2) != 0)
+			continue;
+		/* these read as e.g. "1000 (system)" */
+		sprintf(path, "/sys/block/%s/md/sync_speed_min", de->d_name);
+		if (load_sys(path, buf) == 0)
+			*minp = atoi(buf);
+		sprintf(path, "/sys/block/%s/md/sync_speed_max", de->d_name);
+		if (load_sys(path, buf) == 0)
+			*maxp = atoi(buf);
+		break;
+	}
+	closedir(dir);
+}
+
+/* Time to resync 'sectors' at 'speed' K/sec, in seconds */
+static unsigned long long resync_secs(unsigned long long sectors, int speed)
+{
+	return (sectors / 2 + speed - 1) / speed;
+}
+
+static char *human_secs(unsigned long long secs)
+{
+	static char buf[2][30];
+	static int which;
+	char *b = buf[which ^= 1];
+
+	if (secs >= 3600)
+		sprintf(b, "%lluh%02llum", secs / 3600, secs / 60 % 60);
+	else if (secs >= 60)
+		sprintf(b, "%llum%02llus", secs / 60, secs % 60);
+	else
+		sprintf(b, "%llus", secs);
+	return b;
+}
+
+static void bitmap_uuid(bitmap_super_t *sb, struct supertype *st, char *buf)
+{
+	int swap;
+	__u32 uuid32[4];
+
+	if (st)
+		swap = st->ss->swapuuid;
+	else
+#if __BYTE_ORDER == BIG_ENDIAN
+		swap = 0;
+#else
+		swap = 1;
+#endif
+	memcpy(uuid32, sb->uuid, 16);
+	if (swap)
+		sprintf(buf, "%08x:%08x:%08x:%08x",
+			swapl(uuid32[0]),
+			swapl(uuid32[1]),
+			swapl(uuid32[2]),
+			swapl(uuid32[3]));
+	else
+		sprintf(buf, "%08x:%08x:%08x:%08x",
+			uuid32[0],
+			uuid32[1],
+			uuid32[2],
+			uuid32[3]);
+}
+
+struct bitmap_export {
+	struct supertype **stp;	/* set once the metadata is known */
+	int header_done;
+	unsigned long long extents;
+};
+
+static void bitmap_export_header(bitmap_info_t *info,
+				 struct bitmap_export *ex)
+{
+	bitmap_super_t *sb = &info->sb;
+	char uuid[40];
+
+	if (ex->header_done)
+		return;
+	ex->header_done = 1;
+	bitmap_uuid(sb, *ex->stp, uuid);
+	printf("MD_BITMAP_UUID=%s\n", uuid);
+	printf("MD_BITMAP_EVENTS=%llu\n", (unsigned long long)sb->events);
+	printf("MD_BITMAP_EVENTS_CLEARED=%llu\n",
+	       (unsigned long long)sb->events_cleared);
+	printf("MD_BITMAP_STATE=%s\n", bitmap_state(sb->state));
+	printf("MD_BITMAP_CHUNK_SIZE=%lu\n", (unsigned long)sb->chunksize);
+	printf("MD_BITMAP_SYNC_SIZE=%llu\n", (unsigned long long)sb->sync_size);
+}
+
+/* Print each region as it is found, so nothing is kept for them */
+static void bitmap_export_extent(bitmap_info_t *info, void *arg,
+				 unsigned long long start,
+				 unsigned long long len)
+{
+	struct bitmap_export *ex = arg;
+
+	bitmap_export_header(info, ex);
+	printf("MD_BITMAP_EXTENT_%llu=%llu:%llu\n", ex->extents++,
+	       start * (info->sb.chunksize >> 9),
+	       region_sectors(info, start, len));
+}
+
+int ExamineBitmap(char *filename, int brief, int export, struct supertype *st)
 {
 	/*
 	 * Read the bitmap file and display its contents
@@ -273,22 +674,29 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 
 	bitmap_super_t *sb;
 	bitmap_info_t *info;
+	struct bitmap_export ex;
 	int rv = 1;
 	char buf[64];
-	int swap;
-	__u32 uuid32[4];
+	char uuid[40];
+	int speed_min, speed_max;
 
-	info = bitmap_file_read(filename, brief, &st);
+	memset(&ex, 0, sizeof(ex));
+	ex.stp = &st;
+	info = bitmap_file_read(filename, brief, &st,
+				export ? bitmap_export_extent : NULL, &ex);
 	if (!info)
 		return rv;
 
 	sb = &info->sb;
-	printf("        Filename : %s\n", filename);
-	printf("           Magic : %08x\n", sb->magic);
+	if (!export) {
+		printf("        Filename : %s\n", filename);
+		printf("           Magic : %08x\n", sb->magic);
+	}
 	if (sb->magic != BITMAP_MAGIC) {
 		fprintf(stderr, Name ": invalid bitmap magic 0x%x, the bitmap file appears to be corrupted\n", sb->magic);
 	}
-	printf("         Version : %d\n", sb->version);
+	if (!export)
+		printf("         Version : %d\n", sb->version);
 	if (sb->version < BITMAP_MAJOR_LO ||
 	    sb->version > BITMAP_MAJOR_HI) {
 		fprintf(stderr, Name ": unknown bitmap version %d, either the bitmap file is corrupted or you need to upgrade your tools\n", sb->version);
@@ -296,50 +704,359 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 	}
 
 	rv = 0;
-	if (st)
-		swap = st->ss->swapuuid;
-	else
-#if __BYTE_ORDER == BIG_ENDIAN
-		swap = 0;
-#else
-		swap = 1;
-#endif
-	memcpy(uuid32, sb->uuid, 16);
-	if (swap)
-		printf("            UUID : %08x:%08x:%08x:%08x\n",
-		       swapl(uuid32[0]),
-		       swapl(uuid32[1]),
-		       swapl(uuid32[2]),
-		       swapl(uuid32[3]));
-	else
-		printf("            UUID : %08x:%08x:%08x:%08x\n",
-		       uuid32[0],
-		       uuid32[1],
-		       uuid32[2],
-		       uuid32[3]);
-
-	printf("          Events : %llu\n", (unsigned long long)sb->events);
-	printf("  Events Cleared : %llu\n", (unsigned long long)sb->events_cleared);
-	printf("           State : %s\n", bitmap_state(sb->state));
-	printf("       Chunksize : %s\n", human_chunksize(sb->chunksize));
-	printf("          Daemon : %ds flush period\n", sb->daemon_sleep);
-	if (sb->write_behind)
-		sprintf(buf, "Allow write behind, max %d", sb->write_behind);
-	else
-		sprintf(buf, "Normal");
-	printf("      Write Mode : %s\n", buf);
-	printf("       Sync Size : %llu%s\n", (unsigned long long)sb->sync_size/2,
-					human_size(sb->sync_size * 512));
+	if (!export) {
+		bitmap_uuid(sb, st, uuid);
+		printf("            UUID : %s\n", uuid);
+		printf("          Events : %llu\n", (unsigned long long)sb->events);
+		printf("  Events Cleared : %llu\n", (unsigned long long)sb->events_cleared);
+		printf("           State : %s\n", bitmap_state(sb->state));
+		printf("       Chunksize : %s\n", human_chunksize(sb->chunksize));
+		printf("          Daemon : %ds flush period\n", sb->daemon_sleep);
+		if (sb->write_behind)
+			sprintf(buf, "Allow write behind, max %d", sb->write_behind);
+		else
+			sprintf(buf, "Normal");
+		printf("      Write Mode : %s\n", buf);
+		printf("       Sync Size : %llu%s\n", (unsigned long long)sb->sync_size/2,
+						human_size(sb->sync_size * 512));
+	} else
+		bitmap_export_header(info, &ex);
 	if (brief)
 		goto free_info;
+
+	bitmap_sync_speed(filename, &speed_min, &speed_max);
+	if (export) {
+		printf("MD_BITMAP_CHUNKS=%llu\n", info->total_bits);
+		printf("MD_BITMAP_DIRTY_CHUNKS=%llu\n", info->dirty_bits);
+		printf("MD_BITMAP_EXTENTS=%llu\n", ex.extents);
+		printf("MD_BITMAP_RESYNC_SECTORS=%llu\n", info->dirty_sectors);
+		if (speed_min > 0 && speed_max > 0) {
+			printf("MD_BITMAP_RESYNC_SECS_MIN=%llu\n",
+			       resync_secs(info->dirty_sectors, speed_max));
+			printf("MD_BITMAP_RESYNC_SECS_MAX=%llu\n",
+			       resync_secs(info->dirty_sectors, speed_min));
+		}
+		goto free_info;
+	}
 	printf("          Bitmap : %llu bits (chunks), %llu dirty (%2.1f%%)\n",
 			info->total_bits, info->dirty_bits,
 			100.0 * info->dirty_bits / (info->total_bits?:1));
+	if (info->dirty_regions) {
+		int i;
+
+		printf("   Dirty Regions : %llu, largest %s\n",
+		       info->dirty_regions,
+		       human_size_brief(info->largest_region * sb->chunksize));
+		for (i = 0; i < BITMAP_HIST_BUCKETS; i++) {
+			char label[40];
+
+			if (!info->region_hist[i])
+				continue;
+			snprintf(label, sizeof(label), "up to %s",
+				 human_chunksize((unsigned long)sb->chunksize << i));
+			printf("%16s : %llu\n", label, info->region_hist[i]);
+		}
+		printf("     Resync Size : %llu%s\n", info->dirty_sectors/2,
+		       human_size(info->dirty_sectors * 512));
+		if (speed_min > 0 && speed_max > 0)
+			printf("      Resync ETA : %s to %s (at %d to %d K/sec)\n",
+			       human_secs(resync_secs(info->dirty_sectors,
+						      speed_max)),
+			       human_secs(resync_secs(info->dirty_sectors,
+						      speed_min)),
+			       speed_max, speed_min);
+	}
 free_info:
 	free(info);
 	return rv;
 }
 
+/* Choosing a bitmap chunk size.
+ *
+ * Small chunks make a resync after a crash or --re-add short, as only
+ * a little around each recent write is dirty.  But the first write to
+ * a clean chunk must wait for the bitmap to be updated on disk, and
+ * with small chunks more writes are such first writes.  So we watch
+ * the array for a while and pick the smallest chunk for which bitmap
+ * updates stay below BITMAP_ADVISE_OVERHEAD of the writes.
+ *
+ * The write rate and size come from the array's 'stat' file.  If the
+ * array already has a bitmap we also snapshot it every second, which
+ * shows exactly how many bits get set (each one a bitmap update) at
+ * its chunk size and at every larger one.  For smaller chunks, or with
+ * no bitmap, we assume the writes land at random: k writes in the
+ * time a bit stays set touch N*(1-exp(-k/N)) of N chunks.
+ */
+#define BITMAP_ADVISE_OVERHEAD	2	/* percent */
+#define BITMAP_ADVISE_MAX_CHUNK	(1UL << 30)
+
+/* Only the bitmap itself (and its previous snapshot) is kept; the
+ * bits a larger chunk would have are worked out from it as it is
+ * counted.
+ */
+struct advise_level {
+	unsigned long long set;		/* bits newly set while watching */
+	unsigned long long dirty_max;	/* most bits set at once */
+};
+
+struct advise_snap {
+	unsigned long long nbits;
+	__u64 *cur, *prev;
+	struct advise_level *levels;
+	int nlevels;
+};
+
+static void advise_region(bitmap_info_t *info, void *arg,
+			  unsigned long long start, unsigned long long len)
+{
+	struct advise_snap *sn = arg;
+	unsigned long long b, e = start + len;
+
+	if (e > sn->nbits)
+		e = sn->nbits;
+	for (b = start; b < e; b++)
+		sn->cur[b / 64] |= 1ULL << (b % 64);
+}
+
+/* The lowest bit of each group of 2^k bits, for k up to 6 */
+static const __u64 advise_group_mask[7] = {
+	0xffffffffffffffffULL, 0x5555555555555555ULL, 0x1111111111111111ULL,
+	0x0101010101010101ULL, 0x0001000100010001ULL, 0x0000000100000001ULL,
+	0x0000000000000001ULL,
+};
+
+/* Read the bitmap on 'bitmap_dev' and count, for every chunk size,
+ * what changed since last time.
+ */
+static int advise_snapshot(char *bitmap_dev, struct advise_snap *sn,
+			   int first)
+{
+	struct supertype *st = NULL;
+	bitmap_info_t *info;
+	unsigned long long nwords = (sn->nbits + 63) / 64;
+	unsigned long long dirty[64], set[64];
+	__u64 gcur[64], gprev[64];
+	unsigned long long w;
+	__u64 *t;
+	int k;
+
+	memset(sn->cur, 0, nwords * 8);
+	info = bitmap_file_read(bitmap_dev, 0, &st, advise_region, sn);
+	if (!info)
+		return -1;
+	free(info);
+	if (st)
+		st->ss->free_super(st);
+
+	memset(dirty, 0, sizeof(dirty));
+	memset(set, 0, sizeof(set));
+	memset(gcur, 0, sizeof(gcur));
+	memset(gprev, 0, sizeof(gprev));
+	for (w = 0; w < nwords; w++) {
+		__u64 c = sn->cur[w], p = sn->prev[w];
+
+		for (k = 0; k < sn->nlevels; k++) {
+			if (k <= 6) {
+				/* fold each group into its lowest bit */
+				__u64 d, n;
+
+				if (k) {
+					c |= c >> (1 << (k-1));
+					p |= p >> (1 << (k-1));
+				}
+				d = c & advise_group_mask[k];
+				n = d & ~p;
+				dirty[k] += popcount((unsigned char *)&d, 8);
+				set[k] += popcount((unsigned char *)&n, 8);
+			} else {
+				/* a group is several words */
+				gcur[k] |= sn->cur[w];
+				gprev[k] |= sn->prev[w];
+				if ((w + 1) % (1ULL << (k-6)) == 0 ||
+				    w + 1 == nwords) {
+					dirty[k] += gcur[k] != 0;
+					set[k] += gcur[k] && !gprev[k];
+					gcur[k] = gprev[k] = 0;
+				}
+			}
+		}
+	}
+
+	for (k = 0; k < sn->nlevels; k++) {
+		struct advise_level *l = &sn->levels[k];
+
+		if (!first)
+			l->set += set[k];
+		if (dirty[k] > l->dirty_max)
+			l->dirty_max = dirty[k];
+	}
+	t = sn->prev; sn->prev = sn->cur; sn->cur = t;
+	return 0;
+}
+
+/* e^-x for x >= 0, good enough for estimates and without libm */
+static double exp_neg(double x)
+{
+	double r;
+	int halvings = 0;
+
+	while (x > 0.5) {
+		x /= 2;
+		halvings++;
+	}
+	r = 1 - x * (1 - x / 2 * (1 - x / 3 * (1 - x / 4)));
+	while (halvings--)
+		r *= r;
+	return r;
+}
+
+static int md_write_stat(char *mddev, unsigned long long *ios,
+			 unsigned long long *sectors)
+{
+	char path[100], buf[1024];
+	unsigned long long f[7];
+
+	sprintf(path, "/sys/block/%s/stat", mddev);
+	if (load_sys(path, buf) < 0)
+		return -1;
+	if (sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu",
+		   &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]) != 7)
+		return -1;
+	*ios = f[4];
+	*sectors = f[6];
+	return 0;
+}
+
+/* Watch the array on 'fd' for 'secs' seconds and print what each
+ * bitmap chunk size from 'min_chunk' up would cost.  'size' is the
+ * sectors covered by the bitmap and 'delay' its daemon sleep.  If the
+ * array has a bitmap, 'bitmap_dev' names the file or a member device
+ * it can be read from.
+ * Returns the chunk size (in bytes) to use, UnSet if there is nothing
+ * to go on, or -1.
+ */
+int bitmap_advise_chunk(int fd, unsigned long long size,
+			unsigned long min_chunk, int delay, int secs,
+			char *bitmap_dev, int verbose)
+{
+	char *mddev = devnum2devname(fd2devnum(fd));
+	unsigned long long ios0, secs0, ios, sectors;
+	struct advise_snap sn;
+	bitmap_info_t *info = NULL;
+	struct supertype *st = NULL;
+	unsigned long bm_chunk = 0, chunk;
+	long best = 0;
+	double writes, wsize, hold;
+	char path[100], buf[1024];
+	int speed = 0;
+	int i, k;
+
+	if (!mddev || md_write_stat(mddev, &ios0, &secs0) < 0) {
+		fprintf(stderr, Name ": cannot read I/O statistics for array\n");
+		free(mddev);
+		return -1;
+	}
+	sprintf(path, "/sys/block/%s/md/sync_speed_max", mddev);
+	if (load_sys(path, buf) == 0)
+		speed = atoi(buf);
+
+	memset(&sn, 0, sizeof(sn));
+	if (bitmap_dev)
+		info = bitmap_file_read(bitmap_dev, 1, &st, NULL, NULL);
+	if (st)
+		st->ss->free_super(st);
+	if (info && info->sb.magic == BITMAP_MAGIC && info->sb.chunksize &&
+	    info->sb.sync_size) {
+		unsigned long long nbits;
+
+		bm_chunk = info->sb.chunksize;
+		nbits = bitmap_bits(info->sb.sync_size, bm_chunk);
+		for (chunk = bm_chunk; chunk <= BITMAP_ADVISE_MAX_CHUNK; chunk <<= 1)
+			sn.nlevels++;
+		sn.nbits = nbits;
+		sn.levels = calloc(sn.nlevels, sizeof(sn.levels[0]));
+		sn.cur = calloc((nbits + 63) / 64, 8);
+		sn.prev = calloc((nbits + 63) / 64, 8);
+		if (!sn.levels || !sn.cur || !sn.prev ||
+		    advise_snapshot(bitmap_dev, &sn, 1) < 0) {
+			fprintf(stderr, Name ": cannot follow the bitmap, "
+				"estimating from I/O statistics alone\n");
+			bm_chunk = 0;
+		}
+	}
+	free(info);
+
+	if (verbose > 0)
+		fprintf(stderr, Name ": watching /dev/%s for %d seconds...\n",
+			mddev, secs);
+	for (i = 0; i < secs; i++) {
+		sleep(1);
+		if (bm_chunk && advise_snapshot(bitmap_dev, &sn, 0) < 0)
+			bm_chunk = 0;
+	}
+	if (md_write_stat(mddev, &ios, &sectors) < 0) {
+		fprintf(stderr, Name ": cannot read I/O statistics for array\n");
+		best = -1;
+		goto out;
+	}
+	writes = (double)(ios - ios0) / secs;
+	wsize = ios > ios0 ? (double)(sectors - secs0) * 512 / (ios - ios0) : 0;
+	/* A bit is cleared a few daemon passes after its last write */
+	hold = 2.0 * delay;
+
+	printf("%16s : %.0f writes/sec, average %s\n", "Workload",
+	       writes, human_chunksize((unsigned long)wsize));
+	if (ios == ios0) {
+		printf("%16s : none, so no basis for advice\n", "Writes seen");
+		best = UnSet;
+		goto out;
+	}
+	printf("           Chunk   Updates/sec   Overhead   Dirty at once   Resync%s\n",
+	       speed ? "" : " (at 1000K/sec)");
+	for (chunk = min_chunk; chunk <= BITMAP_ADVISE_MAX_CHUNK; chunk <<= 1) {
+		double updates, dirty, overhead;
+		unsigned long long resync;
+		char label[20];
+
+		if (bm_chunk && chunk >= bm_chunk) {
+			struct advise_level *l = &sn.levels[0];
+
+			for (k = 0; bm_chunk << k < chunk; k++)
+				l++;
+			updates = (double)l->set / secs;
+			dirty = (double)l->dirty_max * chunk;
+		} else {
+			double n = (double)size * 512 / chunk;
+			/* a write may span chunks */
+			double k_writes = writes * hold * (1 + wsize / chunk);
+
+			dirty = n * (1 - exp_neg(k_writes / n));
+			updates = dirty / hold;
+			dirty *= chunk;
+		}
+		if (dirty > (double)size * 512)
+			dirty = (double)size * 512;
+		overhead = 100 * updates / writes;
+		resync = (unsigned long long)(dirty / 1024 / (speed ?: 1000));
+		if (!best && overhead <= BITMAP_ADVISE_OVERHEAD)
+			best = chunk;
+		snprintf(label, sizeof(label), "%s", human_chunksize(chunk));
+		printf("%16s   %11.1f   %7.1f%%   %13s   %s\n", label,
+		       updates, overhead,
+		       human_size_brief((long long)dirty), human_secs(resync));
+	}
+	if (!best)
+		best = BITMAP_ADVISE_MAX_CHUNK;
+	printf("%16s : %s (bitmap updates below %d%% of writes)\n",
+	       "Advised chunk", human_chunksize(best), BITMAP_ADVISE_OVERHEAD);
+out:
+	free(sn.cur);
+	free(sn.prev);
+	free(sn.levels);
+	free(mddev);
+	return best;
+}
+
 int CreateBitmap(char *filename, int force, char uuid[16],
 		 unsigned long chunksize, unsigned long daemon_sleep,
 		 unsigned long write_behind,
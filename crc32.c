@@ -52,7 +52,12 @@
 #define Z_NULL ((void*)0)
 #define OF(X) X
 #define ZEXPORT
-typedef long ptrdiff_t;
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+#include <pthread.h>
+#endif
 #define NOBYFOUR
 
 #define local static
@@ -238,6 +243,283 @@ const unsigned long FAR * ZEXPORT get_crc_table(void)
 #define DO1 crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8)
 #define DO8 DO1; DO1; DO1; DO1; DO1; DO1; DO1; DO1
 
+/* =========================================================================
+ * mdadm: crc32() here is the raw shift register update, without zlib's
+ * pre- and post-conditioning, as that is what DDF stores.  The loop a
+ * byte at a time is the reference.  Faster versions are chosen at run
+ * time, and only after they have been seen to agree with it.
+ */
+local unsigned long crc32_bytewise(
+	unsigned long crc,
+	const unsigned char FAR *buf,
+	unsigned len)
+{
+    while (len >= 8) {
+        DO8;
+        len -= 8;
+    }
+    if (len) do {
+        DO1;
+    } while (--len);
+    return crc;
+}
+
+/* =========================================================================
+ * Slicing-by-8: crc_slice[k][n] is the crc of byte n followed by k zero
+ * bytes, so eight bytes take eight independent lookups.
+ */
+local unsigned int crc_slice[8][256];
+
+local void make_slice_table(void)
+{
+    unsigned int c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = crc_table[0][n];
+        crc_slice[0][n] = c;
+        for (k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_slice[k][n] = c;
+        }
+    }
+}
+
+local unsigned long crc32_slice8(
+	unsigned long crc,
+	const unsigned char FAR *buf,
+	unsigned len)
+{
+    unsigned int c = crc;
+
+    while (len >= 8) {
+        unsigned int lo, hi;
+
+        lo = (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+              ((unsigned int)buf[3] << 24)) ^ c;
+        hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
+             ((unsigned int)buf[7] << 24);
+        c = crc_slice[7][lo & 0xff] ^ crc_slice[6][(lo >> 8) & 0xff] ^
+            crc_slice[5][(lo >> 16) & 0xff] ^ crc_slice[4][lo >> 24] ^
+            crc_slice[3][hi & 0xff] ^ crc_slice[2][(hi >> 8) & 0xff] ^
+            crc_slice[1][(hi >> 16) & 0xff] ^ crc_slice[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = crc_slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_X86_PCLMUL
+#include <immintrin.h>
+#include <cpuid.h>
+
+/* =========================================================================
+ * Fold 64 bytes at a time with carry-less multiplies, then 16 at a time,
+ * and finish with a Barrett reduction.  This is the method of Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", with
+ * the constants for the bit-reflected polynomial 0xedb88320 that Linux
+ * uses in crc32-pclmul.  len must be a multiple of 16, and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+local unsigned int crc32_fold(
+	unsigned int crc,
+	const unsigned char FAR *buf,
+	unsigned len)
+{
+    static const unsigned long long k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const unsigned long long k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const unsigned long long k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const unsigned long long poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                  _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                  _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                  _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                  _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* then any remaining 16 byte blocks */
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                  _mm_loadu_si128((const __m128i *)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* and Barrett reduce to 32 */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+local unsigned long crc32_pclmul(
+	unsigned long crc,
+	const unsigned char FAR *buf,
+	unsigned len)
+{
+    if (len >= 64) {
+        unsigned chunk = len & ~15U;
+
+        crc = crc32_fold(crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return crc32_slice8(crc, buf, len);
+}
+
+local int have_pclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif /* HAVE_X86_PCLMUL */
+
+local const struct crc32_call {
+    const char *name;
+    int (*valid)(void);
+    unsigned long (*crc)(unsigned long, const unsigned char FAR *, unsigned);
+} crc32_algos[] = {
+#ifdef HAVE_X86_PCLMUL
+    { "pclmul", have_pclmul, crc32_pclmul },
+#endif
+    { "slice8", NULL, crc32_slice8 },
+    { "table", NULL, crc32_bytewise },
+};
+
+/* Check an implementation against the reference on every length up to
+ * a few folds, at every alignment, and with a non-zero starting crc.
+ */
+local int crc32_selftest(const struct crc32_call *c)
+{
+    unsigned char buf[8 + 320];
+    unsigned int x = 0x12345678;
+    unsigned len, off;
+
+    for (len = 0; len < sizeof(buf); len++) {
+        x = x * 1103515245 + 12345;
+        buf[len] = x >> 16;
+    }
+    for (off = 0; off < 8; off++)
+        for (len = 0; len + off <= sizeof(buf); len++) {
+            unsigned long seed = len * 0x9e3779b9UL & 0xffffffffUL;
+
+            if (c->crc(seed, buf + off, len) !=
+                crc32_bytewise(seed, buf + off, len))
+                return 0;
+        }
+    return 1;
+}
+
+/* As with raid6_select_algo(), $MDADM_CRC32_ALGO can force a choice */
+local const struct crc32_call *crc32_call;
+
+local void crc32_init(void)
+{
+    const char *want;
+    unsigned int i;
+
+    make_slice_table();
+    want = getenv("MDADM_CRC32_ALGO");
+    for (i = 0; i < sizeof(crc32_algos)/sizeof(crc32_algos[0]); i++) {
+        const struct crc32_call *c = &crc32_algos[i];
+        if (want && strcmp(want, c->name) != 0)
+            continue;
+        if (c->valid && !c->valid())
+            continue;
+        if (!crc32_selftest(c))
+            continue;
+        crc32_call = c;
+        break;
+    }
+    if (!crc32_call)
+        crc32_call = &crc32_algos[i-1];
+}
+
+/* crc32() is called from the parallel probe threads, so the first
+ * caller must finish building the tables before anyone uses them.
+ */
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+local pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+local const struct crc32_call *crc32_select(void)
+{
+    pthread_once(&crc32_once, crc32_init);
+    return crc32_call;
+}
+#else
+local const struct crc32_call *crc32_select(void)
+{
+    if (!crc32_call)
+        crc32_init();
+    return crc32_call;
+}
+#endif
+
 /* ========================================================================= */
 unsigned long ZEXPORT crc32(
 	unsigned long crc,
@@ -251,26 +533,7 @@ unsigned long ZEXPORT crc32(
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
-#ifdef BYFOUR
-    if (sizeof(void *) == sizeof(ptrdiff_t)) {
-        u4 endian;
-
-        endian = 1;
-        if (*((unsigned char *)(&endian)))
-            return crc32_little(crc, buf, len);
-        else
-            return crc32_big(crc, buf, len);
-    }
-#endif /* BYFOUR */
-/*    crc = crc ^ 0xffffffffUL;*/
-    while (len >= 8) {
-        DO8;
-        len -= 8;
-    }
-    if (len) do {
-        DO1;
-    } while (--len);
-    return crc /* ^ 0xffffffffUL*/;
+    return crc32_select()->crc(crc, buf, len);
 }
 
 #ifdef BYFOUR
@@ -358,3 +621,64 @@ local unsigned long crc32_big(crc, buf, len)
 }
 
 #endif /* BYFOUR */
+
+#ifdef MAIN
+/* Check every implementation this machine can run against the table
+ * and time them on DDF-sized records.
+ *   test_crc32 [bytes [iterations]]
+ */
+#include <stdio.h>
+#include <sys/time.h>
+
+int main(int argc, char *argv[])
+{
+    unsigned len = argc > 1 ? (unsigned)atoi(argv[1]) : 64 * 1024;
+    int iters = argc > 2 ? atoi(argv[2]) : 1000;
+    unsigned char *buf = malloc(len);
+    unsigned long want = 0;
+    int have_want = 0;
+    unsigned int i;
+    int fail = 0;
+
+    if (!buf)
+        return 1;
+    for (i = 0; i < len; i++)
+        buf[i] = (i * 7 + (i >> 8)) & 0xff;
+    printf("using %s\n", crc32_select()->name);
+
+    for (i = 0; i < sizeof(crc32_algos)/sizeof(crc32_algos[0]); i++) {
+        const struct crc32_call *c = &crc32_algos[i];
+        struct timeval start, end;
+        unsigned long crc = 0;
+        double secs;
+        int n;
+
+        if (c->valid && !c->valid()) {
+            printf("%-8s not supported\n", c->name);
+            continue;
+        }
+        if (!crc32_selftest(c)) {
+            printf("%-8s FAILED self-test\n", c->name);
+            fail = 1;
+            continue;
+        }
+        gettimeofday(&start, NULL);
+        for (n = 0; n < iters; n++)
+            crc = c->crc(crc, buf, len);
+        gettimeofday(&end, NULL);
+        if (!have_want) {
+            want = crc;
+            have_want = 1;
+        } else if (crc != want) {
+            printf("%-8s disagrees: %08lx != %08lx\n", c->name, crc, want);
+            fail = 1;
+        }
+        secs = (end.tv_sec - start.tv_sec) +
+            (end.tv_usec - start.tv_usec) / 1000000.0;
+        printf("%-8s ok  %8.1f MB/s\n", c->name,
+               secs > 0 ? (double)len * iters / secs / 1000000 : 0.0);
+    }
+    free(buf);
+    return fail;
+}
+#endif /* MAIN */
@@ -24,6 +24,7 @@
 
 #include	"mdadm.h"
 #include	<ctype.h>
+#include	<dirent.h>
 
 /* This fill contains various 'library' style function.  They
  * have no dependency on anything outside this file.
@@ -129,15 +130,183 @@ int fd2devnum(int fd)
 
 /*
  * convert a major/minor pair for a block device into a name in /dev, if possible.
- * On the first call, walk /dev collecting name.
- * Put them in a simple linked listfor now.
+ * Names are kept in a hash table indexed by major/minor.  The names for
+ * a device are found when it is first asked for, from the DEVNAME that
+ * the kernel gives in /sys/dev/block/M:m/uevent, the symlinks udev has
+ * recorded for it, and /dev/md/.  Only if none of that finds anything do
+ * we walk all of /dev, and then only once.
  */
 struct devmap {
-    int major, minor;
-    char *name;
-    struct devmap *next;
-} *devlist = NULL;
-int devlist_ready = 0;
+	int major, minor;
+	int filled;		/* sysfs and udev have been checked */
+	struct devname {
+		char *name;
+		struct devname *next;
+	} *names;
+	struct devmap *next;
+};
+static struct devmap **devmap_hash;
+static unsigned int devmap_size, devmap_count;
+static int devmap_walked;
+
+static char *dev_dir = "/dev";
+static char *sys_dev_block = "/sys/dev/block";
+static char *udev_data = "/run/udev/data";
+
+static unsigned int devmap_bucket(int major, int minor, unsigned int size)
+{
+	unsigned int h = ((unsigned)major * 2654435761U) ^ (unsigned)minor;
+
+	h ^= h >> 15;
+	h *= 2246822519U;
+	h ^= h >> 13;
+	return h & (size - 1);
+}
+
+static struct devmap *devmap_find(int major, int minor, int create)
+{
+	struct devmap *dm;
+
+	if (devmap_size) {
+		dm = devmap_hash[devmap_bucket(major, minor, devmap_size)];
+		for (; dm; dm = dm->next)
+			if (dm->major == major && dm->minor == minor)
+				return dm;
+	}
+	if (!create)
+		return NULL;
+
+	if (devmap_count >= devmap_size) {
+		/* grow the table, keeping it no more than full */
+		unsigned int size = devmap_size ? devmap_size * 2 : 256;
+		struct devmap **h = calloc(size, sizeof(*h));
+		unsigned int i;
+		if (!h && !devmap_size)
+			return NULL;
+		for (i = 0; h && i < devmap_size; i++)
+			while (devmap_hash[i]) {
+				unsigned int b;
+				dm = devmap_hash[i];
+				devmap_hash[i] = dm->next;
+				b = devmap_bucket(dm->major, dm->minor, size);
+				dm->next = h[b];
+				h[b] = dm;
+			}
+		if (h) {
+			free(devmap_hash);
+			devmap_hash = h;
+			devmap_size = size;
+		}
+	}
+	dm = calloc(1, sizeof(*dm));
+	if (!dm)
+		return NULL;
+	dm->major = major;
+	dm->minor = minor;
+	dm->next = devmap_hash[devmap_bucket(major, minor, devmap_size)];
+	devmap_hash[devmap_bucket(major, minor, devmap_size)] = dm;
+	devmap_count++;
+	return dm;
+}
+
+static void devmap_add(int major, int minor, const char *name)
+{
+	struct devmap *dm = devmap_find(major, minor, 1);
+	struct devname *dn;
+
+	if (!dm)
+		return;
+	for (dn = dm->names; dn; dn = dn->next)
+		if (strcmp(dn->name, name) == 0)
+			return;
+	dn = malloc(sizeof(*dn));
+	if (!dn)
+		return;
+	dn->name = strdup(name);
+	if (!dn->name) {
+		free(dn);
+		return;
+	}
+	dn->next = dm->names;
+	dm->names = dn;
+}
+
+/* Add 'path' if it is (or links to) block device major:minor.
+ * A major of -1 accepts any block device.
+ */
+static void devmap_check(int major, int minor, const char *path)
+{
+	struct stat stb;
+
+	if (stat(path, &stb) != 0 || !S_ISBLK(stb.st_mode))
+		return;
+	if (major >= 0 && (major(stb.st_rdev) != (unsigned)major ||
+			   minor(stb.st_rdev) != (unsigned)minor))
+		return;
+	devmap_add(major(stb.st_rdev), minor(stb.st_rdev), path);
+}
+
+static void devmap_fill(struct devmap *dm)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX];
+	FILE *f;
+	DIR *dir;
+
+	dm->filled = 1;
+
+	snprintf(path, sizeof(path), "%s/%d:%d/uevent",
+		 sys_dev_block, dm->major, dm->minor);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\n")] = 0;
+			if (strncmp(line, "DEVNAME=", 8) != 0)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s",
+				 dev_dir, line+8);
+			devmap_check(dm->major, dm->minor, path);
+		}
+		fclose(f);
+	}
+
+	/* udev records the symlinks it made as "S:" lines */
+	snprintf(path, sizeof(path), "%s/b%d:%d",
+		 udev_data, dm->major, dm->minor);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\n")] = 0;
+			if (strncmp(line, "S:", 2) != 0 &&
+			    strncmp(line, "N:", 2) != 0)
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s",
+				     dev_dir, line+2) >= (int)sizeof(path))
+				continue;
+			devmap_check(dm->major, dm->minor, path);
+		}
+		fclose(f);
+	}
+
+	/* Without udev, names in /dev/md/ were made by us and
+	 * are not recorded anywhere else.
+	 */
+	if (dm->major != MD_MAJOR && dm->major != get_mdp_major())
+		return;
+	snprintf(path, sizeof(path), "%s/md", dev_dir);
+	dir = opendir(path);
+	if (dir) {
+		struct dirent *de;
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/md/%s",
+				 dev_dir, de->d_name);
+			devmap_check(-1, -1, path);
+		}
+		closedir(dir);
+	}
+}
 
 int add_dev(const char *name, const struct stat *stb, int flag, struct FTW *s)
 {
@@ -151,16 +320,12 @@ int add_dev(const char *name, const struct stat *stb, int flag, struct FTW *s)
 
 	if ((stb->st_mode&S_IFMT)== S_IFBLK) {
 		char *n = strdup(name);
-		struct devmap *dm = malloc(sizeof(*dm));
+		if (!n)
+			return 0;
 		if (strncmp(n, "/dev/./", 7)==0)
 			strcpy(n+4, name+6);
-		if (dm) {
-			dm->major = major(stb->st_rdev);
-			dm->minor = minor(stb->st_rdev);
-			dm->name = n;
-			dm->next = devlist;
-			devlist = dm;
-		}
+		devmap_add(major(stb->st_rdev), minor(stb->st_rdev), n);
+		free(n);
 	}
 	return 0;
 }
@@ -183,6 +348,21 @@ int nftw(const char *path, int (*han)(const char *name, const struct stat *stb,
 #endif /* HAVE_FTW */
 #endif /* HAVE_NFTW */
 
+static void devmap_walk(void)
+{
+	char *dev = dev_dir;
+	char dot[PATH_MAX];
+	struct stat stb;
+
+	if (lstat(dev, &stb)==0 &&
+	    S_ISLNK(stb.st_mode)) {
+		snprintf(dot, sizeof(dot), "%s/.", dev_dir);
+		dev = dot;
+	}
+	nftw(dev, add_dev, 10, FTW_PHYS);
+	devmap_walked = 1;
+}
+
 /*
  * Find a block device with the right major/minor number.
  * If we find multiple names, choose the shortest.
@@ -191,63 +371,67 @@ int nftw(const char *path, int (*han)(const char *name, const struct stat *stb,
  * If 'prefer' is set (normally to e.g. /by-path/)
  * then we prefer a name which contains that string.
  */
+static char *devmap_choose(struct devmap *dm, char *prefer)
+{
+	struct devname *p;
+	char *regular = NULL, *preferred=NULL;
+	int md_len = strlen(dev_dir);
+
+	for (p = dm->names; p; p=p->next) {
+		if ((strncmp(p->name, dev_dir, md_len) == 0 &&
+		     strncmp(p->name + md_len, "/md/", 4) == 0)
+		    || (prefer && strstr(p->name, prefer))) {
+			if (preferred == NULL ||
+			    strlen(p->name) < strlen(preferred))
+				preferred = p->name;
+		} else {
+			if (regular == NULL ||
+			    strlen(p->name) < strlen(regular))
+				regular = p->name;
+		}
+	}
+	return preferred ? preferred : regular;
+}
+
 char *map_dev_preferred(int major, int minor, int create,
 			char *prefer)
 {
-	struct devmap *p;
-	char *regular = NULL, *preferred=NULL;
-	int did_check = 0;
+	struct devmap *dm;
+	char *name = NULL;
+	int fresh = 0;
 
 	if (major == 0 && minor == 0)
 			return NULL;
 
- retry:
-	if (!devlist_ready) {
-		char *dev = "/dev";
-		struct stat stb;
-		while(devlist) {
-			struct devmap *d = devlist;
-			devlist = d->next;
-			free(d->name);
-			free(d);
+	dm = devmap_find(major, minor, 1);
+	if (dm) {
+		if (!dm->filled) {
+			devmap_fill(dm);
+			fresh = 1;
 		}
-		if (lstat(dev, &stb)==0 &&
-		    S_ISLNK(stb.st_mode))
-			dev = "/dev/.";
-		nftw(dev, add_dev, 10, FTW_PHYS);
-		devlist_ready=1;
-		did_check = 1;
-	}
-
-	for (p=devlist; p; p=p->next)
-		if (p->major == major &&
-		    p->minor == minor) {
-			if (strncmp(p->name, "/dev/md/",8) == 0
-			    || (prefer && strstr(p->name, prefer))) {
-				if (preferred == NULL ||
-				    strlen(p->name) < strlen(preferred))
-					preferred = p->name;
-			} else {
-				if (regular == NULL ||
-				    strlen(p->name) < strlen(regular))
-					regular = p->name;
-			}
+		name = devmap_choose(dm, prefer);
+		if (!name && !fresh) {
+			/* The device node may have appeared since we
+			 * last looked.
+			 */
+			devmap_fill(dm);
+			name = devmap_choose(dm, prefer);
+		}
+		if (!name && !devmap_walked) {
+			/* Last resort: look everywhere in /dev */
+			devmap_walk();
+			name = devmap_choose(dm, prefer);
 		}
-	if (!regular && !preferred && !did_check) {
-		devlist_ready = 0;
-		goto retry;
 	}
-	if (create && !regular && !preferred) {
+	if (create && !name) {
 		static char buf[30];
 		snprintf(buf, sizeof(buf), "%d:%d", major, minor);
-		regular = buf;
+		name = buf;
 	}
 
-	return preferred ? preferred : regular;
+	return name;
 }
 
-
-
 /* conf_word gets one word from the conf file.
  * if "allow_key", then accept words at the start of a line,
  * otherwise stop when such a word is found.
@@ -393,3 +577,164 @@ void print_escape(char *str)
 		}
 	}
 }
+
+#ifdef MAIN
+/* Benchmark for map_dev_preferred(): build a fake /dev with 'nodes'
+ * device nodes and symlinks, and matching sysfs and udev entries, then
+ * time a walk of it against lookups through sysfs and udev.
+ * Needs to be able to mknod, so normally run as root.
+ *   test_devmap [nodes]
+ */
+static void devmap_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < devmap_size; i++)
+		while (devmap_hash[i]) {
+			struct devmap *dm = devmap_hash[i];
+			devmap_hash[i] = dm->next;
+			while (dm->names) {
+				struct devname *dn = dm->names;
+				dm->names = dn->next;
+				free(dn->name);
+				free(dn);
+			}
+			free(dm);
+		}
+	devmap_count = 0;
+	devmap_walked = 0;
+}
+
+static void put_file(char *path, char *text)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f) {
+		fputs(text, f);
+		fclose(f);
+	}
+}
+
+static double now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+#define BENCH_MAJOR 240
+/* each device has a node and this many links */
+#define BENCH_LINKS 4
+
+int main(int argc, char *argv[])
+{
+	static char *linkdirs[BENCH_LINKS] = {
+		"disk/by-id", "disk/by-path", "disk/by-uuid", "disk/by-partuuid"
+	};
+	char root[] = "/tmp/devmap.XXXXXX";
+	char path[PATH_MAX], target[PATH_MAX], text[1024];
+	int nodes = argc > 1 ? atoi(argv[1]) : 50000;
+	int devs = nodes / (BENCH_LINKS + 1);
+	char *devroot, *sysroot, *udevroot;
+	char **walked;
+	double t;
+	int i, l, bad = 0;
+
+	if (devs < 1 || !mkdtemp(root)) {
+		fprintf(stderr, "usage: test_devmap [nodes]\n");
+		return 1;
+	}
+	devroot = malloc(strlen(root) + 20);
+	sysroot = malloc(strlen(root) + 20);
+	udevroot = malloc(strlen(root) + 20);
+	sprintf(devroot, "%s/dev", root);
+	sprintf(sysroot, "%s/sys", root);
+	sprintf(udevroot, "%s/udev", root);
+	mkdir(devroot, 0755);
+	mkdir(sysroot, 0755);
+	mkdir(udevroot, 0755);
+	sprintf(path, "%s/bench", devroot);
+	mkdir(path, 0755);
+	sprintf(path, "%s/disk", devroot);
+	mkdir(path, 0755);
+	for (l = 0; l < BENCH_LINKS; l++) {
+		sprintf(path, "%s/%s", devroot, linkdirs[l]);
+		mkdir(path, 0755);
+	}
+
+	printf("creating %d devices with %d names each...\n",
+	       devs, BENCH_LINKS + 1);
+	for (i = 0; i < devs; i++) {
+		int len;
+		sprintf(path, "%s/bench/d%d", devroot, i);
+		if (mknod(path, S_IFBLK|0600, makedev(BENCH_MAJOR, i)) != 0) {
+			perror("mknod");
+			return 1;
+		}
+		len = 0;
+		for (l = 0; l < BENCH_LINKS; l++) {
+			sprintf(path, "%s/%s/bench-device-%08d",
+				devroot, linkdirs[l], i);
+			sprintf(target, "../../bench/d%d", i);
+			if (symlink(target, path) != 0) {
+				perror("symlink");
+				return 1;
+			}
+			len += sprintf(text + len, "S:%s/bench-device-%08d\n",
+				       linkdirs[l], i);
+		}
+		sprintf(path, "%s/b%d:%d", udevroot, BENCH_MAJOR, i);
+		put_file(path, text);
+		sprintf(path, "%s/%d:%d", sysroot, BENCH_MAJOR, i);
+		mkdir(path, 0755);
+		sprintf(path, "%s/%d:%d/uevent", sysroot, BENCH_MAJOR, i);
+		sprintf(text, "MAJOR=%d\nMINOR=%d\nDEVNAME=bench/d%d\n",
+			BENCH_MAJOR, i, i);
+		put_file(path, text);
+	}
+	dev_dir = devroot;
+	sys_dev_block = sysroot;
+	udev_data = udevroot;
+
+	/* What we used to do on the first lookup, and on every miss */
+	t = now_us();
+	devmap_walk();
+	printf("walk of %d nodes:           %10.0f us\n",
+	       devs * (BENCH_LINKS + 1), now_us() - t);
+	walked = malloc(devs * sizeof(char*));
+	for (i = 0; i < devs; i++) {
+		char *n = map_dev(BENCH_MAJOR, i, 0);
+		walked[i] = n ? strdup(n) : NULL;
+	}
+	devmap_clear();
+
+	t = now_us();
+	for (i = 0; i < devs; i++) {
+		char *n = map_dev(BENCH_MAJOR, i, 0);
+		if (!n || !walked[i] || strcmp(n, walked[i]) != 0)
+			bad++;
+	}
+	printf("first lookup of each device: %8.2f us/lookup\n",
+	       (now_us() - t) / devs);
+	t = now_us();
+	for (i = 0; i < devs; i++)
+		map_dev(BENCH_MAJOR, i, 0);
+	printf("repeated lookup:             %8.2f us/lookup\n",
+	       (now_us() - t) / devs);
+	t = now_us();
+	map_dev(BENCH_MAJOR, devs + 1, 0);
+	printf("lookup of a missing device:  %8.2f us (walked /dev: %s)\n",
+	       now_us() - t, devmap_walked ? "yes" : "no");
+	t = now_us();
+	map_dev(BENCH_MAJOR, devs + 1, 0);
+	printf("and again:                   %8.2f us\n", now_us() - t);
+	if (bad)
+		printf("%d lookups disagreed with the walk\n", bad);
+
+	snprintf(text, sizeof(text), "rm -rf %s", root);
+	if (system(text) != 0)
+		fprintf(stderr, "could not remove %s\n", root);
+	return bad != 0;
+}
+#endif /* MAIN */
@@ -242,6 +242,11 @@ void check_update_queue(struct supertype *container)
 
 	if (update_queue == NULL &&
 	    update_queue_pending) {
+		/* The monitor is done with the last batch, so the list
+		 * of disks holds still until this one goes over.
+		 */
+		if (container->ss->prepare_sync)
+			container->ss->prepare_sync(container);
 		update_queue = update_queue_pending;
 		update_queue_pending = NULL;
 		wakeup_monitor();
@@ -421,6 +426,7 @@ static int disk_init_and_add(struct mdinfo *disk, struct mdinfo *clone,
 		close(disk->recovery_fd);
 		return -1;
 	}
+	monitor_watch(disk->state_fd, aa->devnum);
 	disk->prev_state = read_dev_state(disk->state_fd);
 	disk->curr_state = disk->prev_state;
 	disk->next = aa->info.devs;
@@ -692,6 +698,9 @@ static void manage_new(struct mdstat_ent *mdstat,
 	new->resync_start_fd = sysfs_open(new->devnum, NULL, "resync_start");
 	new->metadata_fd = sysfs_open(new->devnum, NULL, "metadata_version");
 	new->sync_completed_fd = sysfs_open(new->devnum, NULL, "sync_completed");
+	monitor_watch(new->action_fd, new->devnum);
+	monitor_watch(new->info.state_fd, new->devnum);
+	monitor_watch(new->sync_completed_fd, new->devnum);
 	dprintf("%s: inst: %d action: %d state: %d\n", __func__, atoi(inst),
 		new->action_fd, new->info.state_fd);
 
@@ -783,9 +792,9 @@ static void handle_message(struct supertype *container, struct metadata_update *
 		
 		cnt = monitor_loop_cnt;
 		if (cnt & 1)
-			cnt += 2; /* wait until next pselect */
+			cnt += 2; /* wait until next sleep */
 		else
-			cnt += 3; /* wait for 2 pselects */
+			cnt += 3; /* wait for 2 sleeps */
 		wakeup_monitor();
 
 		while (monitor_loop_cnt - cnt < 0)
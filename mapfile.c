@@ -41,6 +41,31 @@
  * The best place for the mapfile is /run/mdadm/map.  Distros and users
  * which have not switched to /run yet can choose a different location
  * at compile time via MAP_DIR and MAP_FILE.
+ *
+ * The text file is no longer what we work from though.  With many
+ * arrays appearing at once, every "mdadm -I" parsing the whole file
+ * and writing it all back under the lock serialises them badly.  So
+ * the real map is MAP_FILE.idx, which has
+ *  - a header with the table size and a generation number,
+ *  - a table of 32bit record references hashed by uuid,
+ *  - a table of record references hashed by name (the path under
+ *    /dev/md/, if any),
+ *  - a table of fixed-size records hashed by devnum,
+ * and a change is a pwrite of one record and a reference or two.  All
+ * the tables use linear probing with tombstones, and are rebuilt (under
+ * the lock, via rename) at double the size when half full.
+ *
+ * The text file is still written for anything else that reads it -
+ * including an older mdadm in an initramfs - but only once, as the
+ * process that changed the index exits, and only by one process at a
+ * time.  Its first line is a comment, which the old parser skips,
+ * marking it as an export.  If we find a text file without that
+ * mark, someone else wrote it and it is imported in place of the index.
+ *
+ * A list from map_read() is complete and map_by_* search it.  Given
+ * an empty list, map_by_* look the answer up in the index and add just
+ * that entry to the list, marked 'indexed' so that later calls know
+ * the list is partial and keep using the index.
  */
 #include	"mdadm.h"
 #include	<sys/file.h>
@@ -51,17 +76,27 @@
 #define MAP_NEW 1
 #define MAP_LOCK 2
 #define MAP_DIRNAME 3
+#define MAP_INDEX 4
+#define MAP_INDEX_NEW 5
+#define MAP_EXPORT 6
+#define MAP_EXPORT_LOCK 7
 
-char *mapname[4] = {
+char *mapname[8] = {
 	MAP_DIR "/" MAP_FILE,
 	MAP_DIR "/" MAP_FILE ".new",
 	MAP_DIR "/" MAP_FILE ".lock",
-	MAP_DIR
+	MAP_DIR,
+	MAP_DIR "/" MAP_FILE ".idx",
+	MAP_DIR "/" MAP_FILE ".idx.new",
+	MAP_DIR "/" MAP_FILE ".export",
+	MAP_DIR "/" MAP_FILE ".export.lock",
 };
 
 int mapmode[3] = { O_RDONLY, O_RDWR|O_CREAT, O_RDWR|O_CREAT|O_TRUNC };
 char *mapsmode[3] = { "r", "w", "w"};
 
+#define MAP_EXPORT_MARK "# mdadm map export - see " MAP_FILE ".idx\n"
+
 FILE *open_map(int modenum)
 {
 	int fd;
@@ -76,15 +111,170 @@ FILE *open_map(int modenum)
 	return NULL;
 }
 
-int map_write(struct map_ent *mel)
+unsigned long crc32(
+	unsigned long crc,
+	const unsigned char *buf,
+	unsigned len);
+
+#define MAP_IDX_MAGIC "mdmapidx"
+#define MAP_IDX_MIN 64
+
+struct map_idx_head {
+	char	magic[8];
+	__u32	version;
+	__u32	slots;		/* power of 2, in each table */
+	__u32	used;		/* live records */
+	__u32	filled;		/* live or deleted records */
+	__u64	generation;	/* bumped by every change */
+	char	pad[512-32];
+};
+
+#define REC_EMPTY	0
+#define REC_USED	1
+#define REC_DELETED	2
+/* uuid and name references: 0 is empty, ~0 a tombstone, else slot+1 */
+#define REF_TOMB	0xffffffffU
+#define REFS_UUID	0
+#define REFS_NAME	1
+
+struct map_rec {
+	__u32	state;
+	__s32	devnum;
+	int	uuid[4];
+	char	metadata[20];
+	char	path[200];
+	__u32	members;
+	__u32	csum;
+};
+
+static FILE *lf = NULL;
+
+static unsigned long long refs_size(struct map_idx_head *h)
+{
+	return ROUND_UP(h->slots * 4, 512);
+}
+
+static unsigned long long ref_offset(struct map_idx_head *h, int table,
+				     unsigned int i)
+{
+	return sizeof(*h) + table * refs_size(h) + i * 4;
+}
+
+static unsigned long long rec_offset(struct map_idx_head *h, unsigned int slot)
+{
+	return sizeof(*h) + 2 * refs_size(h) +
+		(unsigned long long)slot * sizeof(struct map_rec);
+}
+
+static unsigned int devnum_hash(int devnum)
+{
+	return (unsigned int)devnum * 2654435761U;
+}
+
+static unsigned int uuid_hash(int uuid[4])
+{
+	unsigned int h = uuid[0] ^ (uuid[1] * 31) ^ (uuid[2] * 961) ^ uuid[3];
+
+	return h * 2654435761U;
+}
+
+static unsigned int name_hash(char *name)
+{
+	return crc32(0, (unsigned char *)name, strlen(name)) * 2654435761U;
+}
+
+/* The name map_by_name() knows a record by, or NULL */
+static char *rec_name(struct map_rec *r)
+{
+	r->path[sizeof(r->path)-1] = 0;
+	if (strncmp(r->path, "/dev/md/", 8) != 0)
+		return NULL;
+	return r->path + 8;
+}
+
+static __u32 rec_csum(struct map_rec *r)
+{
+	return crc32(0, (unsigned char *)r, offsetof(struct map_rec, csum));
+}
+
+static int rec_read(int fd, struct map_idx_head *h, unsigned int slot,
+		    struct map_rec *r)
+{
+	int tries;
+
+	/* A reader without the lock may catch a record mid-update */
+	for (tries = 0; tries < 3; tries++) {
+		if (pread(fd, r, sizeof(*r), rec_offset(h, slot)) != sizeof(*r))
+			return -1;
+		if (r->state == REC_EMPTY || r->csum == rec_csum(r))
+			return 0;
+	}
+	return -1;
+}
+
+static int rec_write(int fd, struct map_idx_head *h, unsigned int slot,
+		     struct map_rec *r)
+{
+	r->csum = rec_csum(r);
+	if (pwrite(fd, r, sizeof(*r), rec_offset(h, slot)) != sizeof(*r))
+		return -1;
+	return 0;
+}
+
+static int ref_read(int fd, struct map_idx_head *h, int table,
+		    unsigned int i, __u32 *ref)
+{
+	if (pread(fd, ref, 4, ref_offset(h, table, i)) != 4)
+		return -1;
+	return 0;
+}
+
+static int ref_write(int fd, struct map_idx_head *h, int table,
+		     unsigned int i, __u32 ref)
+{
+	if (pwrite(fd, &ref, 4, ref_offset(h, table, i)) != 4)
+		return -1;
+	return 0;
+}
+
+static void rec_to_ent(struct map_rec *r, struct map_ent *me)
+{
+	me->devnum = r->devnum;
+	memcpy(me->metadata, r->metadata, sizeof(me->metadata));
+	me->metadata[sizeof(me->metadata)-1] = 0;
+	memcpy(me->uuid, r->uuid, 16);
+	r->path[sizeof(r->path)-1] = 0;
+	me->path = r->path[0] ? strdup(r->path) : NULL;
+	me->bad = 0;
+	me->indexed = 0;
+	me->members = r->members;
+}
+
+static void ent_to_rec(struct map_ent *me, struct map_rec *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->state = REC_USED;
+	r->devnum = me->devnum;
+	snprintf(r->metadata, sizeof(r->metadata), "%s", me->metadata);
+	memcpy(r->uuid, me->uuid, 16);
+	if (me->path)
+		strncpy(r->path, me->path, sizeof(r->path)-1);
+	r->members = me->members;
+}
+
+/* Write the text layout for anyone else reading it */
+static int map_write_text(struct map_ent *mel, char *name, int marked)
 {
 	FILE *f;
 	int err;
 
-	f = open_map(MAP_NEW);
-
+	(void)mkdir(mapname[MAP_DIRNAME], 0755);
+	f = fopen(name, "w");
 	if (!f)
 		return 0;
+	fchmod(fileno(f), 0600);
+	if (marked)
+		fputs(MAP_EXPORT_MARK, f);
 	for (; mel; mel = mel->next) {
 		if (mel->bad)
 			continue;
@@ -101,15 +291,338 @@ int map_write(struct map_ent *mel)
 	err = ferror(f);
 	fclose(f);
 	if (err) {
-		unlink(mapname[1]);
+		unlink(name);
 		return 0;
 	}
-	return rename(mapname[1],
-		      mapname[0]) == 0;
+	return 1;
 }
 
+static void map_read_text(struct map_ent **melp, FILE *f)
+{
+	char buf[8192];
+	char path[201];
+	int devnum, uuid[4];
+	char metadata[30];
+	char nam[4];
+
+	while (fgets(buf, sizeof(buf), f)) {
+		path[0] = 0;
+		if (sscanf(buf, " %3[mdp]%d %s %x:%x:%x:%x %200s",
+			   nam, &devnum, metadata, uuid, uuid+1,
+			   uuid+2, uuid+3, path) >= 7) {
+			if (strncmp(nam, "md", 2) != 0)
+				continue;
+			if (nam[2] == 'p')
+				devnum = -1 - devnum;
+			map_add(melp, devnum, metadata, uuid, path);
+		}
+	}
+}
+
+/* Replace the index with one holding exactly 'mel' */
+static int map_idx_build(struct map_ent *mel)
+{
+	struct map_idx_head h;
+	struct map_ent *me;
+	struct map_rec *recs;
+	__u32 *refs;
+	unsigned int n = 0, i;
+	unsigned long long refsize;
+	int fd, ok;
+
+	for (me = mel; me; me = me->next)
+		if (!me->bad)
+			n++;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAP_IDX_MAGIC, 8);
+	h.version = 2;
+	h.slots = MAP_IDX_MIN;
+	while (h.slots < n * 4)
+		h.slots *= 2;
+	h.used = h.filled = n;
+	h.generation = time(0);
+	refsize = refs_size(&h);
+
+	/* the uuid references, then the name references */
+	refs = calloc(2, refsize);
+	recs = calloc(h.slots, sizeof(*recs));
+	if (!refs || !recs) {
+		free(refs);
+		free(recs);
+		return 0;
+	}
+	for (me = mel; me; me = me->next) {
+		unsigned int s, u;
+		__u32 *names = refs + refsize / 4;
+		char *name;
+
+		if (me->bad)
+			continue;
+		for (s = devnum_hash(me->devnum) & (h.slots-1);
+		     recs[s].state != REC_EMPTY;
+		     s = (s+1) & (h.slots-1))
+			;
+		ent_to_rec(me, &recs[s]);
+		recs[s].csum = rec_csum(&recs[s]);
+		for (u = uuid_hash(me->uuid) & (h.slots-1);
+		     refs[u];
+		     u = (u+1) & (h.slots-1))
+			;
+		refs[u] = s + 1;
+		name = rec_name(&recs[s]);
+		if (!name)
+			continue;
+		for (u = name_hash(name) & (h.slots-1);
+		     names[u];
+		     u = (u+1) & (h.slots-1))
+			;
+		names[u] = s + 1;
+	}
+
+	(void)mkdir(mapname[MAP_DIRNAME], 0755);
+	fd = open(mapname[MAP_INDEX_NEW], O_RDWR|O_CREAT|O_TRUNC, 0600);
+	ok = fd >= 0 &&
+		write(fd, &h, sizeof(h)) == sizeof(h) &&
+		write(fd, refs, 2 * refsize) == (ssize_t)(2 * refsize);
+	for (i = 0; ok && i < h.slots; i += 256) {
+		unsigned int cnt = h.slots - i < 256 ? h.slots - i : 256;
+		ssize_t len = cnt * sizeof(*recs);
+
+		ok = write(fd, recs + i, len) == len;
+	}
+	if (fd >= 0)
+		close(fd);
+	free(refs);
+	free(recs);
+	if (!ok || rename(mapname[MAP_INDEX_NEW], mapname[MAP_INDEX]) != 0) {
+		unlink(mapname[MAP_INDEX_NEW]);
+		return 0;
+	}
+	return 1;
+}
+
+static int map_idx_read_all(int fd, struct map_idx_head *h,
+			    struct map_ent **melp)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->slots; i++) {
+		struct map_rec r;
+
+		if (rec_read(fd, h, i, &r) < 0)
+			return -1;
+		if (r.state != REC_USED)
+			continue;
+		map_add(melp, r.devnum, "", r.uuid, NULL);
+		rec_to_ent(&r, *melp);
+	}
+	return 0;
+}
+
+/* Was the text file written by someone other than us? */
+static FILE *map_text_foreign(void)
+{
+	FILE *f = open_map(MAP_READ);
+	char buf[sizeof(MAP_EXPORT_MARK)];
+
+	if (!f)
+		return NULL;
+	if (fgets(buf, sizeof(buf), f) &&
+	    strcmp(buf, MAP_EXPORT_MARK) == 0) {
+		fclose(f);
+		return NULL;
+	}
+	rewind(f);
+	return f;
+}
+
+static int map_idx_head(int fd, struct map_idx_head *h)
+{
+	if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+	    memcmp(h->magic, MAP_IDX_MAGIC, 8) != 0 ||
+	    h->version != 2 ||
+	    h->slots < MAP_IDX_MIN || (h->slots & (h->slots-1)))
+		return -1;
+	return 0;
+}
+
+/* Open the index, creating it from the text map (or by RebuildMap) if
+ * need be.  Returns an fd and fills in 'h', or -1.
+ */
+static int rebuilding;
+
+static int map_idx_open(int flags, struct map_idx_head *h)
+{
+	int fd;
+	FILE *f;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		f = map_text_foreign();
+		if (!f) {
+			fd = open(mapname[MAP_INDEX], flags);
+			if (fd >= 0 && map_idx_head(fd, h) == 0)
+				return fd;
+			if (fd >= 0)
+				close(fd);
+			if (access(mapname[MAP_READ], F_OK) != 0) {
+				if (tries || rebuilding)
+					return -1;
+				RebuildMap(1);
+				continue;
+			}
+			/* Our own export but no index: rebuild from it */
+			f = open_map(MAP_READ);
+			if (!f)
+				return -1;
+		}
+		/* Import the text file, under the lock */
+		if (lf == NULL) {
+			struct map_ent *map = NULL;
+
+			fclose(f);
+			if (map_lock(&map) == 0) {
+				fd = map_idx_open(flags, h);
+				map_unlock(&map);
+				return fd;
+			}
+			return -1;
+		} else {
+			struct map_ent *map = NULL;
+
+			map_read_text(&map, f);
+			fclose(f);
+			map_idx_build(map);
+			map_write_text(map, mapname[MAP_NEW], 1);
+			rename(mapname[MAP_NEW], mapname[MAP_READ]);
+			map_free(map);
+		}
+	}
+	return -1;
+}
+
+/* Write the text map from the index as it is now.  Returns 1 and the
+ * generation exported, or 0 if there is nothing more to be done.
+ */
+static int map_export_once(__u64 *gen)
+{
+	struct map_idx_head h, h2;
+	struct map_ent *map;
+	int fd;
+	int tries;
+	int rv = 0;
+
+	fd = open(mapname[MAP_INDEX], O_RDONLY);
+	for (tries = 0; fd >= 0 && tries < 5; tries++) {
+		FILE *f;
+
+		if (map_idx_head(fd, &h) < 0)
+			break;
+		map = NULL;
+		if (map_idx_read_all(fd, &h, &map) < 0) {
+			map_free(map);
+			continue;
+		}
+		map_write_text(map, mapname[MAP_EXPORT], 1);
+		map_free(map);
+		if (map_idx_head(fd, &h2) < 0 ||
+		    h2.generation != h.generation) {
+			unlink(mapname[MAP_EXPORT]);
+			continue;
+		}
+		/* Don't overwrite a text map someone else just wrote.
+		 * It will be imported the next time the index is opened.
+		 */
+		f = map_text_foreign();
+		if (f) {
+			fclose(f);
+			unlink(mapname[MAP_EXPORT]);
+			break;
+		}
+		if (rename(mapname[MAP_EXPORT], mapname[MAP_READ]) == 0) {
+			*gen = h.generation;
+			rv = 1;
+		}
+		break;
+	}
+	if (fd >= 0)
+		close(fd);
+	return rv;
+}
+
+/* Bring the text map up to date with the index.  Only one process
+ * exports at a time, and anyone who finds an export under way leaves
+ * it to that one: having dropped the export lock, it checks the index
+ * generation again and goes round once more if anything changed.
+ */
+static void map_export(void)
+{
+	struct map_idx_head h;
+	__u64 gen;
+	int efd, fd;
+
+	efd = open(mapname[MAP_EXPORT_LOCK], O_RDWR|O_CREAT, 0600);
+	if (efd < 0)
+		return;
+	while (flock(efd, LOCK_EX|LOCK_NB) == 0) {
+		int done = !map_export_once(&gen);
+
+		flock(efd, LOCK_UN);
+		if (done)
+			break;
+		fd = open(mapname[MAP_INDEX], O_RDONLY);
+		if (fd < 0)
+			break;
+		done = map_idx_head(fd, &h) < 0 || h.generation == gen;
+		close(fd);
+		if (done)
+			break;
+	}
+	close(efd);
+}
+
+/* The index has changed, so the text map needs exporting.  That is
+ * left until we exit, so that however many changes a process makes it
+ * only rewrites the text once, and never while holding the map lock.
+ */
+static int map_dirty;
+
+static void map_export_at_exit(void)
+{
+	if (map_dirty) {
+		map_dirty = 0;
+		map_export();
+	}
+}
+
+static void map_set_dirty(void)
+{
+	static int registered;
+
+	if (!registered && atexit(map_export_at_exit) == 0)
+		registered = 1;
+	map_dirty = 1;
+}
+
+int map_write(struct map_ent *mel)
+{
+	struct map_ent *map = NULL;
+	int locked = 0;
+	int rv;
+
+	if (lf == NULL) {
+		if (map_lock(&map) != 0)
+			return 0;
+		locked = 1;
+	}
+	rv = map_idx_build(mel) &&
+		map_write_text(mel, mapname[MAP_NEW], 1) &&
+		rename(mapname[MAP_NEW], mapname[MAP_READ]) == 0;
+	if (locked)
+		map_unlock(&map);
+	return rv;
+}
 
-static FILE *lf = NULL;
 int map_lock(struct map_ent **melp)
 {
 	while (lf == NULL) {
@@ -132,9 +645,12 @@ int map_lock(struct map_ent **melp)
 			lf = NULL;
 		}
 	}
+	/* Nothing is read here: lookups go to the index as needed,
+	 * and anyone who wants the whole list calls map_read().
+	 */
 	if (*melp)
 		map_free(*melp);
-	map_read(melp);
+	*melp = NULL;
 	return 0;
 }
 
@@ -161,6 +677,7 @@ void map_fork(void)
 		fclose(lf);
 		lf = NULL;
 	}
+	map_dirty = 0;
 }
 
 void map_add(struct map_ent **melp,
@@ -174,41 +691,34 @@ void map_add(struct map_ent **melp,
 	me->path = path ? strdup(path) : NULL;
 	me->next = *melp;
 	me->bad = 0;
+	me->indexed = 0;
+	me->members = 0;
 	*melp = me;
 }
 
 void map_read(struct map_ent **melp)
 {
-	FILE *f;
-	char buf[8192];
-	char path[200];
-	int devnum, uuid[4];
-	char metadata[30];
-	char nam[4];
+	struct map_idx_head h;
+	int fd;
 
 	*melp = NULL;
 
-	f = open_map(MAP_READ);
-	if (!f) {
-		RebuildMap();
-		f = open_map(MAP_READ);
-	}
-	if (!f)
-		return;
+	fd = map_idx_open(O_RDONLY, &h);
+	if (fd < 0) {
+		/* No index and can't make one - maybe the text is readable */
+		FILE *f = open_map(MAP_READ);
 
-	while (fgets(buf, sizeof(buf), f)) {
-		path[0] = 0;
-		if (sscanf(buf, " %3[mdp]%d %s %x:%x:%x:%x %200s",
-			   nam, &devnum, metadata, uuid, uuid+1,
-			   uuid+2, uuid+3, path) >= 7) {
-			if (strncmp(nam, "md", 2) != 0)
-				continue;
-			if (nam[2] == 'p')
-				devnum = -1 - devnum;
-			map_add(melp, devnum, metadata, uuid, path);
+		if (f) {
+			map_read_text(melp, f);
+			fclose(f);
 		}
+		return;
 	}
-	fclose(f);
+	if (map_idx_read_all(fd, &h, melp) < 0) {
+		map_free(*melp);
+		*melp = NULL;
+	}
+	close(fd);
 }
 
 void map_free(struct map_ent *map)
@@ -221,32 +731,198 @@ void map_free(struct map_ent *map)
 	}
 }
 
+/* Find the record for 'devnum'.  Returns its slot, or -1 and sets
+ * *freep to the first reusable slot seen (or -1 if the table is full).
+ */
+static int idx_find_devnum(int fd, struct map_idx_head *h, int devnum,
+			   struct map_rec *r, int *freep)
+{
+	unsigned int s = devnum_hash(devnum) & (h->slots-1);
+	unsigned int n;
+
+	if (freep)
+		*freep = -1;
+	for (n = 0; n < h->slots; n++, s = (s+1) & (h->slots-1)) {
+		if (rec_read(fd, h, s, r) < 0)
+			continue;
+		if (r->state == REC_USED && r->devnum == devnum)
+			return s;
+		if (r->state != REC_USED && freep && *freep < 0)
+			*freep = s;
+		if (r->state == REC_EMPTY)
+			break;
+	}
+	return -1;
+}
+
+/* Add a reference to 'slot' in 'table', where it hashes to 'hash' */
+static int idx_ref_add(int fd, struct map_idx_head *h, int table,
+		       unsigned int hash, unsigned int slot)
+{
+	unsigned int u = hash & (h->slots-1);
+	unsigned int n;
+	__u32 ref;
+
+	for (n = 0; n < h->slots; n++, u = (u+1) & (h->slots-1)) {
+		if (ref_read(fd, h, table, u, &ref) < 0)
+			return -1;
+		if (ref == 0 || ref == REF_TOMB)
+			return ref_write(fd, h, table, u, slot + 1);
+	}
+	return -1;
+}
+
+static void idx_ref_del(int fd, struct map_idx_head *h, int table,
+			unsigned int hash, unsigned int slot)
+{
+	unsigned int u = hash & (h->slots-1);
+	unsigned int n;
+	__u32 ref;
+
+	for (n = 0; n < h->slots; n++, u = (u+1) & (h->slots-1)) {
+		if (ref_read(fd, h, table, u, &ref) < 0 || ref == 0)
+			return;
+		if (ref == slot + 1) {
+			ref_write(fd, h, table, u, REF_TOMB);
+			return;
+		}
+	}
+}
+
+/* Move the name reference for 'slot' from the old record's name to the
+ * new one's, either of which may be NULL.
+ */
+static int idx_name_move(int fd, struct map_idx_head *h, char *from,
+			 char *to, unsigned int slot)
+{
+	if (from && to && strcmp(from, to) == 0)
+		return 0;
+	if (from)
+		idx_ref_del(fd, h, REFS_NAME, name_hash(from), slot);
+	if (to)
+		return idx_ref_add(fd, h, REFS_NAME, name_hash(to), slot);
+	return 0;
+}
+
+static int idx_commit(int fd, struct map_idx_head *h)
+{
+	h->generation++;
+	map_set_dirty();
+	if (pwrite(fd, h, sizeof(*h), 0) != sizeof(*h))
+		return -1;
+	return 0;
+}
+
+/* Set or (if me == NULL) remove the record for 'devnum'.
+ * The caller holds the map lock.
+ */
+static int idx_set(int devnum, struct map_ent *me)
+{
+	struct map_idx_head h;
+	struct map_rec old, r;
+	int fd, slot, free_slot;
+	int rv = -1;
+
+	fd = map_idx_open(O_RDWR, &h);
+	if (fd < 0)
+		return -1;
+	slot = idx_find_devnum(fd, &h, devnum, &old, &free_slot);
+	if (!me) {
+		if (slot < 0) {
+			close(fd);
+			return 0;
+		}
+		old.state = REC_DELETED;
+		if (rec_write(fd, &h, slot, &old) == 0) {
+			idx_ref_del(fd, &h, REFS_UUID, uuid_hash(old.uuid),
+				    slot);
+			idx_name_move(fd, &h, rec_name(&old), NULL, slot);
+			h.used--;
+			rv = idx_commit(fd, &h);
+		}
+		close(fd);
+		return rv;
+	}
+
+	if (slot < 0 && (free_slot < 0 || h.filled + 1 > h.slots / 2)) {
+		/* Time for a bigger table */
+		struct map_ent *map = NULL;
+
+		close(fd);
+		map_read(&map);
+		map_add(&map, me->devnum, me->metadata, me->uuid, me->path);
+		rv = map_idx_build(map) ? 0 : -1;
+		map_free(map);
+		map_set_dirty();
+		return rv;
+	}
+
+	ent_to_rec(me, &r);
+	if (slot >= 0) {
+		if (memcmp(old.uuid, r.uuid, 16) != 0) {
+			idx_ref_del(fd, &h, REFS_UUID, uuid_hash(old.uuid),
+				    slot);
+			if (idx_ref_add(fd, &h, REFS_UUID, uuid_hash(r.uuid),
+					slot) < 0)
+				goto out;
+		}
+		if (idx_name_move(fd, &h, rec_name(&old), rec_name(&r),
+				  slot) < 0)
+			goto out;
+	} else {
+		struct map_rec prev;
+
+		slot = free_slot;
+		if (rec_read(fd, &h, slot, &prev) == 0 &&
+		    prev.state == REC_EMPTY)
+			h.filled++;
+		h.used++;
+		if (idx_ref_add(fd, &h, REFS_UUID, uuid_hash(r.uuid),
+				slot) < 0 ||
+		    idx_name_move(fd, &h, NULL, rec_name(&r), slot) < 0)
+			goto out;
+	}
+	if (rec_write(fd, &h, slot, &r) == 0)
+		rv = idx_commit(fd, &h);
+out:
+	close(fd);
+	return rv;
+}
+
+/* Is 'map' a complete list from map_read (or being built), rather than
+ * a few entries fetched from the index?
+ */
+static int map_is_list(struct map_ent *map)
+{
+	return map && !map->indexed;
+}
+
 int map_update(struct map_ent **mpp, int devnum, char *metadata,
 	       int *uuid, char *path)
 {
-	struct map_ent *map, *mp;
+	struct map_ent *map = NULL, me;
+	int locked = 0;
 	int rv;
 
-	if (mpp && *mpp)
-		map = *mpp;
-	else
-		map_read(&map);
+	me.devnum = devnum;
+	strncpy(me.metadata, metadata, sizeof(me.metadata)-1);
+	me.metadata[sizeof(me.metadata)-1] = 0;
+	memcpy(me.uuid, uuid, 16);
+	me.path = path;
+	me.members = 0;
 
-	for (mp = map ; mp ; mp=mp->next)
-		if (mp->devnum == devnum) {
-			strcpy(mp->metadata, metadata);
-			memcpy(mp->uuid, uuid, 16);
-			free(mp->path);
-			mp->path = path ? strdup(path) : NULL;
-			mp->bad = 0;
-			break;
-		}
-	if (!mp)
-		map_add(&map, devnum, metadata, uuid, path);
-	if (mpp)
+	if (lf == NULL) {
+		if (map_lock(&map) != 0)
+			return 0;
+		locked = 1;
+	}
+	rv = idx_set(devnum, &me) == 0;
+	if (locked)
+		map_unlock(&map);
+	if (mpp) {
+		map_free(*mpp);
 		*mpp = NULL;
-	rv = map_write(map);
-	map_free(map);
+	}
 	return rv;
 }
 
@@ -269,55 +945,150 @@ void map_delete(struct map_ent **mapp, int devnum)
 
 void map_remove(struct map_ent **mapp, int devnum)
 {
+	struct map_ent *map = NULL;
+	int locked = 0;
+
 	if (devnum == NoMdDev)
 		return;
 
-	map_delete(mapp, devnum);
-	map_write(*mapp);
+	if (lf == NULL) {
+		if (map_lock(&map) != 0)
+			return;
+		locked = 1;
+	}
+	idx_set(devnum, NULL);
+	if (locked)
+		map_unlock(&map);
 	map_free(*mapp);
+	*mapp = NULL;
+}
+
+/* Add an entry found in the index to the caller's (partial) list */
+static struct map_ent *map_found(struct map_ent **map, struct map_rec *r)
+{
+	struct map_ent *me;
+
+	map_add(map, r->devnum, "", r->uuid, NULL);
+	me = *map;
+	rec_to_ent(r, me);
+	me->indexed = 1;
+	return me;
 }
 
 struct map_ent *map_by_uuid(struct map_ent **map, int uuid[4])
 {
 	struct map_ent *mp;
-	if (!*map)
-		map_read(map);
+	struct map_idx_head h;
+	unsigned int u, n;
+	int fd;
 
-	for (mp = *map ; mp ; mp = mp->next) {
-		if (memcmp(uuid, mp->uuid, 16) != 0)
+	if (map_is_list(*map)) {
+		for (mp = *map ; mp ; mp = mp->next) {
+			if (memcmp(uuid, mp->uuid, 16) != 0)
+				continue;
+			if (!mddev_busy(mp->devnum)) {
+				mp->bad = 1;
+				continue;
+			}
+			return mp;
+		}
+		return NULL;
+	}
+
+	fd = map_idx_open(O_RDONLY, &h);
+	if (fd < 0)
+		return NULL;
+	mp = NULL;
+	u = uuid_hash(uuid) & (h.slots-1);
+	for (n = 0; n < h.slots; n++, u = (u+1) & (h.slots-1)) {
+		struct map_rec r;
+		__u32 ref;
+
+		if (ref_read(fd, &h, REFS_UUID, u, &ref) < 0 || ref == 0)
+			break;
+		if (ref == REF_TOMB || ref > h.slots)
 			continue;
-		if (!mddev_busy(mp->devnum)) {
-			mp->bad = 1;
+		if (rec_read(fd, &h, ref - 1, &r) < 0 ||
+		    r.state != REC_USED ||
+		    memcmp(uuid, r.uuid, 16) != 0)
 			continue;
-		}
-		return mp;
+		if (!mddev_busy(r.devnum))
+			continue;
+		mp = map_found(map, &r);
+		break;
 	}
-	return NULL;
+	close(fd);
+	return mp;
 }
 
 struct map_ent *map_by_devnum(struct map_ent **map, int devnum)
 {
 	struct map_ent *mp;
-	if (!*map)
-		map_read(map);
+	struct map_idx_head h;
+	struct map_rec r;
+	int fd;
 
-	for (mp = *map ; mp ; mp = mp->next) {
-		if (mp->devnum != devnum)
-			continue;
-		if (!mddev_busy(mp->devnum)) {
-			mp->bad = 1;
-			continue;
+	if (map_is_list(*map)) {
+		for (mp = *map ; mp ; mp = mp->next) {
+			if (mp->devnum != devnum)
+				continue;
+			if (!mddev_busy(mp->devnum)) {
+				mp->bad = 1;
+				continue;
+			}
+			return mp;
 		}
-		return mp;
+		return NULL;
 	}
-	return NULL;
+
+	fd = map_idx_open(O_RDONLY, &h);
+	if (fd < 0)
+		return NULL;
+	mp = NULL;
+	if (idx_find_devnum(fd, &h, devnum, &r, NULL) >= 0 &&
+	    mddev_busy(devnum))
+		mp = map_found(map, &r);
+	close(fd);
+	return mp;
 }
 
 struct map_ent *map_by_name(struct map_ent **map, char *name)
 {
 	struct map_ent *mp;
-	if (!*map)
-		map_read(map);
+	struct map_idx_head h;
+	unsigned int u, n;
+	int fd;
+
+	if (!map_is_list(*map)) {
+		fd = map_idx_open(O_RDONLY, &h);
+		if (fd < 0)
+			return NULL;
+		mp = NULL;
+		u = name_hash(name) & (h.slots-1);
+		for (n = 0; n < h.slots; n++, u = (u+1) & (h.slots-1)) {
+			struct map_rec r;
+			char *rname;
+			__u32 ref;
+
+			if (ref_read(fd, &h, REFS_NAME, u, &ref) < 0 ||
+			    ref == 0)
+				break;
+			if (ref == REF_TOMB || ref > h.slots)
+				continue;
+			if (rec_read(fd, &h, ref - 1, &r) < 0 ||
+			    r.state != REC_USED)
+				continue;
+			rname = rec_name(&r);
+			if (!rname || strcmp(rname, name) != 0)
+				continue;
+			if (!mddev_busy(r.devnum))
+				continue;
+			mp = map_found(map, &r);
+			break;
+		}
+		close(fd);
+		return mp;
+	}
 
 	for (mp = *map ; mp ; mp = mp->next) {
 		if (!mp->path)
@@ -355,11 +1126,36 @@ static char *get_member_info(struct mdstat_ent *ent)
 	return NULL;
 }
 
-void RebuildMap(void)
+/* A summary of the array's metadata and member devices as listed in
+ * mdstat, so RebuildMap can tell whether an entry it made earlier
+ * still holds.  Never 0, which marks an entry made elsewhere.
+ */
+static unsigned int mdstat_members(struct mdstat_ent *md)
+{
+	struct dev_member *m;
+	unsigned int sig = 0;
+
+	if (md->metadata_version)
+		sig = crc32(0, (unsigned char *)md->metadata_version,
+			    strlen(md->metadata_version));
+	/* mdstat order can change, so combine the names in any order */
+	for (m = md->members; m; m = m->next)
+		sig += crc32(0, (unsigned char *)m->name,
+			     strlen(m->name)) | 1;
+	return sig ?: 1;
+}
+
+/* Rebuild the map from the arrays the kernel knows about.  If 'reuse'
+ * is set, as when the index is simply missing, arrays whose members
+ * are unchanged keep the entry we made for them earlier.  An explicit
+ * --rebuild-map probes everything, so a bad entry can be corrected.
+ */
+void RebuildMap(int reuse)
 {
 	struct mdstat_ent *mdstat = mdstat_read(0, 0);
 	struct mdstat_ent *md;
 	struct map_ent *map = NULL;
+	struct map_ent *old = NULL, *me;
 	int mdp = get_mdp_major();
 	int require_homehost;
 	char sys_hostname[256];
@@ -372,10 +1168,31 @@ void RebuildMap(void)
 		}
 	}
 
+	/* Arrays whose members haven't changed since we last looked
+	 * keep their entry, and only the rest are probed.
+	 */
+	if (reuse) {
+		rebuilding = 1;
+		map_read(&old);
+		rebuilding = 0;
+	}
+
 	for (md = mdstat ; md ; md = md->next) {
-		struct mdinfo *sra = sysfs_read(-1, md->devnum, GET_DEVS);
+		struct mdinfo *sra;
 		struct mdinfo *sd;
+		unsigned int members = mdstat_members(md);
+
+		for (me = old; me; me = me->next)
+			if (me->devnum == md->devnum)
+				break;
+		if (me && me->members == members) {
+			map_add(&map, me->devnum, me->metadata,
+				me->uuid, me->path);
+			map->members = members;
+			continue;
+		}
 
+		sra = sysfs_read(-1, md->devnum, GET_DEVS);
 		if (!sra)
 			continue;
 
@@ -393,12 +1210,14 @@ void RebuildMap(void)
 			dfd = dev_open(dn, O_RDONLY);
 			if (dfd < 0)
 				continue;
-			st = guess_super(dfd);
+			st = guess_super_cached(dfd);
 			if ( st == NULL)
 				ok = -1;
 			else {
 				subarray = get_member_info(md);
 				ok = st->ss->load_super(st, dfd, NULL);
+				if (ok == 0)
+					sbcache_store(dfd, st);
 			}
 			close(dfd);
 			if (ok != 0)
@@ -492,6 +1311,7 @@ void RebuildMap(void)
 			map_add(&map, md->devnum,
 				info->text_version,
 				info->uuid, path);
+			map->members = members;
 			st->ss->free_super(st);
 			free(info);
 			break;
@@ -508,5 +1328,6 @@ void RebuildMap(void)
 			sysfs_free(sra);
 		}
 	map_free(map);
+	map_free(old);
 	free_mdstat(mdstat);
 }
@@ -1061,6 +1061,11 @@ int main(int argc, char *argv[])
 			exit(2);
 
 		case O(GROW,BitmapChunk):
+			if (strcmp(optarg, "auto") == 0) {
+				bitmap_chunk = BitmapChunkAuto;
+				continue;
+			}
+			/* FALL THROUGH */
 		case O(BUILD,BitmapChunk):
 		case O(CREATE,BitmapChunk): /* bitmap chunksize */
 			bitmap_chunk = parse_size(optarg);
@@ -1577,7 +1582,7 @@ int main(int argc, char *argv[])
 				case 'Q':
 					rv |= Query(dv->devname); continue;
 				case 'X':
-					rv |= ExamineBitmap(dv->devname, brief, ss); continue;
+					rv |= ExamineBitmap(dv->devname, brief, export, ss); continue;
 				case 'W':
 				case WaitOpt:
 					rv |= Wait(dv->devname); continue;
@@ -1697,6 +1702,11 @@ int main(int argc, char *argv[])
 				delay = DEFAULT_BITMAP_DELAY;
 			rv = Grow_addbitmap(devlist->devname, mdfd, bitmap_file,
 					    bitmap_chunk, delay, write_behind, force);
+		} else if (bitmap_chunk == BitmapChunkAuto) {
+			if (delay == 0)
+				delay = DEFAULT_BITMAP_DELAY;
+			rv = Grow_bitmap_advise(devlist->devname, mdfd, delay,
+						verbose);
 		} else if (grow_continue)
 			rv = Grow_continue_command(devlist->devname,
 						   mdfd, backup_file,
@@ -1712,7 +1722,7 @@ int main(int argc, char *argv[])
 		break;
 	case INCREMENTAL:
 		if (rebuild_map) {
-			RebuildMap();
+			RebuildMap(0);
 		}
 		if (scan) {
 			if (runstop <= 0) {
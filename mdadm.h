@@ -57,6 +57,7 @@ extern __off64_t lseek64 __P ((int __fd, __off64_t __offset, int __whence));
 #include	<sys/mount.h>
 #include	<asm/types.h>
 #include	<sys/ioctl.h>
+#include	<stdint.h>
 #define	MD_MAJOR 9
 #define MdpMinorShift 6
 
@@ -336,6 +337,7 @@ enum special_options {
  * devices is considered
  */
 #define UnSet (0xfffe)
+#define BitmapChunkAuto (-2)	/* --bitmap-chunk=auto */
 struct mddev_ident {
 	char	*devname;
 
@@ -400,6 +402,8 @@ struct mdstat_ent {
 	int		devcnt;
 	int		raid_disks;
 	char *		metadata_version;
+	char *		devs; /* members as listed, with (F) etc */
+	int		changed; /* set by mdstat_diff() */
 	struct dev_member {
 		char			*name;
 		struct dev_member	*next;
@@ -408,7 +412,21 @@ struct mdstat_ent {
 };
 
 extern struct mdstat_ent *mdstat_read(int hold, int start);
+struct mdstat_arena {
+	char	*text;		/* /proc/mdstat, parsed in place */
+	int	text_size;
+	char	*mem;		/* entries are allocated from here */
+	size_t	mem_size, mem_used;
+	size_t	mem_want;	/* how much the last read needed */
+	void	*spill;		/* what didn't fit in 'mem' */
+	char	**words;
+	int	words_max;
+};
+extern struct mdstat_ent *mdstat_read_arena(struct mdstat_arena *arena,
+					    int hold, int start);
+extern void mdstat_arena_free(struct mdstat_arena *arena);
 extern void free_mdstat(struct mdstat_ent *ms);
+extern int mdstat_diff(struct mdstat_ent *old, struct mdstat_ent *new);
 extern void mdstat_wait(int seconds);
 extern void mdstat_wait_fd(int fd, const sigset_t *sigmask);
 extern int mddev_busy(int devnum);
@@ -421,6 +439,8 @@ struct map_ent {
 	char	metadata[20];
 	int	uuid[4];
 	int	bad;
+	int	indexed;	/* fetched alone from the index */
+	unsigned int members;	/* RebuildMap's note of the member set */
 	char	*path;
 };
 extern int map_update(struct map_ent **mpp, int devnum, char *metadata,
@@ -525,6 +545,28 @@ extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   unsigned long long start, unsigned long long length,
 			   char *src_buf);
 
+/* P/Q generation routines, chosen at run time to suit the CPU.
+ * See restripe.c
+ */
+struct raid6_calls {
+	const char *name;
+	int (*valid)(void);	/* NULL means always usable */
+	void (*xor_blocks)(char *target, char **sources, int disks, int size);
+	void (*gen_syndrome)(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size);
+};
+extern const struct raid6_calls *raid6_select_algo(void);
+extern void xor_blocks(char *target, char **sources, int disks, int size);
+extern void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources,
+		      int disks, int size);
+extern int geo_map(int block, unsigned long long stripe, int raid_disks,
+		   int level, int layout);
+extern void make_tables(void);
+extern void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
+			      uint8_t **ptrs);
+extern void raid6_datap_recov(int disks, size_t bytes, int faila,
+			      uint8_t **ptrs);
+
 #ifndef Sendmail
 #define Sendmail "/usr/lib/sendmail -t"
 #endif
@@ -570,6 +612,23 @@ struct reshape {
 	unsigned long long new_size; /* New size of array in sectors */
 };
 
+/* The start and end of a device, read just once by guess_super_type()
+ * so that each metadata handler can look for its signature in memory
+ * before ->load_super is tried.  The tail covers everywhere any of the
+ * handlers put an anchor near the end of a device.
+ */
+#define SNIFF_HEAD	(8*1024)
+#define SNIFF_TAIL	(128*1024)
+struct sniff {
+	unsigned long long size;	/* of the device, in bytes */
+	char *head;
+	int head_len;
+	char *tail;
+	unsigned long long tail_offset;
+	int tail_len;
+};
+extern void *sniff_data(struct sniff *sn, unsigned long long offset, int len);
+
 /* A superswitch provides entry point the a metadata handler.
  *
  * The super_switch primarily operates on some "metadata" that
@@ -703,6 +762,11 @@ extern struct superswitch {
 	int (*write_init_super)(struct supertype *st);
 	int (*compare_super)(struct supertype *st, struct supertype *tst);
 	int (*load_super)(struct supertype *st, int fd, char *devname);
+	/* Optional: return 0 if this metadata is certainly not present
+	 * on the device 'sn' was read from, 1 if ->load_super is worth
+	 * trying.  Anything 'sn' doesn't cover must count as 'worth trying'.
+	 */
+	int (*sniff_super)(struct sniff *sn);
 	int (*load_container)(struct supertype *st, int fd, char *devname);
 	struct supertype * (*match_metadata_desc)(char *arg);
 	__u64 (*avail_size)(struct supertype *st, __u64 size);
@@ -787,6 +851,12 @@ extern struct superswitch {
 	 * not in fact changed.
 	 */
 	void (*set_disk)(struct active_array *a, int n, int state);
+	/* prepare_sync is called by mdmon's manager, which may allocate,
+	 * to set up anything sync_metadata will need, as the monitor
+	 * may not allocate.  It runs after the container is loaded and
+	 * before each batch of updates goes to the monitor.
+	 */
+	void (*prepare_sync)(struct supertype *st);
 	void (*sync_metadata)(struct supertype *st);
 	void (*process_update)(struct supertype *st,
 			       struct metadata_update *update);
@@ -893,6 +963,24 @@ static inline struct supertype *guess_super(int fd) {
 	return guess_super_type(fd, guess_any);
 }
 extern struct supertype *dup_super(struct supertype *st);
+extern struct supertype *guess_super_cached(int fd);
+extern void sbcache_store(int fd, struct supertype *st);
+extern void sbcache_forget(int fd);
+struct probe_set;
+extern struct probe_set *probe_devices(struct mddev_dev *devlist,
+				       char *devices, struct supertype *st,
+				       int ignore_hw_compat);
+extern int probe_load(struct probe_set *ps, struct mddev_dev *dv,
+		      struct supertype **stp, int fd, int ignore_hw_compat,
+		      char *devname);
+extern void probe_free(struct probe_set *ps);
+struct parallel_pool;
+extern struct parallel_pool *parallel_pool_grow(struct parallel_pool *pool,
+						int cnt);
+extern void parallel_pool_run(struct parallel_pool *pool, int cnt,
+			      void (*fn)(void *arg, int i), void *arg);
+extern void parallel_pool_stop(struct parallel_pool *pool);
+extern void run_parallel(int cnt, void (*fn)(void *arg, int i), void *arg);
 extern int get_dev_size(int fd, char *dname, unsigned long long *sizep);
 extern int must_be_container(int fd);
 extern int dev_size_from_id(dev_t id, unsigned long long *size);
@@ -1047,6 +1135,7 @@ extern int Manage_subdevs(char *devname, int fd,
 extern int autodetect(void);
 extern int Grow_Add_device(char *devname, int fd, char *newdev);
 extern int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int write_behind, int force);
+extern int Grow_bitmap_advise(char *devname, int fd, int delay, int verbose);
 extern int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 			long long size,
 			int level, char *layout_str, int chunksize, int raid_disks,
@@ -1108,7 +1197,7 @@ extern int WaitClean(char *dev, int sock, int verbose);
 extern int Incremental(char *devname, int verbose, int runstop,
 		       struct supertype *st, char *homehost, int require_homehost,
 		       int autof, int freeze_reshape);
-extern void RebuildMap(void);
+extern void RebuildMap(int reuse);
 extern int IncrementalScan(int verbose);
 extern int IncrementalRemove(char *devname, char *path, int verbose);
 extern int CreateBitmap(char *filename, int force, char uuid[16],
@@ -1116,7 +1205,10 @@ extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long write_behind,
 			unsigned long long array_size,
 			int major);
-extern int ExamineBitmap(char *filename, int brief, struct supertype *st);
+extern int ExamineBitmap(char *filename, int brief, int export, struct supertype *st);
+extern int bitmap_advise_chunk(int fd, unsigned long long size,
+			       unsigned long min_chunk, int delay, int secs,
+			       char *bitmap_dev, int verbose);
 extern int Write_rules(char *rule_name);
 extern int bitmap_update_uuid(int fd, int *uuid, int swap);
 extern unsigned long bitmap_sectors(struct bitmap_super_s *bsb);
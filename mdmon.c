@@ -537,6 +537,10 @@ static int mdmon(char *devname, int devnum, int must_fork, int takeover)
 
 	mlockall(MCL_CURRENT | MCL_FUTURE);
 
+	if (container->ss->prepare_sync)
+		container->ss->prepare_sync(container);
+
+	monitor_epoll_init();
 	if (clone_monitor(container) < 0) {
 		fprintf(stderr, "mdmon: failed to start monitor process: %s\n",
 			strerror(errno));
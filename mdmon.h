@@ -48,6 +48,10 @@ struct active_array {
 
 	int check_degraded; /* flag set by mon, read by manage */
 	int check_reshape; /* flag set by mon, read by manage */
+	int woken; /* an attribute of this array has changed */
+	int dirty; /* ARRAY_DIRTY from the last read_and_act() */
+	int acting; /* read_and_act() done, effect_changes() to do */
+	int checks; /* ARRAY_CHECK_* for the manager, once that is done */
 
 	int devnum;
 };
@@ -86,6 +90,9 @@ struct mdstat_ent *mdstat_read(int hold, int start);
 extern int exit_now, manager_ready;
 extern int mon_tid, mgr_tid;
 extern int monitor_loop_cnt;
+extern int monitor_epfd;
+void monitor_epoll_init(void);
+void monitor_watch(int fd, int devnum);
 
 /* helper routine to determine resync completion since MaxSector is a
  * moving target
@@ -73,14 +73,14 @@
  *   pattern of failed drives (so need number of drives)
  *   percent resync complete
  *
- * As continuation is indicated by leading space, we use
- *  conf_line from config.c to read logical lines
+ * As continuation is indicated by leading space, a logical line
+ * (one array) runs until the next line that starts in column 0.
  *
  */
 
 #include	"mdadm.h"
-#include	"dlink.h"
 #include	<sys/select.h>
+#include	<sys/epoll.h>
 #include	<ctype.h>
 
 static void free_member_devnames(struct dev_member *m)
@@ -94,22 +94,6 @@ static void free_member_devnames(struct dev_member *m)
 	}
 }
 
-static int add_member_devname(struct dev_member **m, char *name)
-{
-	struct dev_member *new;
-	char *t;
-
-	if ((t = strchr(name, '[')) == NULL)
-		/* not a device */
-		return 0;
-
-	new = malloc(sizeof(*new));
-	new->name = strndup(name, t - name);
-	new->next = *m;
-	*m = new;
-	return 1;
-}
-
 void free_mdstat(struct mdstat_ent *ms)
 {
 	while (ms) {
@@ -118,6 +102,7 @@ void free_mdstat(struct mdstat_ent *ms)
 		free(ms->level);
 		free(ms->pattern);
 		free(ms->metadata_version);
+		free(ms->devs);
 		free_member_devnames(ms->members);
 		t = ms;
 		ms = ms->next;
@@ -126,166 +111,415 @@ void free_mdstat(struct mdstat_ent *ms)
 }
 
 static int mdstat_fd = -1;
-struct mdstat_ent *mdstat_read(int hold, int start)
+static char *mdstat_file = "/proc/mdstat";
+
+/* Entries are either malloced, to be released with free_mdstat(), or
+ * carved out of a struct mdstat_arena.  In the latter case strings
+ * point straight into the text read from /proc/mdstat.
+ */
+static void *arena_alloc(struct mdstat_arena *a, size_t len)
 {
-	FILE *f;
-	struct mdstat_ent *all, *rv, **end, **insert_here;
-	char *line;
-	int fd;
+	char *p;
 
-	if (hold && mdstat_fd != -1) {
-		lseek(mdstat_fd, 0L, 0);
-		fd = dup(mdstat_fd);
-		if (fd >= 0)
-			f = fdopen(fd, "r");
-		else
-			return NULL;
-	} else
-		f = fopen("/proc/mdstat", "r");
-	if (f == NULL)
+	if (!a)
+		return malloc(len);
+	len = (len + 15) & ~(size_t)15;
+	a->mem_want += len;
+	if (a->mem_used + len <= a->mem_size) {
+		p = a->mem + a->mem_used;
+		a->mem_used += len;
+		return p;
+	}
+	/* Doesn't fit this time.  Chain it on 'spill' to be freed at
+	 * the next read, when 'mem' will be made big enough.
+	 */
+	p = malloc(16 + len);
+	if (!p)
 		return NULL;
-	else
-		fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+	*(void**)p = a->spill;
+	a->spill = p;
+	return p + 16;
+}
 
-	all = NULL;
-	end = &all;
-	for (; (line = conf_line(f)) ; free_line(line)) {
-		struct mdstat_ent *ent;
-		char *w;
-		int devnum;
-		int in_devs = 0;
-		char *ep;
+static char *arena_keep(struct mdstat_arena *a, char *s)
+{
+	return a ? s : strdup(s);
+}
 
-		if (strcmp(line, "Personalities")==0)
-			continue;
-		if (strcmp(line, "read_ahead")==0)
-			continue;
-		if (strcmp(line, "unused")==0)
-			continue;
-		insert_here = NULL;
-		/* Better be an md line.. */
-		if (strncmp(line, "md", 2)!= 0)
-			continue;
-		if (strncmp(line, "md_d", 4) == 0)
-			devnum = -1-strtoul(line+4, &ep, 10);
-		else if (strncmp(line, "md", 2) == 0)
-			devnum = strtoul(line+2, &ep, 10);
-		else
-			continue;
-		if (ep == NULL || *ep ) {
-			/* fprintf(stderr, Name ": bad /proc/mdstat line starts: %s\n", line); */
-			continue;
-		}
+/* Split one logical line of /proc/mdstat into words, in place. */
+static int mdstat_split(char *p, char *end, char ***wordsp, int *maxp)
+{
+	int n = 0;
+
+	while (p < end) {
+		char *s;
 
-		ent = malloc(sizeof(*ent));
-		if (!ent) {
-			fprintf(stderr, Name ": malloc failed reading /proc/mdstat.\n");
-			free_line(line);
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+			p++;
+		if (p >= end)
 			break;
+		s = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\n') {
+			p++;
+			/* Hack for broken kernels (2.6.14-.24) that put
+			 *        "active(auto-read-only)"
+			 * in /proc/mdstat instead of
+			 *        "active (auto-read-only)"
+			 */
+			if (p < end && *p == '(' && p - s >= 6 &&
+			    strncmp(p - 6, "active", 6) == 0)
+				break;
 		}
-		ent->dev = ent->level = ent->pattern= NULL;
-		ent->next = NULL;
-		ent->percent = RESYNC_NONE;
-		ent->active = -1;
-		ent->resync = 0;
-		ent->metadata_version = NULL;
-		ent->raid_disks = 0;
-		ent->devcnt = 0;
-		ent->members = NULL;
-
-		ent->dev = strdup(line);
-		ent->devnum = devnum;
-
-		for (w=dl_next(line); w!= line ; w=dl_next(w)) {
-			int l = strlen(w);
-			char *eq;
-			if (strcmp(w, "active")==0)
-				ent->active = 1;
-			else if (strcmp(w, "inactive")==0) {
-				ent->active = 0;
-				in_devs = 1;
-			} else if (ent->active > 0 &&
-				 ent->level == NULL &&
-				 w[0] != '(' /*readonly*/) {
-				ent->level = strdup(w);
-				in_devs = 1;
-			} else if (in_devs && strcmp(w, "blocks")==0)
-				in_devs = 0;
-			else if (in_devs) {
-				ent->devcnt +=
-					add_member_devname(&ent->members, w);
-				if (strncmp(w, "md", 2)==0) {
-					/* This has an md device as a component.
-					 * If that device is already in the
-					 * list, make sure we insert before
-					 * there.
-					 */
-					struct mdstat_ent **ih;
-					int dn2 = devname2devnum(w);
-					ih = &all;
-					while (ih != insert_here && *ih &&
-					       (*ih)->devnum != dn2)
-						ih = & (*ih)->next;
-					insert_here = ih;
-				}
-			} else if (strcmp(w, "super") == 0 &&
-				   dl_next(w) != line) {
-				w = dl_next(w);
-				ent->metadata_version = strdup(w);
-			} else if (w[0] == '[' && isdigit(w[1])) {
-				ent->raid_disks = atoi(w+1);
-			} else if (!ent->pattern &&
-				 w[0] == '[' &&
-				 (w[1] == 'U' || w[1] == '_')) {
-				ent->pattern = strdup(w+1);
-				if (ent->pattern[l-2]==']')
-					ent->pattern[l-2] = '\0';
-			} else if (ent->percent == RESYNC_NONE &&
-				   strncmp(w, "re", 2)== 0 &&
-				   w[l-1] == '%' &&
-				   (eq=strchr(w, '=')) != NULL ) {
-				ent->percent = atoi(eq+1);
-				if (strncmp(w,"resync", 6)==0)
-					ent->resync = 1;
-				else if (strncmp(w, "reshape", 7)==0)
-					ent->resync = 2;
-				else
-					ent->resync = 0;
-			} else if (ent->percent == RESYNC_NONE &&
-				   (w[0] == 'r' || w[0] == 'c')) {
-				if (strncmp(w, "resync", 4)==0)
-					ent->resync = 1;
-				if (strncmp(w, "reshape", 7)==0)
-					ent->resync = 2;
-				if (strncmp(w, "recovery", 8)==0)
-					ent->resync = 0;
-				if (strncmp(w, "check", 5)==0)
-					ent->resync = 3;
-
-				if (l > 8 && strcmp(w+l-8, "=DELAYED") == 0)
-					ent->percent = RESYNC_DELAYED;
-				if (l > 8 && strcmp(w+l-8, "=PENDING") == 0)
-					ent->percent = RESYNC_PENDING;
-			} else if (ent->percent == RESYNC_NONE &&
-				   w[0] >= '0' &&
-				   w[0] <= '9' &&
-				   w[l-1] == '%') {
-				ent->percent = atoi(w);
+		/* A logical line always ends with a newline, or with
+		 * the nul after the end of the file.
+		 */
+		if (p < end)
+			*p++ = '\0';
+		if (n >= *maxp) {
+			char **w = realloc(*wordsp,
+					   (*maxp + 64) * sizeof(char*));
+			if (!w)
+				break;
+			*wordsp = w;
+			*maxp += 64;
+		}
+		if (strcmp(s, "auto-read-only)") == 0)
+			s = "(auto-read-only)";
+		(*wordsp)[n++] = s;
+	}
+	return n;
+}
+
+static struct mdstat_ent *mdstat_parse(char **words, int nwords,
+				       struct mdstat_arena *a)
+{
+	struct mdstat_ent *ent;
+	char *line = words[0];
+	char *w;
+	int devnum;
+	int in_devs = 0;
+	int first_dev = 0, last_dev = 0;
+	char *ep;
+	int i;
+
+	/* Better be an md line.. */
+	if (strncmp(line, "md_d", 4) == 0)
+		devnum = -1-strtoul(line+4, &ep, 10);
+	else if (strncmp(line, "md", 2) == 0)
+		devnum = strtoul(line+2, &ep, 10);
+	else
+		return NULL;
+	if (ep == NULL || *ep ) {
+		/* fprintf(stderr, Name ": bad /proc/mdstat line starts: %s\n", line); */
+		return NULL;
+	}
+
+	ent = arena_alloc(a, sizeof(*ent));
+	if (!ent) {
+		fprintf(stderr, Name ": malloc failed reading /proc/mdstat.\n");
+		return NULL;
+	}
+	ent->dev = ent->level = ent->pattern= NULL;
+	ent->next = NULL;
+	ent->percent = RESYNC_NONE;
+	ent->active = -1;
+	ent->resync = 0;
+	ent->metadata_version = NULL;
+	ent->raid_disks = 0;
+	ent->devcnt = 0;
+	ent->members = NULL;
+	ent->devs = NULL;
+	ent->changed = 1;
+
+	ent->dev = arena_keep(a, line);
+	ent->devnum = devnum;
+
+	for (i = 1; i < nwords; i++) {
+		int l;
+		char *eq;
+		w = words[i];
+		l = strlen(w);
+		/* Most words are tested against several keywords, so
+		 * look at the first character before calling strcmp.
+		 */
+		if (w[0] == 'a' && strcmp(w, "active")==0)
+			ent->active = 1;
+		else if (w[0] == 'i' && strcmp(w, "inactive")==0) {
+			ent->active = 0;
+			in_devs = 1;
+		} else if (ent->active > 0 &&
+			 ent->level == NULL &&
+			 w[0] != '(' /*readonly*/) {
+			ent->level = arena_keep(a, w);
+			in_devs = 1;
+		} else if (in_devs && w[0] == 'b' && strcmp(w, "blocks")==0)
+			in_devs = 0;
+		else if (in_devs) {
+			/* member devices are gathered below */
+			if (!first_dev)
+				first_dev = i;
+			last_dev = i;
+		} else if (w[0] == 's' && strcmp(w, "super") == 0 &&
+			   i + 1 < nwords) {
+			w = words[++i];
+			ent->metadata_version = arena_keep(a, w);
+		} else if (w[0] == '[' && isdigit(w[1])) {
+			ent->raid_disks = atoi(w+1);
+		} else if (!ent->pattern &&
+			 w[0] == '[' &&
+			 (w[1] == 'U' || w[1] == '_')) {
+			ent->pattern = arena_keep(a, w+1);
+			if (ent->pattern[l-2]==']')
+				ent->pattern[l-2] = '\0';
+		} else if (ent->percent == RESYNC_NONE &&
+			   strncmp(w, "re", 2)== 0 &&
+			   w[l-1] == '%' &&
+			   (eq=strchr(w, '=')) != NULL ) {
+			ent->percent = atoi(eq+1);
+			if (strncmp(w,"resync", 6)==0)
+				ent->resync = 1;
+			else if (strncmp(w, "reshape", 7)==0)
+				ent->resync = 2;
+			else
+				ent->resync = 0;
+		} else if (ent->percent == RESYNC_NONE &&
+			   (w[0] == 'r' || w[0] == 'c')) {
+			if (strncmp(w, "resync", 4)==0)
+				ent->resync = 1;
+			if (strncmp(w, "reshape", 7)==0)
+				ent->resync = 2;
+			if (strncmp(w, "recovery", 8)==0)
+				ent->resync = 0;
+			if (strncmp(w, "check", 5)==0)
+				ent->resync = 3;
+
+			if (l > 8 && strcmp(w+l-8, "=DELAYED") == 0)
+				ent->percent = RESYNC_DELAYED;
+			if (l > 8 && strcmp(w+l-8, "=PENDING") == 0)
+				ent->percent = RESYNC_PENDING;
+		} else if (ent->percent == RESYNC_NONE &&
+			   w[0] >= '0' &&
+			   w[0] <= '9' &&
+			   w[l-1] == '%') {
+			ent->percent = atoi(w);
+		}
+	}
+
+	if (first_dev) {
+		/* Keep the words as listed, with any (F) or (S), so
+		 * mdstat_diff() can see state changes.
+		 */
+		int len = 0;
+		for (i = first_dev; i <= last_dev; i++)
+			len += strlen(words[i]) + 1;
+		ent->devs = arena_alloc(a, len);
+		if (ent->devs) {
+			ep = ent->devs;
+			for (i = first_dev; i <= last_dev; i++) {
+				if (i > first_dev)
+					*ep++ = ' ';
+				strcpy(ep, words[i]);
+				ep += strlen(ep);
 			}
 		}
-		if (insert_here && (*insert_here)) {
-			ent->next = *insert_here;
-			*insert_here = ent;
-		} else {
-			*end = ent;
-			end = &ent->next;
+	}
+	for (i = first_dev; first_dev && i <= last_dev; i++) {
+		struct dev_member *m;
+		char *t;
+
+		w = words[i];
+		if ((t = strchr(w, '[')) == NULL)
+			/* not a device */
+			continue;
+		m = arena_alloc(a, sizeof(*m));
+		if (!m)
+			break;
+		if (a) {
+			*t = '\0';
+			m->name = w;
+		} else
+			m->name = strndup(w, t - w);
+		m->next = ent->members;
+		ent->members = m;
+		ent->devcnt++;
+	}
+	return ent;
+}
+
+static char *strdup_null(char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+static struct mdstat_ent *mdstat_dup(struct mdstat_ent *ent)
+{
+	struct mdstat_ent *new = malloc(sizeof(*new));
+	struct dev_member *m, **mp;
+
+	if (!new)
+		return NULL;
+	*new = *ent;
+	new->dev = strdup_null(ent->dev);
+	new->level = strdup_null(ent->level);
+	new->pattern = strdup_null(ent->pattern);
+	new->metadata_version = strdup_null(ent->metadata_version);
+	new->devs = strdup_null(ent->devs);
+	new->next = NULL;
+	mp = &new->members;
+	for (m = ent->members; m; m = m->next) {
+		*mp = malloc(sizeof(**mp));
+		if (!*mp)
+			break;
+		(*mp)->name = strdup(m->name);
+		mp = &(*mp)->next;
+	}
+	*mp = NULL;
+	return new;
+}
+
+/* Most of the time most arrays look exactly as they did last time
+ * /proc/mdstat was read, so we remember the text of each array and
+ * what we made of it, and only parse the ones that differ.
+ */
+struct mdstat_cache {
+	char *text;
+	int len;
+	struct mdstat_ent *ent;
+};
+static struct mdstat_cache *mdstat_cache;
+static int mdstat_cached;
+
+static struct mdstat_cache *cache_find(char *text, int len, int *hint)
+{
+	int i;
+
+	/* arrays are normally listed in the same order each time */
+	for (i = 0; i < mdstat_cached; i++) {
+		struct mdstat_cache *c =
+			&mdstat_cache[(*hint + i) % mdstat_cached];
+		if (c->len == len && c->ent &&
+		    memcmp(c->text, text, len) == 0) {
+			*hint = (*hint + i + 1) % mdstat_cached;
+			return c;
 		}
 	}
-	if (hold && mdstat_fd == -1) {
-		mdstat_fd = dup(fileno(f));
-		fcntl(mdstat_fd, F_SETFD, FD_CLOEXEC);
+	return NULL;
+}
+
+static void cache_free(struct mdstat_cache *cache, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		free(cache[i].text);
+		free_mdstat(cache[i].ent);
 	}
-	fclose(f);
+	free(cache);
+}
+
+/* Read all of /proc/mdstat into *bufp (growing it as needed) and nul
+ * terminate it.  A seq_file hands back at most a page or so per read,
+ * so keep going until it reports the end.
+ */
+static int read_mdstat_file(int fd, char **bufp, int *sizep)
+{
+	int len = 0;
+
+	while (1) {
+		int n;
+		if (len + 4096 >= *sizep) {
+			int size = *sizep ? *sizep * 2 : 16384;
+			char *b = realloc(*bufp, size);
+			if (!b)
+				return -1;
+			*bufp = b;
+			*sizep = size;
+		}
+		n = pread(fd, *bufp + len, *sizep - len - 1, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	(*bufp)[len] = 0;
+	return len;
+}
+
+static int open_mdstat(int hold)
+{
+	int fd;
+
+	if (hold && mdstat_fd != -1)
+		return mdstat_fd;
+	fd = open(mdstat_file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (hold)
+		mdstat_fd = fd;
+	return fd;
+}
+
+static void close_mdstat(int fd)
+{
+	if (fd != mdstat_fd)
+		close(fd);
+}
+
+/* Find the end of the logical line (one array) starting at 'p'.
+ * A logical line continues while lines start with a space.
+ */
+static char *mdstat_next(char *p, char *eof)
+{
+	do {
+		p = memchr(p, '\n', eof - p);
+		p = p ? p + 1 : eof;
+	} while (p < eof && (*p == ' ' || *p == '\t' || *p == '\n'));
+	return p;
+}
+
+/* Add an entry to the list, in front of any array it has as a member,
+ * so components of an array always come after it.
+ */
+static void mdstat_insert(struct mdstat_ent **all,
+			  struct mdstat_ent ***end,
+			  struct mdstat_ent *ent)
+{
+	struct mdstat_ent **insert_here = NULL;
+	struct dev_member *m;
+
+	for (m = ent->members; m; m = m->next) {
+		/* This has an md device as a component.
+		 * If that device is already in the
+		 * list, make sure we insert before
+		 * there.
+		 */
+		struct mdstat_ent **ih;
+		int dn2;
+		if (strncmp(m->name, "md", 2) != 0)
+			continue;
+		dn2 = devname2devnum(m->name);
+		ih = all;
+		while (ih != insert_here && *ih &&
+		       (*ih)->devnum != dn2)
+			ih = & (*ih)->next;
+		insert_here = ih;
+	}
+	if (insert_here && (*insert_here)) {
+		ent->next = *insert_here;
+		*insert_here = ent;
+	} else {
+		**end = ent;
+		*end = &ent->next;
+	}
+}
+
+static struct mdstat_ent *mdstat_order(struct mdstat_ent *all, int start)
+{
+	struct mdstat_ent *rv;
 
 	/* If we might want to start array,
 	 * reverse the order, so that components comes before composites
@@ -302,11 +536,257 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 	return rv;
 }
 
+struct mdstat_ent *mdstat_read(int hold, int start)
+{
+	static char *buf;
+	static int size;
+	static char **words;
+	static int words_max;
+	struct mdstat_ent *all, **end;
+	struct mdstat_cache *cache = NULL;
+	int cached = 0;
+	int hint = 0;
+	char *p, *eof;
+	int fd;
+	int len;
+
+	fd = open_mdstat(hold);
+	if (fd < 0)
+		return NULL;
+	len = read_mdstat_file(fd, &buf, &size);
+	close_mdstat(fd);
+	if (len < 0)
+		return NULL;
+
+	all = NULL;
+	end = &all;
+	p = buf;
+	eof = buf + len;
+	while (p < eof) {
+		char *s = p;
+		struct mdstat_ent *ent = NULL;
+		struct mdstat_cache *c, *nc = NULL;
+		int n;
+
+		p = mdstat_next(p, eof);
+		if (strncmp(s, "md", 2) != 0)
+			continue;
+
+		c = cache_find(s, p - s, &hint);
+		if (hold) {
+			/* remember this array for next time */
+			nc = realloc(cache, (cached + 1) * sizeof(*cache));
+			if (nc) {
+				cache = nc;
+				nc = &cache[cached++];
+				if (c) {
+					*nc = *c;
+					c->ent = NULL;
+					c->text = NULL;
+				} else {
+					nc->ent = NULL;
+					nc->len = p - s;
+					nc->text = malloc(p - s);
+					if (nc->text)
+						memcpy(nc->text, s, p - s);
+				}
+			}
+		}
+		if (nc && nc->ent)
+			ent = mdstat_dup(nc->ent);
+		else {
+			n = mdstat_split(s, p, &words, &words_max);
+			if (n)
+				ent = mdstat_parse(words, n, NULL);
+			if (ent && nc && nc->text)
+				nc->ent = mdstat_dup(ent);
+		}
+		if (ent)
+			mdstat_insert(&all, &end, ent);
+	}
+	if (hold) {
+		cache_free(mdstat_cache, mdstat_cached);
+		mdstat_cache = cache;
+		mdstat_cached = cached;
+	}
+
+	return mdstat_order(all, start);
+}
+
+static void arena_reset(struct mdstat_arena *a, int len)
+{
+	size_t want = a->mem_want + a->mem_want / 4;
+
+	while (a->spill) {
+		void *next = *(void**)a->spill;
+		free(a->spill);
+		a->spill = next;
+	}
+	/* Entries take about as much space as the text they came from */
+	if (want < (size_t)len)
+		want = len;
+	if (want > a->mem_size) {
+		free(a->mem);
+		a->mem = malloc(want);
+		a->mem_size = a->mem ? want : 0;
+	}
+	a->mem_used = 0;
+	a->mem_want = 0;
+}
+
+/* Like mdstat_read(), but all memory comes from 'arena' and is reused
+ * on the next call with the same arena.  The result must not be passed
+ * to free_mdstat(), and is only valid until the arena is used again or
+ * released with mdstat_arena_free().
+ * Once the arena has grown to fit, this does no allocation at all.
+ */
+struct mdstat_ent *mdstat_read_arena(struct mdstat_arena *a,
+				     int hold, int start)
+{
+	struct mdstat_ent *all, **end;
+	char *p, *eof;
+	int fd;
+	int len;
+
+	fd = open_mdstat(hold);
+	if (fd < 0)
+		return NULL;
+	len = read_mdstat_file(fd, &a->text, &a->text_size);
+	close_mdstat(fd);
+	if (len < 0)
+		return NULL;
+	arena_reset(a, len);
+
+	all = NULL;
+	end = &all;
+	p = a->text;
+	eof = a->text + len;
+	while (p < eof) {
+		char *s = p;
+		struct mdstat_ent *ent;
+		int n;
+
+		p = mdstat_next(p, eof);
+		if (strncmp(s, "md", 2) != 0)
+			continue;
+		n = mdstat_split(s, p, &a->words, &a->words_max);
+		if (n == 0)
+			continue;
+		ent = mdstat_parse(a->words, n, a);
+		if (ent)
+			mdstat_insert(&all, &end, ent);
+	}
+	return mdstat_order(all, start);
+}
+
+void mdstat_arena_free(struct mdstat_arena *a)
+{
+	a->mem_want = 0;
+	arena_reset(a, 0);
+	free(a->mem);
+	free(a->text);
+	free(a->words);
+	memset(a, 0, sizeof(*a));
+}
+
+static int str_differ(char *a, char *b)
+{
+	if (a == NULL || b == NULL)
+		return a != b;
+	return strcmp(a, b) != 0;
+}
+
+static struct mdstat_ent *find_dev(struct mdstat_ent *from,
+				   struct mdstat_ent *to, char *dev)
+{
+	for (; from != to; from = from->next)
+		if (strcmp(from->dev, dev) == 0)
+			return from;
+	return NULL;
+}
+
+/* Compare each entry in 'new' with the entry for the same array in
+ * 'old', and set ->changed if there is anything different that we
+ * might care about.  Progress of a resync is only noticed when the
+ * whole percentage changes.
+ * Returns the number of changed arrays.
+ */
+int mdstat_diff(struct mdstat_ent *old, struct mdstat_ent *new)
+{
+	struct mdstat_ent *o = old;
+	int changed = 0;
+
+	for (; new; new = new->next) {
+		/* Arrays are normally in the same order as last time */
+		struct mdstat_ent *e = find_dev(o, NULL, new->dev);
+		if (!e)
+			e = find_dev(old, o, new->dev);
+		if (!e)
+			new->changed = 1;
+		else {
+			new->changed =
+				e->active != new->active ||
+				e->percent != new->percent ||
+				e->resync != new->resync ||
+				e->devcnt != new->devcnt ||
+				e->raid_disks != new->raid_disks ||
+				str_differ(e->level, new->level) ||
+				str_differ(e->pattern, new->pattern) ||
+				str_differ(e->metadata_version,
+					   new->metadata_version) ||
+				str_differ(e->devs, new->devs);
+			o = e->next;
+		}
+		changed += new->changed;
+	}
+	return changed;
+}
+
+/* /proc/mdstat signals a change with POLLPRI.  It is kept in an epoll
+ * set so each wait is a single system call.  If epoll is not
+ * available we fall back to select.
+ */
+static int mdstat_epfd = -1;
+static int mdstat_epoll_other = -1;
+
+static int mdstat_epoll(void)
+{
+	struct epoll_event ev;
+
+	if (mdstat_epfd >= 0 || mdstat_fd < 0)
+		return mdstat_epfd;
+	mdstat_epfd = epoll_create(2);
+	if (mdstat_epfd < 0)
+		return -1;
+	fcntl(mdstat_epfd, F_SETFD, FD_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI;
+	ev.data.fd = mdstat_fd;
+	if (epoll_ctl(mdstat_epfd, EPOLL_CTL_ADD, mdstat_fd, &ev) < 0) {
+		close(mdstat_epfd);
+		mdstat_epfd = -1;
+	}
+	return mdstat_epfd;
+}
+
 void mdstat_wait(int seconds)
 {
 	fd_set fds;
 	struct timeval tm;
 	int maxfd = 0;
+	int epfd = mdstat_epoll();
+
+	if (epfd >= 0) {
+		struct epoll_event ev;
+		if (mdstat_epoll_other >= 0) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL,
+				  mdstat_epoll_other, &ev);
+			mdstat_epoll_other = -1;
+		}
+		epoll_wait(epfd, &ev, 1, seconds * 1000);
+		return;
+	}
+
 	FD_ZERO(&fds);
 	if (mdstat_fd >= 0) {
 		FD_SET(mdstat_fd, &fds);
@@ -321,11 +801,8 @@ void mdstat_wait_fd(int fd, const sigset_t *sigmask)
 {
 	fd_set fds, rfds;
 	int maxfd = 0;
-
-	FD_ZERO(&fds);
-	FD_ZERO(&rfds);
-	if (mdstat_fd >= 0)
-		FD_SET(mdstat_fd, &fds);
+	int pri = 0;
+	int epfd = mdstat_epoll();
 
 	if (fd >= 0) {
 		struct stat stb;
@@ -335,6 +812,45 @@ void mdstat_wait_fd(int fd, const sigset_t *sigmask)
 			 * POLLPRI
 			 * i.e. an 'exceptional' event.
 			 */
+			pri = 1;
+	}
+
+	if (epfd >= 0) {
+		struct epoll_event ev;
+		int ok = 1;
+
+		/* The other fd is normally the same every time and stays
+		 * registered, but it might have been closed and the
+		 * number reused, so always (re)add it.
+		 */
+		if (mdstat_epoll_other >= 0 && mdstat_epoll_other != fd)
+			epoll_ctl(epfd, EPOLL_CTL_DEL,
+				  mdstat_epoll_other, &ev);
+		mdstat_epoll_other = -1;
+		if (fd >= 0) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = pri ? EPOLLPRI : EPOLLIN;
+			ev.data.fd = fd;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+			    (errno != EEXIST ||
+			     epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0))
+				ok = 0;
+			else
+				mdstat_epoll_other = fd;
+		}
+		if (ok) {
+			epoll_pwait(epfd, &ev, 1, -1, sigmask);
+			return;
+		}
+	}
+
+	FD_ZERO(&fds);
+	FD_ZERO(&rfds);
+	if (mdstat_fd >= 0)
+		FD_SET(mdstat_fd, &fds);
+
+	if (fd >= 0) {
+		if (pri)
 			FD_SET(fd, &fds);
 		else
 			FD_SET(fd, &rfds);
@@ -352,13 +868,13 @@ void mdstat_wait_fd(int fd, const sigset_t *sigmask)
 
 int mddev_busy(int devnum)
 {
-	struct mdstat_ent *mdstat = mdstat_read(0, 0);
+	static struct mdstat_arena arena;
+	struct mdstat_ent *mdstat = mdstat_read_arena(&arena, 0, 0);
 	struct mdstat_ent *me;
 
 	for (me = mdstat ; me ; me = me->next)
 		if (me->devnum == devnum)
 			break;
-	free_mdstat(mdstat);
 	return me != NULL;
 }
 
@@ -421,3 +937,142 @@ struct mdstat_ent *mdstat_by_subdev(char *subdev, int container)
 	}
 	return NULL;
 }
+
+#ifdef MAIN
+/* Micro-benchmark: time mdstat_read() and mdstat_read_arena() on a
+ * synthetic /proc/mdstat listing many arrays, and check they agree.
+ *   test_mdstat [arrays [iterations]]
+ */
+static void make_mdstat(FILE *f, int arrays)
+{
+	int i, d;
+
+	fprintf(f, "Personalities : [raid1] [raid6] [raid5] [raid4]\n");
+	for (i = 0; i < arrays; i++) {
+		switch (i % 4) {
+		case 0:
+			fprintf(f, "md%d : active raid1 sd%d[1] sd%d[0]\n"
+				"      1047552 blocks super 1.2 [2/2] [UU]\n"
+				"      bitmap: 1/8 pages [4KB], 65536KB chunk\n\n",
+				i, i*8+1, i*8);
+			break;
+		case 1:
+			fprintf(f, "md%d : active raid5", i);
+			for (d = 3; d >= 0; d--)
+				fprintf(f, " sd%d[%d]", i*8+d, d);
+			fprintf(f, "\n      3142656 blocks super 1.2 level 5,"
+				" 512k chunk, algorithm 2 [4/4] [UUUU]\n"
+				"      [=>...................]  resync =  7.5%%"
+				" (79104/1047552) finish=0.4min"
+				" speed=39552K/sec\n\n");
+			break;
+		case 2:
+			fprintf(f, "md%d : active raid6", i);
+			for (d = 5; d >= 0; d--)
+				fprintf(f, " sd%d[%d]%s", i*8+d, d,
+					d == 2 ? "(F)" : "");
+			fprintf(f, "\n      4190208 blocks level 6, 64k chunk,"
+				" algorithm 2 [6/5] [UU_UUU]\n\n");
+			break;
+		case 3:
+			fprintf(f, "md%d : inactive sd%d[1](S) sd%d[0](S)\n"
+				"      5928 blocks super external:imsm\n\n",
+				i, i*8+1, i*8);
+			break;
+		}
+	}
+	fprintf(f, "unused devices: <none>\n");
+}
+
+static int same_ent(struct mdstat_ent *a, struct mdstat_ent *b)
+{
+	struct dev_member *ma, *mb;
+
+	if (strcmp(a->dev, b->dev) || a->devnum != b->devnum ||
+	    a->active != b->active || a->percent != b->percent ||
+	    a->resync != b->resync || a->devcnt != b->devcnt ||
+	    a->raid_disks != b->raid_disks ||
+	    str_differ(a->level, b->level) ||
+	    str_differ(a->pattern, b->pattern) ||
+	    str_differ(a->metadata_version, b->metadata_version) ||
+	    str_differ(a->devs, b->devs))
+		return 0;
+	for (ma = a->members, mb = b->members; ma && mb;
+	     ma = ma->next, mb = mb->next)
+		if (strcmp(ma->name, mb->name))
+			return 0;
+	return ma == mb;
+}
+
+static double now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	char name[] = "/tmp/mdstat.XXXXXX";
+	int arrays = argc > 1 ? atoi(argv[1]) : 1000;
+	int iters = argc > 2 ? atoi(argv[2]) : 200;
+	struct mdstat_arena arena;
+	struct mdstat_ent *ms, *ma, *e1, *e2;
+	double t;
+	int i, cnt = 0;
+	int fd = mkstemp(name);
+	FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+	if (!f) {
+		perror("mkstemp");
+		return 1;
+	}
+	make_mdstat(f, arrays);
+	fflush(f);
+	mdstat_file = name;
+	memset(&arena, 0, sizeof(arena));
+
+	ms = mdstat_read(0, 0);
+	ma = mdstat_read_arena(&arena, 0, 0);
+	for (e1 = ms, e2 = ma; e1 && e2; e1 = e1->next, e2 = e2->next, cnt++)
+		if (!same_ent(e1, e2)) {
+			fprintf(stderr, "%s differs\n", e1->dev);
+			break;
+		}
+	free_mdstat(ms);
+	if (e1 || e2 || cnt != arrays) {
+		fprintf(stderr, "mdstat_read and mdstat_read_arena disagree\n");
+		fclose(f);
+		unlink(name);
+		return 1;
+	}
+
+	t = now_us();
+	for (i = 0; i < iters; i++)
+		free_mdstat(mdstat_read(0, 0));
+	printf("mdstat_read:               %8.1f us/call\n",
+	       (now_us() - t) / iters);
+
+	free_mdstat(mdstat_read(1, 0));
+	t = now_us();
+	for (i = 0; i < iters; i++)
+		free_mdstat(mdstat_read(1, 0));
+	printf("mdstat_read (unchanged):   %8.1f us/call\n",
+	       (now_us() - t) / iters);
+
+	t = now_us();
+	for (i = 0; i < iters; i++)
+		mdstat_read_arena(&arena, 0, 0);
+	printf("mdstat_read_arena:         %8.1f us/call\n",
+	       (now_us() - t) / iters);
+	printf("%d arrays, %ld bytes of text, %lu bytes of arena\n",
+	       arrays, (long)lseek(fd, 0, SEEK_END),
+	       (unsigned long)arena.mem_size);
+
+	mdstat_arena_free(&arena);
+	fclose(f);
+	unlink(name);
+	return 0;
+}
+#endif /* MAIN */
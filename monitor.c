@@ -22,6 +22,7 @@
 #include "mdmon.h"
 #include <sys/syscall.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <signal.h>
 
 static char *array_states[] = {
@@ -45,6 +46,45 @@ static void add_fd(fd_set *fds, int *maxfd, int fd)
 	FD_SET(fd, fds);
 }
 
+/* The monitor sleeps in epoll on every sysfs attribute it watches.
+ * The manager adds each fd as soon as it opens it, with the devnum of
+ * its array as the token, so a wakeup tells us which arrays changed
+ * and only those need to be read.  A clone made by the manager shares
+ * its fds and devnum with the original, and closing an fd takes it
+ * out of the set, so a token can never refer to the wrong array.
+ * If epoll cannot be used we fall back to pselect on everything.
+ */
+int monitor_epfd = -1;
+static int monitor_epoll_failed;
+
+void monitor_epoll_init(void)
+{
+	monitor_epfd = epoll_create(64);
+	if (monitor_epfd >= 0)
+		fcntl(monitor_epfd, F_SETFD, FD_CLOEXEC);
+}
+
+void monitor_watch(int fd, int devnum)
+{
+	struct epoll_event ev;
+
+	if (monitor_epfd < 0 || fd < 0)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI;
+	ev.data.u32 = devnum;
+	if (epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		return;
+	if (errno == EEXIST &&
+	    epoll_ctl(monitor_epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return;
+	/* Cannot trust epoll to see every change any more.  The
+	 * manager is about to hand us the array this fd belongs to,
+	 * which wakes us, and from then on we use pselect.
+	 */
+	monitor_epoll_failed = 1;
+}
+
 static int read_attr(char *buf, int len, int fd)
 {
 	int n;
@@ -199,20 +239,28 @@ static void signal_manager(void)
  *
  * We wait for a change (poll/select) on array_state, sync_action, and
  * each rd-X/state file.
- * When we get any change, we check everything.  So read each state file,
- * then decide what to do.
+ * When we get a change, we check every array it belongs to.  So read
+ * each state file of those arrays, then decide what to do.
  *
  * The core action is to write new metadata to all devices in the array.
- * This is done at most once on any wakeup.
+ * This is done at most once on any wakeup, for all arrays together.
  * After that we might:
  *   - update the array_state
  *   - set the role of some devices.
  *   - request a sync_action
  *
+ * read_and_act() does the reading and deciding for one array, and
+ * records what it decided in the metadata.  effect_changes() then does
+ * the rest, once the metadata has been written, and only after that
+ * is the manager asked to look for spares or new devices.
  */
 
 #define ARRAY_DIRTY 1
 #define ARRAY_BUSY 2
+#define ARRAY_FAILING 4	/* a member device has just failed */
+#define ARRAY_WAITING 8	/* array can't go active until metadata is written */
+#define ARRAY_CHECK_DEGRADED 16	/* manager should look for spares */
+#define ARRAY_CHECK_RESHAPE 32	/* manager should look for new devices */
 static int read_and_act(struct active_array *a)
 {
 	unsigned long long sync_completed;
@@ -340,6 +388,8 @@ static int read_and_act(struct active_array *a)
 		if (mdi->curr_state & DS_FAULTY) {
 			a->container->ss->set_disk(a, mdi->disk.raid_disk,
 						   mdi->curr_state);
+			if (!(mdi->prev_state & DS_FAULTY))
+				ret |= ARRAY_FAILING;
 			check_degraded = 1;
 			if (mdi->curr_state & DS_BLOCKED)
 				mdi->next_state |= DS_UNBLOCK;
@@ -398,7 +448,38 @@ static int read_and_act(struct active_array *a)
 	if (sync_completed > a->last_checkpoint)
 		a->last_checkpoint = sync_completed;
 
-	a->container->ss->sync_metadata(a->container);
+	if (a->next_state == active)
+		ret |= ARRAY_WAITING;
+
+	/* manager will do the actual check */
+	if (check_degraded)
+		ret |= ARRAY_CHECK_DEGRADED;
+	if (check_reshape)
+		ret |= ARRAY_CHECK_RESHAPE;
+
+	return ret;
+}
+
+/* read_and_act() on an array that changed, noting what it returned
+ * for after the metadata has been written.
+ */
+static int act_on(struct active_array *a)
+{
+	int ret;
+
+	a->woken = 0;
+	a->acting = 1;
+	ret = read_and_act(a);
+	a->dirty = !!(ret & ARRAY_DIRTY);
+	a->checks = ret & (ARRAY_CHECK_DEGRADED|ARRAY_CHECK_RESHAPE);
+	return ret;
+}
+
+static int effect_changes(struct active_array *a)
+{
+	struct mdinfo *mdi;
+	int ret = 0;
+
 	dprintf("%s(%d): state:%s action:%s next(", __func__, a->info.container_member,
 		array_states[a->curr_state], sync_actions[a->curr_action]);
 
@@ -450,16 +531,8 @@ static int read_and_act(struct active_array *a)
 		mdi->next_state = 0;
 	}
 
-	if (check_degraded || check_reshape) {
-		/* manager will do the actual check */
-		if (check_degraded)
-			a->check_degraded = 1;
-		if (check_reshape)
-			a->check_reshape = 1;
-		signal_manager();
-	}
-
-	if (deactivate)
+	/* Only a stopped array is set to 'clear' */
+	if (a->next_state == clear)
 		a->container = NULL;
 
 	return ret;
@@ -522,8 +595,92 @@ static void dprint_wake_reasons(fd_set *fds)
 	}
 	fprintf(stderr, ")\n");
 }
+
+static void dprint_wake_events(struct epoll_event *events, int cnt)
+{
+	int i;
+
+	fprintf(stderr, "monitor: wake ( ");
+	for (i = 0; i < cnt; i++)
+		fprintf(stderr, "%s ", devnum2devname((int)events[i].data.u32));
+	fprintf(stderr, ")\n");
+}
 #endif
 
+/* Note which arrays the attributes that fired belong to.  A replacement
+ * array shares its devnum with the one it replaces, so both are marked.
+ */
+static void mark_woken(struct active_array *aa,
+		       struct epoll_event *events, int cnt)
+{
+	struct active_array *a;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		for (a = aa; a; a = a->next)
+			if (a->devnum == (int)events[i].data.u32)
+				a->woken = 1;
+}
+
+#define MONITOR_EVENTS 16
+static struct epoll_event events[MONITOR_EVENTS];
+
+/* A shelf going away fails many member devices within a few
+ * milliseconds, and each failure would otherwise cost a metadata write
+ * of its own.  So when devices have just failed, and no array is
+ * waiting for the metadata before it can go active, hold the commit
+ * back until nothing has changed for COMMIT_QUIET_MS, but never for
+ * more than COMMIT_WINDOW_MS, and record everything that changed
+ * meanwhile in the same write.
+ * SIGUSR1 stays blocked here, so a request from the manager waits
+ * for the next pass.  So does an array that changes again after it
+ * has been read in this pass, as what was decided for it must be
+ * carried out first.
+ */
+#define COMMIT_WINDOW_MS 10
+#define COMMIT_QUIET_MS 2
+
+static void commit_window(struct supertype *container)
+{
+	struct timeval start, now;
+	struct active_array *a;
+	int fresh;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		long elapsed, tmo;
+		int n;
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_usec - start.tv_usec) / 1000;
+		if (elapsed >= COMMIT_WINDOW_MS)
+			return;
+		tmo = COMMIT_WINDOW_MS - elapsed;
+		if (tmo > COMMIT_QUIET_MS)
+			tmo = COMMIT_QUIET_MS;
+		n = epoll_wait(monitor_epfd, events, MONITOR_EVENTS, tmo);
+		if (n <= 0)
+			return;
+		mark_woken(container->arrays, events, n);
+		fresh = 0;
+		for (a = container->arrays; a; a = a->next) {
+			/* replacements are dealt with on the next pass */
+			if (!a->woken || a->acting || a->replaces ||
+			    !a->container || a->to_remove)
+				continue;
+			fresh++;
+			if (act_on(a) & ARRAY_WAITING)
+				return;
+		}
+		/* Only arrays already read have changed.  Their events
+		 * stay pending until the next pass, so stop waiting now.
+		 */
+		if (!fresh)
+			return;
+	}
+}
+
 int monitor_loop_cnt;
 
 static int wait_and_act(struct supertype *container, int nowait)
@@ -535,6 +692,11 @@ static int wait_and_act(struct supertype *container, int nowait)
 	int rv;
 	struct mdinfo *mdi;
 	static unsigned int dirty_arrays = ~0; /* start at some non-zero value */
+	int acted = 0;
+	int ret;
+	int use_epoll = monitor_epfd >= 0 && !monitor_epoll_failed;
+	int all = 1; /* act on every array, not just those that woke us */
+	int checks = 0;
 
 	FD_ZERO(&rfds);
 
@@ -555,11 +717,13 @@ static int wait_and_act(struct supertype *container, int nowait)
 			continue;
 		}
 
-		add_fd(&rfds, &maxfd, a->info.state_fd);
-		add_fd(&rfds, &maxfd, a->action_fd);
-		add_fd(&rfds, &maxfd, a->sync_completed_fd);
-		for (mdi = a->info.devs ; mdi ; mdi = mdi->next)
-			add_fd(&rfds, &maxfd, mdi->state_fd);
+		if (!use_epoll) {
+			add_fd(&rfds, &maxfd, a->info.state_fd);
+			add_fd(&rfds, &maxfd, a->action_fd);
+			add_fd(&rfds, &maxfd, a->sync_completed_fd);
+			for (mdi = a->info.devs ; mdi ; mdi = mdi->next)
+				add_fd(&rfds, &maxfd, mdi->state_fd);
+		}
 
 		ap = &(*ap)->next;
 	}
@@ -607,12 +771,30 @@ static int wait_and_act(struct supertype *container, int nowait)
 		sigprocmask(SIG_UNBLOCK, NULL, &set);
 		sigdelset(&set, SIGUSR1);
 		monitor_loop_cnt |= 1;
-		rv = pselect(maxfd+1, NULL, NULL, &rfds, &ts, &set);
+		if (use_epoll) {
+			rv = epoll_pwait(monitor_epfd, events, MONITOR_EVENTS,
+					 ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+					 &set);
+			/* Only a change to watched attributes can be
+			 * handled array by array.  The manager always
+			 * signals us when it changes the list, and a
+			 * timeout means something asked to be retried.
+			 */
+			if (rv > 0 && !container->retry_soon && !sigterm) {
+				all = 0;
+				mark_woken(*aap, events, rv);
+				#ifdef DEBUG
+				dprint_wake_events(events, rv);
+				#endif
+			}
+		} else
+			rv = pselect(maxfd+1, NULL, NULL, &rfds, &ts, &set);
 		monitor_loop_cnt += 1;
 		if (rv == -1 && errno == EINTR)
 			rv = 0;
 		#ifdef DEBUG
-		dprint_wake_reasons(&rfds);
+		if (!use_epoll)
+			dprint_wake_reasons(&rfds);
 		#endif
 		container->retry_soon = 0;
 	}
@@ -626,11 +808,11 @@ static int wait_and_act(struct supertype *container, int nowait)
 		update_queue_handled = update_queue;
 		update_queue = NULL;
 		signal_manager();
-		container->ss->sync_metadata(container);
+		/* written below, together with any array changes */
+		all = 1;
 	}
 
 	rv = 0;
-	dirty_arrays = 0;
 	for (a = *aap; a ; a = a->next) {
 
 		if (a->replaces && !discard_this) {
@@ -644,22 +826,57 @@ static int wait_and_act(struct supertype *container, int nowait)
 			a->replaces = NULL;
 			/* FIXME check if device->state_fd need to be cleared?*/
 			signal_manager();
+			a->woken = 1;
 		}
 		if (a->container && !a->to_remove) {
-			int ret = read_and_act(a);
 			rv |= 1;
-			dirty_arrays += !!(ret & ARRAY_DIRTY);
-			/* when terminating stop manipulating the array after it
-			 * is clean, but make sure read_and_act() is given a
-			 * chance to handle 'active_idle'
-			 */
-			if (sigterm && !(ret & ARRAY_DIRTY))
-				a->container = NULL; /* stop touching this array */
-			if (ret & ARRAY_BUSY)
-				container->retry_soon = 1;
+			if (!all && !a->woken)
+				/* nothing changed since we last looked */
+				continue;
+			acted |= act_on(a);
 		}
 	}
 
+	if (use_epoll && (acted & ARRAY_FAILING) &&
+	    !(acted & ARRAY_WAITING) && !sigterm)
+		commit_window(container);
+
+	/* One metadata write covers every array */
+	container->ss->sync_metadata(container);
+
+	dirty_arrays = 0;
+	for (a = *aap; a ; a = a->next) {
+		int acting = a->acting;
+
+		a->acting = 0;
+		if (!a->container || a->to_remove)
+			continue;
+		dirty_arrays += a->dirty;
+		if (!acting)
+			continue;
+		ret = effect_changes(a);
+		/* when terminating stop manipulating the array after it
+		 * is clean, but make sure read_and_act() is given a
+		 * chance to handle 'active_idle'
+		 */
+		if (sigterm && !a->dirty)
+			a->container = NULL; /* stop touching this array */
+		if (ret & ARRAY_BUSY)
+			container->retry_soon = 1;
+		/* The failure is on disk and the device is out of the
+		 * array, so the manager can go ahead with spares.
+		 */
+		if (a->checks & ARRAY_CHECK_DEGRADED)
+			a->check_degraded = 1;
+		if (a->checks & ARRAY_CHECK_RESHAPE)
+			a->check_reshape = 1;
+		if (a->checks)
+			checks = 1;
+		a->checks = 0;
+	}
+	if (checks)
+		signal_manager();
+
 	/* propagate failures across container members */
 	for (a = *aap; a ; a = a->next) {
 		if (!a->container || a->to_remove)
@@ -442,16 +442,28 @@ const struct imsm_orom *find_imsm_orom(void)
 	return find_imsm_hba_orom(SYS_DEV_SATA);
 }
 
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+#include <pthread.h>
+/* The option-rom and EFI results are cached in static storage and the
+ * rom probe swaps signal handlers, so superblocks being loaded from
+ * several threads (see probe_devices()) must take turns here.
+ */
+static pthread_mutex_t capability_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 const struct imsm_orom *find_imsm_capability(enum sys_dev_type hba_id)
 {
 	const struct imsm_orom *cap=NULL;
 
-
-	if ((cap = find_imsm_efi(hba_id)) != NULL)
-		return cap;
-	if ((cap = find_imsm_hba_orom(hba_id)) != NULL)
-		return cap;
-	return NULL;
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+	pthread_mutex_lock(&capability_lock);
+#endif
+	if ((cap = find_imsm_efi(hba_id)) == NULL)
+		cap = find_imsm_hba_orom(hba_id);
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+	pthread_mutex_unlock(&capability_lock);
+#endif
+	return cap;
 }
 
 char *devt_to_devpath(dev_t dev)
@@ -26,11 +26,9 @@
 #include <stdint.h>
 #include <signal.h>
 #include <sys/mman.h>
-
-int geo_map(int block, unsigned long long stripe, int raid_disks,
-	    int level, int layout);
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size);
-void make_tables(void);
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 
 /* Collect per stripe consistency information */
 void raid6_collect(int chunk_size, uint8_t *p, uint8_t *q,
@@ -101,118 +99,736 @@ int raid6_stats(int *results, int raid_disks, int chunk_size)
 	return curr_broken_disk;
 }
 
+/* What was found wrong with one stripe */
+struct stripe_report {
+	unsigned long long stripe;
+	int diskP, diskQ;
+	int p_wrong, q_wrong;
+	int disk;	/* failed slot, -65535 if unknown, -255 if none */
+	int read_err;	/* slot that could not be read, or -1 */
+};
+
+struct check_job;
+
+/* Each worker has its own buffers, and collects reports of the
+ * stripes it found to be inconsistent.
+ */
+struct check_worker {
+	struct check_job *job;
+	int id;
+	char *stripe_buf;
+	char **stripes;		/* raid_disks per stripe in the window */
+	int *read_err;		/* what read_stripe() said of each one */
+	char **blocks;
+	uint8_t *p;
+	uint8_t *q;
+	int *results;
+	struct stripe_report *reports;
+	int nreports;
+	int maxreports;
+	int next_repair;	/* first report not yet considered for repair */
+	int read_errors;
+#ifdef USE_PTHREADS
+	pthread_t thread;
+	unsigned long round;
+#endif
+};
+
+struct check_job {
+	int *source;
+	unsigned long long *offsets;
+	int raid_disks;
+	int chunk_size;
+	int level;
+	int layout;
+	char **name;
+	int jobs;
+	struct check_worker *workers;
+
+	/* Each round suspends IO to 'window' stripes, which is adjusted
+	 * after each round to keep the time IO is suspended near
+	 * 'max_stall' milliseconds, unless 'fixed_window' is set.
+	 */
+	unsigned long long window;
+	unsigned long long max_window;
+	int fixed_window;
+	double max_stall;
+	int per_worker;			/* stripes buffered per worker */
+	unsigned long rounds;
+	double total_stall, longest_stall;
+
+	/* Rewrite blocks that raid6_stats can pin a mismatch on */
+	int repair;
+	int dry_run;
+	unsigned long repaired;
+
+	/* The stripes being checked in this round */
+	unsigned long long lo;
+	unsigned long long n;
+#ifdef USE_PTHREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long round;
+	int reading, checking;
+	int stop;
+#endif
+};
+
+static int worker_init(struct check_worker *w, struct check_job *job, int id)
+{
+	int raid_disks = job->raid_disks;
+	int chunk_size = job->chunk_size;
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	w->job = job;
+	w->id = id;
+	w->stripe_buf = malloc((size_t)job->per_worker * raid_disks * chunk_size);
+	w->stripes = malloc(job->per_worker * raid_disks * sizeof(char*));
+	w->read_err = malloc(job->per_worker * sizeof(int));
+	w->blocks = malloc(raid_disks * sizeof(char*));
+	w->p = malloc(chunk_size);
+	w->q = malloc(chunk_size);
+	w->results = malloc(chunk_size * sizeof(int));
+
+	if((w->stripe_buf == NULL) ||
+	   (w->stripes == NULL) ||
+	   (w->read_err == NULL) ||
+	   (w->blocks == NULL) ||
+	   (w->p == NULL) ||
+	   (w->q == NULL) ||
+	   (w->results == NULL))
+		return 1;
+
+	for ( i = 0 ; i < job->per_worker * raid_disks ; i++)
+		w->stripes[i] = w->stripe_buf + (size_t)i * chunk_size;
+	return 0;
+}
+
+static void worker_free(struct check_worker *w)
+{
+	free(w->stripe_buf);
+	free(w->stripes);
+	free(w->read_err);
+	free(w->blocks);
+	free(w->p);
+	free(w->q);
+	free(w->results);
+	free(w->reports);
+}
+
+static void print_report(struct check_job *job, struct stripe_report *r)
+{
+	if (r->read_err >= 0) {
+		printf("Read error at %llu: slot %d --> %s\n",
+		       r->stripe, r->read_err, job->name[r->read_err]);
+		return;
+	}
+	if (r->p_wrong)
+		printf("P(%d) wrong at %llu\n", r->diskP, r->stripe);
+	if (r->q_wrong)
+		printf("Q(%d) wrong at %llu\n", r->diskQ, r->stripe);
+	if(r->disk >= 0) {
+		printf("Error detected at %llu: possible failed disk slot: %d --> %s\n",
+			r->stripe, r->disk, job->name[r->disk]);
+	}
+	if(r->disk == -65535) {
+		printf("Error detected at %llu: disk slot unknown\n", r->stripe);
+	}
+}
+
+/* The workers share the member fds, so they must not move the file
+ * offset.  Returns the first slot that could not be read in full, or -1.
+ */
+static int read_stripe(struct check_worker *w, unsigned long long stripe,
+		       char **stripes)
+{
+	struct check_job *job = w->job;
+	int i;
+
+	for (i = 0 ; i < job->raid_disks ; i++)
+		if (pread64(job->source[i], stripes[i], job->chunk_size,
+			    job->offsets[i] + stripe * job->chunk_size)
+		    != job->chunk_size)
+			return i;
+	return -1;
+}
+
+/* Compute P and Q for the stripe in 'stripes' and compare them with
+ * what is on disk.  Returns 1 and fills in 'r' if they don't match.
+ */
+static int examine_stripe(struct check_worker *w, unsigned long long stripe,
+			  char **stripes, struct stripe_report *r, int verbose)
+{
+	struct check_job *job = w->job;
+	int raid_disks = job->raid_disks;
+	int chunk_size = job->chunk_size;
+	int level = job->level;
+	int layout = job->layout;
+	int data_disks = raid_disks - 2;
+	int i;
+
+	if (verbose)
+		printf("pos --> %llu\n", stripe);
+	for (i = 0 ; i < data_disks ; i++) {
+		int disk = geo_map(i, stripe, raid_disks, level, layout);
+		w->blocks[i] = stripes[disk];
+		if (verbose)
+			printf("%d->%d\n", i, disk);
+	}
+
+	qsyndrome(w->p, w->q, (uint8_t**)w->blocks, data_disks, chunk_size);
+	r->stripe = stripe;
+	r->diskP = geo_map(-1, stripe, raid_disks, level, layout);
+	r->p_wrong = memcmp(w->p, stripes[r->diskP], chunk_size) != 0;
+	r->diskQ = geo_map(-2, stripe, raid_disks, level, layout);
+	r->q_wrong = memcmp(w->q, stripes[r->diskQ], chunk_size) != 0;
+	if (!r->p_wrong && !r->q_wrong)
+		/* raid6_stats would find nothing */
+		return 0;
+
+	raid6_collect(chunk_size, w->p, w->q, stripes[r->diskP],
+		      stripes[r->diskQ], w->results);
+	r->disk = raid6_stats(w->results, raid_disks, chunk_size);
+
+	if(r->disk >= -2) {
+		r->disk = geo_map(r->disk, stripe, raid_disks, level, layout);
+	}
+	return 1;
+}
+
+static void check_stripe(struct check_worker *w, unsigned long long stripe,
+			 char **stripes, int read_err)
+{
+	struct check_job *job = w->job;
+	/* A single job reports as it goes, as raid6check always has */
+	int verbose = job->jobs == 1;
+	struct stripe_report r;
+
+	if (read_err >= 0) {
+		/* Nothing to check, and nothing to repair */
+		memset(&r, 0, sizeof(r));
+		r.stripe = stripe;
+		r.disk = -255;
+		w->read_errors++;
+	} else if (!examine_stripe(w, stripe, stripes, &r, verbose))
+		return;
+	r.read_err = read_err;
+	if (verbose) {
+		print_report(job, &r);
+		if (!job->repair)
+			return;
+	}
+	if (w->nreports >= w->maxreports) {
+		int max = w->maxreports ? w->maxreports * 2 : 64;
+		struct stripe_report *n = realloc(w->reports,
+						  max * sizeof(*n));
+		if (n == NULL) {
+			/* No room to keep it, so report it now */
+			if (!verbose)
+				print_report(job, &r);
+			return;
+		}
+		w->reports = n;
+		w->maxreports = max;
+	}
+	w->reports[w->nreports++] = r;
+}
+
+/* Stripes lo .. lo+n-1 are shared among the workers round-robin.
+ * n is never more than jobs * per_worker, so each has room to
+ * buffer all of its stripes.
+ */
+static void worker_read(struct check_worker *w)
+{
+	struct check_job *job = w->job;
+	unsigned long long s;
+	int slot = 0;
+
+	for (s = job->lo + w->id; s < job->lo + job->n; s += job->jobs, slot++)
+		w->read_err[slot] = read_stripe(w, s,
+					w->stripes + job->raid_disks * slot);
+}
+
+static void worker_check(struct check_worker *w)
+{
+	struct check_job *job = w->job;
+	unsigned long long s;
+	int slot = 0;
+
+	for (s = job->lo + w->id; s < job->lo + job->n; s += job->jobs, slot++)
+		check_stripe(w, s, w->stripes + job->raid_disks * slot,
+			     w->read_err[slot]);
+}
+
+#ifdef USE_PTHREADS
+/* Reads have to happen while IO to the stripes is suspended.  The
+ * checking doesn't, so main thread can resume IO as soon as every
+ * worker has read its stripes.
+ */
+static void *worker_thread(void *v)
+{
+	struct check_worker *w = v;
+	struct check_job *job = w->job;
+
+	pthread_mutex_lock(&job->lock);
+	while (1) {
+		while (!job->stop && w->round == job->round)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->stop)
+			break;
+		w->round = job->round;
+		pthread_mutex_unlock(&job->lock);
+
+		worker_read(w);
+		pthread_mutex_lock(&job->lock);
+		job->reading--;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+
+		worker_check(w);
+		pthread_mutex_lock(&job->lock);
+		job->checking--;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+#endif
+
+/* Read all the stripes in the round.  Returns once the reads are done */
+static void start_round(struct check_job *job, unsigned long long lo,
+			unsigned long long n)
+{
+	job->lo = lo;
+	job->n = n;
+#ifdef USE_PTHREADS
+	if (job->jobs > 1) {
+		pthread_mutex_lock(&job->lock);
+		job->reading = job->checking = job->jobs;
+		job->round++;
+		pthread_cond_broadcast(&job->cond);
+		while (job->reading)
+			pthread_cond_wait(&job->cond, &job->lock);
+		pthread_mutex_unlock(&job->lock);
+		return;
+	}
+#endif
+	worker_read(&job->workers[0]);
+}
+
+/* Check the stripes that start_round read */
+static void finish_round(struct check_job *job)
+{
+#ifdef USE_PTHREADS
+	if (job->jobs > 1) {
+		pthread_mutex_lock(&job->lock);
+		while (job->checking)
+			pthread_cond_wait(&job->cond, &job->lock);
+		pthread_mutex_unlock(&job->lock);
+		return;
+	}
+#endif
+	worker_check(&job->workers[0]);
+}
+
+static int cmp_report(const void *a, const void *b)
+{
+	const struct stripe_report *ra = a, *rb = b;
+
+	if (ra->stripe < rb->stripe)
+		return -1;
+	return ra->stripe > rb->stripe;
+}
+
+/* Gather what all the workers found and print it in stripe order */
+static void merge_reports(struct check_job *job)
+{
+	struct stripe_report *all;
+	int total = 0;
+	int i, j;
+
+	for (i = 0; i < job->jobs; i++)
+		total += job->workers[i].nreports;
+	if (total == 0)
+		return;
+	all = malloc(total * sizeof(*all));
+	if (all == NULL) {
+		/* print them unsorted then */
+		for (i = 0; i < job->jobs; i++)
+			for (j = 0; j < job->workers[i].nreports; j++)
+				print_report(job, &job->workers[i].reports[j]);
+		return;
+	}
+	for (i = 0, j = 0; i < job->jobs; i++) {
+		memcpy(all + j, job->workers[i].reports,
+		       job->workers[i].nreports * sizeof(*all));
+		j += job->workers[i].nreports;
+	}
+	qsort(all, total, sizeof(*all), cmp_report);
+	for (i = 0; i < total; i++)
+		print_report(job, &all[i]);
+	free(all);
+}
+
+/* Rewrite the one block of a stripe that is inconsistent with the
+ * others.  This is only done if the stripe still shows the same single
+ * culprit when read again with IO to it suspended, and if the block
+ * rebuilt from Q and the other data then agrees with P too.
+ * On return, IO is suspended only from 'resume' onwards, which is
+ * where the next round will start.
+ */
+static int repair_stripe(struct mdinfo *info, struct check_job *job,
+			 struct stripe_report *found, unsigned long long resume)
+{
+	struct check_worker *w = &job->workers[0];
+	int raid_disks = job->raid_disks;
+	int chunk_size = job->chunk_size;
+	int data_disks = raid_disks - 2;
+	unsigned long long stripe = found->stripe;
+	unsigned long long step = (unsigned long long)chunk_size * data_disks;
+	char **stripes = w->stripes;
+	struct stripe_report r;
+	char *fixed = NULL;
+	const char *what;
+	int rv = 0;
+	int disk = found->disk;
+	int i;
+
+	if (!job->dry_run) {
+		rv = sysfs_set_num(info, NULL, "suspend_hi", (stripe + 1) * step);
+		rv |= sysfs_set_num(info, NULL, "suspend_lo", stripe * step);
+		if (rv)
+			goto resume;
+	}
+	i = read_stripe(w, stripe, stripes);
+	if (i >= 0) {
+		printf("Stripe %llu: cannot read slot %d, not repairing\n",
+		       stripe, i);
+		goto resume;
+	}
+	if (!examine_stripe(w, stripe, stripes, &r, 0) || r.disk != disk) {
+		printf("Stripe %llu changed, not repairing slot %d\n",
+		       stripe, disk);
+		goto resume;
+	}
+
+	if (disk == r.diskP) {
+		fixed = (char*)w->p;
+		what = "P";
+	} else if (disk == r.diskQ) {
+		fixed = (char*)w->q;
+		what = "Q";
+	} else {
+		/* Treat the block and P as failed, rebuild both from Q,
+		 * and make sure P comes out as it is on disk.
+		 */
+		uint8_t *ptrs[raid_disks];
+		int faila = -1;
+
+		for (i = 0; i < data_disks; i++) {
+			ptrs[i] = (uint8_t*)w->blocks[i];
+			if (w->blocks[i] == stripes[disk])
+				faila = i;
+		}
+		ptrs[data_disks] = w->p;
+		ptrs[data_disks+1] = (uint8_t*)stripes[r.diskQ];
+		raid6_datap_recov(raid_disks, chunk_size, faila, ptrs);
+		if (memcmp(w->p, stripes[r.diskP], chunk_size) != 0) {
+			printf("Stripe %llu: rebuilt slot %d disagrees with P, "
+			       "not repairing\n", stripe, disk);
+			goto resume;
+		}
+		fixed = stripes[disk];
+		what = "data";
+	}
+
+	if (job->dry_run) {
+		printf("Would repair stripe %llu: %s block in slot %d --> %s\n",
+		       stripe, what, disk, job->name[disk]);
+		goto resume;
+	}
+	if (pwrite64(job->source[disk], fixed, chunk_size,
+		     job->offsets[disk] + stripe * chunk_size) != chunk_size ||
+	    fsync(job->source[disk]) != 0) {
+		fprintf(stderr, "raid6check: failed to write stripe %llu "
+			"to %s: %s\n", stripe, job->name[disk],
+			strerror(errno));
+		rv = 1;
+	} else {
+		printf("Repaired stripe %llu: %s block in slot %d --> %s\n",
+		       stripe, what, disk, job->name[disk]);
+		job->repaired++;
+	}
+
+resume:
+	if (!job->dry_run)
+		rv |= sysfs_set_num(info, NULL, "suspend_lo", resume * step);
+	return rv;
+}
+
+/* Consider for repair everything found in the last round */
+static int repair_round(struct mdinfo *info, struct check_job *job,
+			unsigned long long resume)
+{
+	int rv = 0;
+	int i;
+
+	for (i = 0; i < job->jobs; i++) {
+		struct check_worker *w = &job->workers[i];
+
+		for (; w->next_repair < w->nreports; w->next_repair++)
+			if (w->reports[w->next_repair].disk >= 0)
+				rv |= repair_stripe(info, job,
+						    &w->reports[w->next_repair],
+						    resume);
+	}
+	return rv;
+}
+
+/* Choose the size of the next suspend window from how long the last
+ * one kept IO suspended.  Growth is limited to doubling so one fast
+ * round (e.g. from cache) can't cause a huge stall on the next.
+ */
+static void adjust_window(struct check_job *job, double stall)
+{
+	unsigned long long want;
+
+	job->rounds++;
+	job->total_stall += stall;
+	if (stall > job->longest_stall)
+		job->longest_stall = stall;
+	if (job->fixed_window)
+		return;
+	if (stall <= 0)
+		want = job->window * 2;
+	else
+		want = job->max_stall * job->n / stall;
+	if (want > job->window * 2)
+		want = job->window * 2;
+	if (want > job->max_window)
+		want = job->max_window;
+	want -= want % job->jobs;
+	if (want < (unsigned long long)job->jobs)
+		want = job->jobs;
+	job->window = want;
+}
+
+static double ms_since(struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000.0 +
+		(now.tv_usec - tv->tv_usec) / 1000.0;
+}
+
+/* A signal must never leave the array suspended, so they are noted
+ * here and acted on between rounds.
+ */
+static volatile sig_atomic_t stop_signal;
+
+static void note_signal(int sig)
+{
+	stop_signal = sig;
+}
+
 int check_stripes(struct mdinfo *info, int *source, unsigned long long *offsets,
 		  int raid_disks, int chunk_size, int level, int layout,
-		  unsigned long long start, unsigned long long length, char *name[])
+		  unsigned long long start, unsigned long long length, char *name[],
+		  int jobs, unsigned long long window, double max_stall,
+		  int repair)
 {
 	/* read the data and p and q blocks, and check we got them right */
-	char *stripe_buf = malloc(raid_disks * chunk_size);
-	char **stripes = malloc(raid_disks * sizeof(char*));
-	char **blocks = malloc(raid_disks * sizeof(char*));
-	uint8_t *p = malloc(chunk_size);
-	uint8_t *q = malloc(chunk_size);
-	int *results = malloc(chunk_size * sizeof(int));
-
+	struct check_job job;
 	int i;
-	int diskP, diskQ;
 	int data_disks = raid_disks - 2;
 	int err = 0;
 	sighandler_t sig[3];
 	int rv;
+	int started = 0;
+	int locked = 0;
+	int read_errors = 0;
+	unsigned long long stripe_bytes = (unsigned long long)raid_disks * chunk_size;
+	unsigned long long checked = 0;
+	struct timeval tv_start, tv_end;
+	double secs;
 
 	extern int tables_ready;
+	extern uint8_t *zero;
+	extern int zero_size;
 
-	if((stripe_buf == NULL) ||
-	   (stripes == NULL) ||
-	   (blocks == NULL) ||
-	   (p == NULL) ||
-	   (q == NULL) ||
-	   (results == NULL)) {
+	memset(&job, 0, sizeof(job));
+	job.source = source;
+	job.offsets = offsets;
+	job.raid_disks = raid_disks;
+	job.chunk_size = chunk_size;
+	job.level = level;
+	job.layout = layout;
+	job.name = name;
+	job.jobs = jobs;
+	if (window) {
+		job.fixed_window = 1;
+		job.max_window = window;
+	} else {
+		/* Limit the buffers to about 64MB, but at least one
+		 * stripe per job.
+		 */
+		job.max_window = (64ULL << 20) / stripe_bytes;
+		job.max_window -= job.max_window % jobs;
+		if (job.max_window < (unsigned long long)jobs)
+			job.max_window = jobs;
+		window = jobs;
+	}
+	job.window = window;
+	job.max_stall = max_stall;
+	job.per_worker = (job.max_window + jobs - 1) / jobs;
+	job.repair = repair;
+	job.dry_run = repair == 2;
+	job.workers = calloc(jobs, sizeof(job.workers[0]));
+	if (job.workers == NULL) {
 		err = 1;
 		goto exitCheck;
 	}
+	for (i = 0; i < jobs; i++)
+		if (worker_init(&job.workers[i], &job, i)) {
+			err = 1;
+			goto exitCheck;
+		}
 
 	if (!tables_ready)
 		make_tables();
+	if (repair) {
+		/* raid6_datap_recov needs a zero block */
+		free(zero);
+		zero = calloc(1, chunk_size);
+		zero_size = chunk_size;
+		if (zero == NULL) {
+			err = 1;
+			goto exitCheck;
+		}
+	}
 
-	for ( i = 0 ; i < raid_disks ; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	if (jobs > 1)
+		for (started = 0; started < jobs; started++)
+			if (pthread_create(&job.workers[started].thread, NULL,
+					   worker_thread,
+					   &job.workers[started])) {
+				err = 4;
+				goto exitCheck;
+			}
+#endif
 
-	while (length > 0) {
-		int disk;
+	/* Everything we need while IO is suspended has been allocated,
+	 * so lock it into memory once, rather than for each round.
+	 */
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		err = 2;
+		goto exitCheck;
+	}
+	locked = 1;
+	sig[0] = signal(SIGTERM, note_signal);
+	sig[1] = signal(SIGINT, note_signal);
+	sig[2] = signal(SIGQUIT, note_signal);
 
-		printf("pos --> %llu\n", start);
+	/* Each round only needs to move suspend_hi forward to suspend
+	 * the next window, and suspend_lo up to meet it to resume IO.
+	 */
+	rv = sysfs_set_num(info, NULL, "suspend_lo", start * chunk_size * data_disks);
 
-		if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
-			err = 2;
-			goto exitCheck;
-		}
-		sig[0] = signal(SIGTERM, SIG_IGN);
-		sig[1] = signal(SIGINT, SIG_IGN);
-		sig[2] = signal(SIGQUIT, SIG_IGN);
-		rv = sysfs_set_num(info, NULL, "suspend_lo", start * chunk_size * data_disks);
-		rv |= sysfs_set_num(info, NULL, "suspend_hi", (start + 1) * chunk_size * data_disks);
-		for (i = 0 ; i < raid_disks ; i++) {
-			lseek64(source[i], offsets[i] + start * chunk_size, 0);
-			read(source[i], stripes[i], chunk_size);
-		}
-		rv |= sysfs_set_num(info, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
-		rv |= sysfs_set_num(info, NULL, "suspend_hi", 0);
-		rv |= sysfs_set_num(info, NULL, "suspend_lo", 0);
-		signal(SIGQUIT, sig[2]);
-		signal(SIGINT, sig[1]);
-		signal(SIGTERM, sig[0]);
-		if(munlockall() != 0) {
-			err = 3;
-			goto exitCheck;
-		}
+	gettimeofday(&tv_start, NULL);
+	while (length > 0 && !stop_signal && rv == 0) {
+		unsigned long long n = job.window;
+		struct timeval tv_round;
 
-		if(rv != 0) {
-			err = rv * 256;
-			goto exitCheck;
-		}
+		if (n > length)
+			n = length;
 
-		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start, raid_disks, level, layout);
-			blocks[i] = stripes[disk];
-			printf("%d->%d\n", i, disk);
-		}
+		gettimeofday(&tv_round, NULL);
+		rv |= sysfs_set_num(info, NULL, "suspend_hi", (start + n) * chunk_size * data_disks);
+		start_round(&job, start, n);
+		rv |= sysfs_set_num(info, NULL, "suspend_lo", (start + n) * chunk_size * data_disks);
+		adjust_window(&job, ms_since(&tv_round));
+		finish_round(&job);
+		if (repair)
+			rv |= repair_round(info, &job, start + n);
 
-		qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-		diskP = geo_map(-1, start, raid_disks, level, layout);
-		if (memcmp(p, stripes[diskP], chunk_size) != 0) {
-			printf("P(%d) wrong at %llu\n", diskP, start);
-		}
-		diskQ = geo_map(-2, start, raid_disks, level, layout);
-		if (memcmp(q, stripes[diskQ], chunk_size) != 0) {
-			printf("Q(%d) wrong at %llu\n", diskQ, start);
-		}
-		raid6_collect(chunk_size, p, q, stripes[diskP], stripes[diskQ], results);
-		disk = raid6_stats(results, raid_disks, chunk_size);
+		length -= n;
+		start += n;
+		checked += n;
+	}
+	rv |= sysfs_set_num(info, NULL, "suspend_lo", 0x7FFFFFFFFFFFFFFFULL);
+	rv |= sysfs_set_num(info, NULL, "suspend_hi", 0);
+	rv |= sysfs_set_num(info, NULL, "suspend_lo", 0);
+	signal(SIGQUIT, sig[2]);
+	signal(SIGINT, sig[1]);
+	signal(SIGTERM, sig[0]);
+	locked = 0;
 
-		if(disk >= -2) {
-			disk = geo_map(disk, start, raid_disks, level, layout);
-		}
-		if(disk >= 0) {
-			printf("Error detected at %llu: possible failed disk slot: %d --> %s\n",
-				start, disk, name[disk]);
-		}
-		if(disk == -65535) {
-			printf("Error detected at %llu: disk slot unknown\n", start);
-		}
+	/* Whatever was found before an error is still worth reporting */
+	if (jobs > 1)
+		merge_reports(&job);
 
-		length--;
-		start++;
+	if(munlockall() != 0) {
+		err = 3;
+		goto exitCheck;
+	}
+	if(rv != 0) {
+		err = rv * 256;
+		goto exitCheck;
+	}
+	gettimeofday(&tv_end, NULL);
+
+	secs = (tv_end.tv_sec - tv_start.tv_sec) +
+		(tv_end.tv_usec - tv_start.tv_usec) / 1000000.0;
+	if (secs <= 0)
+		secs = 1e-6;
+	printf("checked %llu stripes in %.2f seconds: %.1f stripes/s, %.1f MB/s\n",
+	       checked, secs, checked / secs,
+	       checked * raid_disks * (double)chunk_size / secs / (1024*1024));
+	if (repair && !job.dry_run)
+		printf("repaired %lu blocks\n", job.repaired);
+	if (job.rounds)
+		printf("IO suspended %lu times, %.1f stripes and %.1f ms on average, "
+		       "%.1f ms at most\n", job.rounds,
+		       (double)checked / job.rounds,
+		       job.total_stall / job.rounds, job.longest_stall);
+	for (i = 0; i < jobs; i++)
+		read_errors += job.workers[i].read_errors;
+	if (read_errors) {
+		fprintf(stderr, "raid6check: %d stripes could not be read\n",
+			read_errors);
+		err = 6;
+	}
+	if (stop_signal) {
+		fprintf(stderr, "raid6check: interrupted at stripe %llu\n",
+			start);
+		err = 5;
 	}
 
 exitCheck:
 
-	free(stripe_buf);
-	free(stripes);
-	free(blocks);
-	free(p);
-	free(q);
-	free(results);
+	if (locked)
+		munlockall();
+#ifdef USE_PTHREADS
+	if (started) {
+		pthread_mutex_lock(&job.lock);
+		job.stop = 1;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+		for (i = 0; i < started; i++)
+			pthread_join(job.workers[i].thread, NULL);
+	}
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+#endif
+	if (job.workers)
+		for (i = 0; i < jobs; i++)
+			worker_free(&job.workers[i]);
+	free(job.workers);
 
 	return err;
 }
@@ -247,15 +863,90 @@ int main(int argc, char *argv[])
 	char *err = NULL;
 	int exit_err = 0;
 	int close_flag = 0;
+	int jobs = 1;
+	unsigned long long window = 0;
+	double max_stall = 100;
+	int repair = 0;
+	int dry_run = 0;
+	int opt;
 	char *prg = strrchr(argv[0], '/');
+	static const struct option long_options[] = {
+		{"jobs", 1, 0, 'j'},
+		{"window", 1, 0, 'w'},
+		{"max-stall", 1, 0, 's'},
+		{"repair", 0, 0, 'r'},
+		{"dry-run", 0, 0, 'n'},
+		{0, 0, 0, 0}
+	};
 
 	if (prg == NULL)
 		prg = argv[0];
 	else
 		prg++;
 
+	while ((opt = getopt_long(argc, argv, "+j:w:s:rn", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = getnum(optarg, &err);
+			if (err || jobs < 1) {
+				fprintf(stderr, "%s: Bad number of jobs: %s\n",
+					prg, optarg);
+				exit_err = 1;
+				goto exitHere;
+			}
+			break;
+		case 'w':
+			window = getnum(optarg, &err);
+			if (err || window < 1) {
+				fprintf(stderr, "%s: Bad window size: %s\n",
+					prg, optarg);
+				exit_err = 1;
+				goto exitHere;
+			}
+			break;
+		case 's':
+			max_stall = getnum(optarg, &err);
+			if (err || max_stall < 1) {
+				fprintf(stderr, "%s: Bad stall time: %s\n",
+					prg, optarg);
+				exit_err = 1;
+				goto exitHere;
+			}
+			break;
+		case 'r':
+			repair = 1;
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			exit_err = 1;
+			goto exitHere;
+		}
+	}
+#ifndef USE_PTHREADS
+	if (jobs > 1) {
+		fprintf(stderr, "%s: built without thread support, using 1 job\n",
+			prg);
+		jobs = 1;
+	}
+#endif
+	if (dry_run) {
+		if (!repair) {
+			fprintf(stderr, "%s: --dry-run only makes sense with --repair\n",
+				prg);
+			exit_err = 1;
+			goto exitHere;
+		}
+		repair = 2;
+	}
+	/* leave the positional arguments at argv[1..] */
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc < 4) {
-		fprintf(stderr, "Usage: %s md_device start_stripe length_stripes\n", prg);
+		fprintf(stderr, "Usage: %s [--jobs N] [--window N | --max-stall MS] [--repair [--dry-run]]\n"
+			"       md_device start_stripe length_stripes\n", prg);
 		exit_err = 1;
 		goto exitHere;
 	}
@@ -380,7 +1071,8 @@ int main(int argc, char *argv[])
 
 	int rv = check_stripes(info, fds, offsets,
 			       raid_disks, chunk_size, level, layout,
-			       start, length, disk_name);
+			       start, length, disk_name, jobs, window, max_stall,
+			       repair);
 	if (rv != 0) {
 		fprintf(stderr,
 			"%s: check_stripes returned %d\n", prg, rv);
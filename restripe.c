@@ -211,11 +211,21 @@ static int is_ddf(int layout)
 }
 
 
-static void xor_blocks(char *target, char **sources, int disks, int size)
+/*
+ * P and Q generation.
+ *
+ * These are the inner loops of save_stripes, restore_stripes and
+ * raid6check, so we keep a small table of implementations and pick the
+ * best one the CPU supports the first time one is needed, much as
+ * the kernel's raid6 and xor code do.
+ * The byte-at-a-time versions are the reference implementation and also
+ * handle any tail that is not a multiple of the word or vector size.
+ */
+static void xor_blocks_ref(char *target, char **sources, int disks,
+			   int start, int size)
 {
 	int i, j;
-	/* Amazingly inefficient... */
-	for (i=0; i<size; i++) {
+	for (i = start; i < size; i++) {
 		char c = 0;
 		for (j=0 ; j<disks; j++)
 			c ^= sources[j][i];
@@ -223,11 +233,12 @@ static void xor_blocks(char *target, char **sources, int disks, int size)
 	}
 }
 
-void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+static void qsyndrome_ref(uint8_t *p, uint8_t *q, uint8_t **sources,
+			  int disks, int start, int size)
 {
 	int d, z;
 	uint8_t wq0, wp0, wd0, w10, w20;
-	for ( d = 0; d < size; d++) {
+	for ( d = start; d < size; d++) {
 		wq0 = wp0 = sources[disks-1][d];
 		for ( z = disks-2 ; z >= 0 ; z-- ) {
 			wd0 = sources[z][d];
@@ -243,6 +254,265 @@ void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 	}
 }
 
+/* Portable version working on a machine word at a time.
+ * Only used when every buffer is word aligned, which is always
+ * the case for the malloc/posix_memalign buffers mdadm passes in.
+ */
+typedef unsigned long word_t;
+#define WORD_BYTES(x) ((word_t)(x) * (~(word_t)0 / 0xff))
+
+static int words_aligned(void *target, void **sources, int disks)
+{
+	unsigned long bits = (unsigned long)target;
+	int i;
+
+	for (i = 0; i < disks; i++)
+		bits |= (unsigned long)sources[i];
+	return (bits & (sizeof(word_t) - 1)) == 0;
+}
+
+static void xor_blocks_int(char *target, char **sources, int disks, int size)
+{
+	int i = 0, j;
+
+	if (words_aligned(target, (void**)sources, disks))
+		for (; i + (int)sizeof(word_t) <= size; i += sizeof(word_t)) {
+			word_t c = 0;
+			for (j = 0; j < disks; j++)
+				c ^= *(word_t*)(sources[j] + i);
+			*(word_t*)(target + i) = c;
+		}
+	xor_blocks_ref(target, sources, disks, i, size);
+}
+
+static void qsyndrome_int(uint8_t *p, uint8_t *q, uint8_t **sources,
+			  int disks, int size)
+{
+	int d = 0, z;
+	word_t wq, wp, wd, w1, w2;
+
+	if (words_aligned(p, (void**)sources, disks) &&
+	    words_aligned(q, NULL, 0))
+		for (; d + (int)sizeof(word_t) <= size; d += sizeof(word_t)) {
+			wq = wp = *(word_t*)(sources[disks-1] + d);
+			for (z = disks-2; z >= 0; z--) {
+				wd = *(word_t*)(sources[z] + d);
+				wp ^= wd;
+				/* multiply every byte of wq by 2 in GF(2^8) */
+				w2 = wq & WORD_BYTES(0x80);
+				w2 = (w2 << 1) - (w2 >> 7);
+				w2 &= WORD_BYTES(0x1d);
+				w1 = (wq << 1) & WORD_BYTES(0xfe);
+				wq = w1 ^ w2 ^ wd;
+			}
+			*(word_t*)(p + d) = wp;
+			*(word_t*)(q + d) = wq;
+		}
+	qsyndrome_ref(p, q, sources, disks, d, size);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+
+/* All SIMD versions use unaligned loads and stores, as save_stripes
+ * and raid6check hand us buffers at arbitrary chunk offsets.
+ */
+__attribute__((target("sse2")))
+static void xor_blocks_sse2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i c = _mm_loadu_si128((__m128i*)(sources[0] + i));
+		for (j = 1; j < disks; j++)
+			c = _mm_xor_si128(c, _mm_loadu_si128(
+						  (__m128i*)(sources[j] + i)));
+		_mm_storeu_si128((__m128i*)(target + i), c);
+	}
+	xor_blocks_ref(target, sources, disks, i, size);
+}
+
+__attribute__((target("sse2")))
+static void qsyndrome_sse2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	int d, z;
+	const __m128i x1d = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wq, wp, wd, w1, w2;
+
+	for (d = 0; d + 16 <= size; d += 16) {
+		wq = wp = _mm_loadu_si128((__m128i*)(sources[disks-1] + d));
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm_loadu_si128((__m128i*)(sources[z] + d));
+			wp = _mm_xor_si128(wp, wd);
+			w2 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq), x1d);
+			w1 = _mm_add_epi8(wq, wq);
+			wq = _mm_xor_si128(_mm_xor_si128(w1, w2), wd);
+		}
+		_mm_storeu_si128((__m128i*)(p + d), wp);
+		_mm_storeu_si128((__m128i*)(q + d), wq);
+	}
+	qsyndrome_ref(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("avx2")))
+static void xor_blocks_avx2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i c = _mm256_loadu_si256((__m256i*)(sources[0] + i));
+		for (j = 1; j < disks; j++)
+			c = _mm256_xor_si256(c, _mm256_loadu_si256(
+						     (__m256i*)(sources[j] + i)));
+		_mm256_storeu_si256((__m256i*)(target + i), c);
+	}
+	xor_blocks_ref(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx2")))
+static void qsyndrome_avx2(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int size)
+{
+	int d, z;
+	const __m256i x1d = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wq, wp, wd, w1, w2;
+
+	for (d = 0; d + 32 <= size; d += 32) {
+		wq = wp = _mm256_loadu_si256((__m256i*)(sources[disks-1] + d));
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm256_loadu_si256((__m256i*)(sources[z] + d));
+			wp = _mm256_xor_si256(wp, wd);
+			w2 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq), x1d);
+			w1 = _mm256_add_epi8(wq, wq);
+			wq = _mm256_xor_si256(_mm256_xor_si256(w1, w2), wd);
+		}
+		_mm256_storeu_si256((__m256i*)(p + d), wp);
+		_mm256_storeu_si256((__m256i*)(q + d), wq);
+	}
+	qsyndrome_ref(p, q, sources, disks, d, size);
+}
+
+#if defined(__clang__) || __GNUC__ >= 5
+#define HAVE_X86_AVX512
+__attribute__((target("avx512f,avx512bw")))
+static void xor_blocks_avx512(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		__m512i c = _mm512_loadu_si512((void*)(sources[0] + i));
+		for (j = 1; j < disks; j++)
+			c = _mm512_xor_si512(c, _mm512_loadu_si512(
+						     (void*)(sources[j] + i)));
+		_mm512_storeu_si512((void*)(target + i), c);
+	}
+	xor_blocks_ref(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void qsyndrome_avx512(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size)
+{
+	int d, z;
+	const __m512i x1d = _mm512_set1_epi8(0x1d);
+	__m512i wq, wp, wd, w1, w2;
+
+	for (d = 0; d + 64 <= size; d += 64) {
+		wq = wp = _mm512_loadu_si512((void*)(sources[disks-1] + d));
+		for (z = disks-2; z >= 0; z--) {
+			wd = _mm512_loadu_si512((void*)(sources[z] + d));
+			wp = _mm512_xor_si512(wp, wd);
+			w2 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq), x1d);
+			w1 = _mm512_add_epi8(wq, wq);
+			wq = _mm512_xor_si512(_mm512_xor_si512(w1, w2), wd);
+		}
+		_mm512_storeu_si512((void*)(p + d), wp);
+		_mm512_storeu_si512((void*)(q + d), wq);
+	}
+	qsyndrome_ref(p, q, sources, disks, d, size);
+}
+#endif /* HAVE_X86_AVX512 */
+
+static int have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#ifdef HAVE_X86_AVX512
+static int have_avx512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+#endif
+#endif /* HAVE_X86_SIMD */
+
+/* Ordered from most to least preferred.  The last entry must
+ * always be usable.
+ */
+static const struct raid6_calls raid6_algos[] = {
+#ifdef HAVE_X86_SIMD
+#ifdef HAVE_X86_AVX512
+	{ "avx512", have_avx512, xor_blocks_avx512, qsyndrome_avx512 },
+#endif
+	{ "avx2", have_avx2, xor_blocks_avx2, qsyndrome_avx2 },
+	{ "sse2", have_sse2, xor_blocks_sse2, qsyndrome_sse2 },
+#endif
+	{ "int", NULL, xor_blocks_int, qsyndrome_int },
+};
+
+static const struct raid6_calls *raid6_call;
+
+/* Choose the gen/xor routines to use.  The choice can be forced
+ * (e.g. for testing) by naming an implementation in $MDADM_RAID6_ALGO.
+ */
+const struct raid6_calls *raid6_select_algo(void)
+{
+	const char *want = getenv("MDADM_RAID6_ALGO");
+	unsigned int i;
+
+	if (raid6_call)
+		return raid6_call;
+	for (i = 0; i < sizeof(raid6_algos)/sizeof(raid6_algos[0]); i++) {
+		const struct raid6_calls *c = &raid6_algos[i];
+		if (want && strcmp(want, c->name) != 0)
+			continue;
+		if (c->valid && !c->valid())
+			continue;
+		raid6_call = c;
+		break;
+	}
+	if (!raid6_call)
+		/* unknown or unsupported request: use the portable version */
+		raid6_call = &raid6_algos[i-1];
+	dprintf("raid6: using %s for P/Q generation\n", raid6_call->name);
+	return raid6_call;
+}
+
+void xor_blocks(char *target, char **sources, int disks, int size)
+{
+	raid6_select_algo()->xor_blocks(target, sources, disks, size);
+}
+
+void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	raid6_select_algo()->gen_syndrome(p, q, sources, disks, size);
+}
+
 
 /*
  * The following was taken from linux/drivers/md/mktables.c, and modified
@@ -282,6 +552,10 @@ static uint8_t gfpow(uint8_t a, int b)
 
 int tables_ready = 0;
 uint8_t raid6_gfmul[256][256];
+/* raid6_vgfmul[c] holds c*x for the low nibble x in the first 16 bytes
+ * and c*(x<<4) in the second 16.
+ */
+static uint8_t raid6_vgfmul[256][32] __attribute__((aligned(32)));
 uint8_t raid6_gfexp[256];
 uint8_t raid6_gfinv[256];
 uint8_t raid6_gfexi[256];
@@ -298,6 +572,13 @@ void make_tables(void)
 		for (j = 0; j < 256; j++)
 				raid6_gfmul[i][j] = gfmul(i, j);
 
+	/* Compute nibble multiplication tables for vector recovery */
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 16; j++) {
+			raid6_vgfmul[i][j] = gfmul(i, j);
+			raid6_vgfmul[i][j+16] = gfmul(i, j << 4);
+		}
+
 	/* Compute power-of-2 table (exponent) */
 	v = 1;
 	for (i = 0; i < 256; i++) {
@@ -335,6 +616,255 @@ void make_tables(void)
 
 uint8_t *zero;
 int zero_size;
+
+/*
+ * The final pass of RAID6 recovery multiplies every byte of a block
+ * by one or two constants.  Done a byte at a time through raid6_gfmul
+ * this dominates the cost, so as with P/Q generation we keep a table of
+ * implementations.  The vector versions split each byte into nibbles
+ * and look both up in 16-entry tables with PSHUFB, as the kernel's
+ * recov_ssse3/recov_avx2 do, using raid6_vgfmul.
+ */
+
+struct raid6_recov_calls {
+	const char *name;
+	int (*valid)(void);
+	/* p/q are the good parity blocks, dp/dq hold the delta syndrome
+	 * and receive the recovered data.
+	 */
+	void (*data2)(size_t bytes, uint8_t *p, uint8_t *q,
+		      uint8_t *dp, uint8_t *dq, uint8_t pbmul, uint8_t qmul);
+	void (*datap)(size_t bytes, uint8_t *p, uint8_t *q,
+		      uint8_t *dq, uint8_t qmul);
+};
+
+static void recov_data2_ref(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dp, uint8_t *dq,
+			    uint8_t pbmul_c, uint8_t qmul_c)
+{
+	const uint8_t *pbmul = raid6_gfmul[pbmul_c];
+	const uint8_t *qmul = raid6_gfmul[qmul_c];
+	uint8_t px, qx, db;
+
+	while ( bytes-- ) {
+		px    = *p ^ *dp;
+		qx    = qmul[*q ^ *dq];
+		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
+		*dp++ = db ^ px; /* Reconstructed A */
+		p++; q++;
+	}
+}
+
+static void recov_datap_ref(size_t bytes, uint8_t *p, uint8_t *q,
+			    uint8_t *dq, uint8_t qmul_c)
+{
+	const uint8_t *qmul = raid6_gfmul[qmul_c];
+
+	while ( bytes-- ) {
+		*p++ ^= *dq = qmul[*q ^ *dq];
+		q++; dq++;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("ssse3")))
+static inline __m128i gfmul_ssse3(__m128i x, const uint8_t *tbl)
+{
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	__m128i lo = _mm_load_si128((__m128i*)tbl);
+	__m128i hi = _mm_load_si128((__m128i*)(tbl + 16));
+
+	lo = _mm_shuffle_epi8(lo, _mm_and_si128(x, x0f));
+	hi = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(x, 4), x0f));
+	return _mm_xor_si128(lo, hi);
+}
+
+__attribute__((target("ssse3")))
+static void recov_data2_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dp, uint8_t *dq,
+			      uint8_t pbmul, uint8_t qmul)
+{
+	size_t i;
+	__m128i px, qx, db;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i*)(p + i)),
+				   _mm_loadu_si128((__m128i*)(dp + i)));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i*)(q + i)),
+				   _mm_loadu_si128((__m128i*)(dq + i)));
+		db = _mm_xor_si128(gfmul_ssse3(px, raid6_vgfmul[pbmul]),
+				   gfmul_ssse3(qx, raid6_vgfmul[qmul]));
+		_mm_storeu_si128((__m128i*)(dq + i), db);
+		_mm_storeu_si128((__m128i*)(dp + i), _mm_xor_si128(db, px));
+	}
+	recov_data2_ref(bytes - i, p + i, q + i, dp + i, dq + i, pbmul, qmul);
+}
+
+__attribute__((target("ssse3")))
+static void recov_datap_ssse3(size_t bytes, uint8_t *p, uint8_t *q,
+			      uint8_t *dq, uint8_t qmul)
+{
+	size_t i;
+	__m128i d;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		d = _mm_xor_si128(_mm_loadu_si128((__m128i*)(q + i)),
+				  _mm_loadu_si128((__m128i*)(dq + i)));
+		d = gfmul_ssse3(d, raid6_vgfmul[qmul]);
+		_mm_storeu_si128((__m128i*)(dq + i), d);
+		_mm_storeu_si128((__m128i*)(p + i),
+				 _mm_xor_si128(d, _mm_loadu_si128(
+						       (__m128i*)(p + i))));
+	}
+	recov_datap_ref(bytes - i, p + i, q + i, dq + i, qmul);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gfmul_avx2(__m256i x, const uint8_t *tbl)
+{
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	/* vpshufb works within each 128bit lane, so repeat the tables */
+	__m256i lo = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i*)tbl));
+	__m256i hi = _mm256_broadcastsi128_si256(
+		_mm_load_si128((__m128i*)(tbl + 16)));
+
+	lo = _mm256_shuffle_epi8(lo, _mm256_and_si256(x, x0f));
+	hi = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x, 4),
+						      x0f));
+	return _mm256_xor_si256(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void recov_data2_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dp, uint8_t *dq,
+			     uint8_t pbmul, uint8_t qmul)
+{
+	size_t i;
+	__m256i px, qx, db;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		px = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(p + i)),
+				      _mm256_loadu_si256((__m256i*)(dp + i)));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(q + i)),
+				      _mm256_loadu_si256((__m256i*)(dq + i)));
+		db = _mm256_xor_si256(gfmul_avx2(px, raid6_vgfmul[pbmul]),
+				      gfmul_avx2(qx, raid6_vgfmul[qmul]));
+		_mm256_storeu_si256((__m256i*)(dq + i), db);
+		_mm256_storeu_si256((__m256i*)(dp + i),
+				    _mm256_xor_si256(db, px));
+	}
+	recov_data2_ref(bytes - i, p + i, q + i, dp + i, dq + i, pbmul, qmul);
+}
+
+__attribute__((target("avx2")))
+static void recov_datap_avx2(size_t bytes, uint8_t *p, uint8_t *q,
+			     uint8_t *dq, uint8_t qmul)
+{
+	size_t i;
+	__m256i d;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		d = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(q + i)),
+				     _mm256_loadu_si256((__m256i*)(dq + i)));
+		d = gfmul_avx2(d, raid6_vgfmul[qmul]);
+		_mm256_storeu_si256((__m256i*)(dq + i), d);
+		_mm256_storeu_si256((__m256i*)(p + i),
+				    _mm256_xor_si256(d, _mm256_loadu_si256(
+							     (__m256i*)(p + i))));
+	}
+	recov_datap_ref(bytes - i, p + i, q + i, dq + i, qmul);
+}
+
+static int have_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+#endif /* HAVE_X86_SIMD */
+
+static const struct raid6_recov_calls raid6_recov_algos[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx2", have_avx2, recov_data2_avx2, recov_datap_avx2 },
+	{ "ssse3", have_ssse3, recov_data2_ssse3, recov_datap_ssse3 },
+#endif
+	{ "int", NULL, recov_data2_ref, recov_datap_ref },
+};
+
+static const struct raid6_recov_calls *raid6_recov;
+
+/* Run a candidate over some awkwardly sized pseudo-random blocks and compare
+ * against the byte-at-a-time code, which is what we have always used.
+ * Anything that disagrees is not used.
+ */
+static int raid6_recov_selftest(const struct raid6_recov_calls *c)
+{
+	enum { TEST_BYTES = 4096 + 77 };
+	uint8_t *buf, *p1, *q1, *dp1, *dq1, *p2, *q2, *dp2, *dq2;
+	unsigned int x = 0x12345678;
+	int i, rv = 1;
+
+	buf = malloc(8 * TEST_BYTES);
+	if (!buf)
+		return 0;
+	/* our own generator, so as not to disturb anyone's random() */
+	for (i = 0; i < 4 * TEST_BYTES; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 16;
+	}
+	p1 = buf; q1 = p1 + TEST_BYTES;
+	dp1 = q1 + TEST_BYTES; dq1 = dp1 + TEST_BYTES;
+	p2 = dq1 + TEST_BYTES; q2 = p2 + TEST_BYTES;
+	dp2 = q2 + TEST_BYTES; dq2 = dp2 + TEST_BYTES;
+	memcpy(p2, p1, 4 * TEST_BYTES);
+
+	/* misalign by one byte to exercise the unaligned paths too */
+	recov_data2_ref(TEST_BYTES - 1, p1+1, q1+1, dp1+1, dq1+1,
+			raid6_gfexi[3], raid6_gfinv[raid6_gfexp[1]^raid6_gfexp[4]]);
+	c->data2(TEST_BYTES - 1, p2+1, q2+1, dp2+1, dq2+1,
+		 raid6_gfexi[3], raid6_gfinv[raid6_gfexp[1]^raid6_gfexp[4]]);
+	if (memcmp(p1, p2, 4 * TEST_BYTES) != 0)
+		rv = 0;
+
+	recov_datap_ref(TEST_BYTES, p1, q1, dq1, raid6_gfinv[raid6_gfexp[5]]);
+	c->datap(TEST_BYTES, p2, q2, dq2, raid6_gfinv[raid6_gfexp[5]]);
+	if (memcmp(p1, p2, 4 * TEST_BYTES) != 0)
+		rv = 0;
+
+	free(buf);
+	return rv;
+}
+
+static const struct raid6_recov_calls *raid6_select_recov(void)
+{
+	const char *want = getenv("MDADM_RAID6_ALGO");
+	unsigned int i;
+	int n = sizeof(raid6_recov_algos)/sizeof(raid6_recov_algos[0]);
+
+	if (raid6_recov)
+		return raid6_recov;
+	if (!tables_ready)
+		make_tables();
+	for (i = 0; i < (unsigned)n - 1; i++) {
+		const struct raid6_recov_calls *c = &raid6_recov_algos[i];
+		if (want && strcmp(want, c->name) != 0)
+			continue;
+		if (c->valid && !c->valid())
+			continue;
+		if (!raid6_recov_selftest(c)) {
+			fprintf(stderr, Name ": raid6 recovery using %s failed "
+				"self-test, not using it.\n", c->name);
+			continue;
+		}
+		raid6_recov = c;
+		break;
+	}
+	if (!raid6_recov)
+		raid6_recov = &raid6_recov_algos[n-1];
+	dprintf("raid6: using %s for recovery\n", raid6_recov->name);
+	return raid6_recov;
+}
+
 /* Following was taken from linux/drivers/md/raid6recov.c */
 
 /* Recover two failed data blocks. */
@@ -342,9 +872,8 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 		       uint8_t **ptrs)
 {
 	uint8_t *p, *q, *dp, *dq;
-	uint8_t px, qx, db;
-	const uint8_t *pbmul;	/* P multiplier table for B data */
-	const uint8_t *qmul;		/* Q multiplier table (for both) */
+	uint8_t pbmul;	/* P multiplier for B data */
+	uint8_t qmul;	/* Q multiplier (for both) */
 
 	p = ptrs[disks-2];
 	q = ptrs[disks-1];
@@ -364,24 +893,18 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 	ptrs[failb]   = dq;
 
 	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[failb-faila]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
+	pbmul = raid6_gfexi[failb-faila];
+	qmul  = raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		px    = *p ^ *dp;
-		qx    = qmul[*q ^ *dq];
-		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
-		*dp++ = db ^ px; /* Reconstructed A */
-		p++; q++;
-	}
+	raid6_select_recov()->data2(bytes, p, q, dp, dq, pbmul, qmul);
 }
 
 /* Recover failure of one data block plus the P block */
 void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
 {
 	uint8_t *p, *q, *dq;
-	const uint8_t *qmul;		/* Q multiplier table */
+	uint8_t qmul;		/* Q multiplier */
 
 	p = ptrs[disks-2];
 	q = ptrs[disks-1];
@@ -397,13 +920,10 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
 	ptrs[faila]   = dq;
 
 	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+	qmul  = raid6_gfinv[raid6_gfexp[faila]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		*p++ ^= *dq = qmul[*q ^ *dq];
-		q++; dq++;
-	}
+	raid6_select_recov()->datap(bytes, p, q, dq, qmul);
 }
 
 /* Try to find out if a specific disk has a problem */
@@ -467,6 +987,205 @@ int raid6_check_disks(int data_disks, int start, int chunk_size,
 	return curr_broken_disk;
 }
 
+/* Read the chunk that device 'dnum' holds at per-device 'offset'.
+ * Returns 0 on success, -1 if it is missing or the read failed.
+ */
+static int read_chunk(int *source, unsigned long long *offsets, int dnum,
+		      unsigned long long offset, char *buf, int chunk_size)
+{
+	if (source[dnum] < 0 ||
+	    lseek64(source[dnum], offsets[dnum]+offset, 0) < 0 ||
+	    read(source[dnum], buf, chunk_size) != chunk_size)
+		return -1;
+	return 0;
+}
+
+/* Find the device holding each block of a stripe, in the order that
+ * save_stripes keeps them in its buffer: data, then P, then Q.
+ */
+static void map_stripe(int *dmap, unsigned long long stripe,
+		       int raid_disks, int data_disks, int level, int layout)
+{
+	int disk;
+
+	for (disk = 0; disk < raid_disks; disk++) {
+		dmap[disk] = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
+				     stripe, raid_disks, level, layout);
+		if (dmap[disk] < 0)
+			abort();
+	}
+}
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+
+/* Reading a stripe one chunk at a time leaves all but one device idle,
+ * so save_stripes hands the reads to one thread per member device.
+ * Each thread owns its device's fd and works through the queued stripes
+ * in order.  Two stripes can be queued so that the next one is read
+ * while the current one is written to the backup.
+ */
+struct stripe_reader {
+	int raid_disks;
+	int chunk_size;
+	int *source;
+	unsigned long long *offsets;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	unsigned long queued;		/* stripes queued so far */
+	unsigned long collected;	/* stripes handed back to caller */
+	unsigned long *done;		/* per device: stripes read */
+	struct stripe_req {
+		char *buf;
+		unsigned long long offset;	/* per-device */
+		int *block;	/* [dnum] -> block in buf */
+		int *failed;	/* [block] -> read failed */
+	} req[2];
+
+	struct stripe_worker {
+		struct stripe_reader *r;
+		int dnum;
+		pthread_t thread;
+	} *workers;
+	int nworkers;
+};
+
+static void *stripe_reader_thread(void *v)
+{
+	struct stripe_worker *w = v;
+	struct stripe_reader *r = w->r;
+	int d = w->dnum;
+
+	pthread_mutex_lock(&r->lock);
+	while (1) {
+		struct stripe_req *req;
+		int block, rv;
+
+		while (!r->stop && r->done[d] >= r->queued)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop)
+			break;
+		req = &r->req[r->done[d] & 1];
+		block = req->block[d];
+		pthread_mutex_unlock(&r->lock);
+
+		rv = read_chunk(r->source, r->offsets, d, req->offset,
+				req->buf + block * r->chunk_size,
+				r->chunk_size);
+
+		pthread_mutex_lock(&r->lock);
+		if (rv)
+			req->failed[block] = 1;
+		r->done[d]++;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static void stripe_reader_stop(struct stripe_reader *r)
+{
+	int i;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	for (i = 0; i < r->nworkers; i++)
+		pthread_join(r->workers[i].thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->req[0].block);
+	free(r->workers);
+	free(r->done);
+	free(r);
+}
+
+static struct stripe_reader *stripe_reader_start(int *source,
+						 unsigned long long *offsets,
+						 int raid_disks, int chunk_size)
+{
+	struct stripe_reader *r = calloc(1, sizeof(*r));
+	int *ints = calloc(4 * raid_disks, sizeof(int));
+	int i;
+
+	if (!r || !ints) {
+		free(r);
+		free(ints);
+		return NULL;
+	}
+	r->raid_disks = raid_disks;
+	r->chunk_size = chunk_size;
+	r->source = source;
+	r->offsets = offsets;
+	r->req[0].block = ints;
+	r->req[0].failed = ints + raid_disks;
+	r->req[1].block = ints + 2 * raid_disks;
+	r->req[1].failed = ints + 3 * raid_disks;
+	r->done = calloc(raid_disks, sizeof(r->done[0]));
+	r->workers = calloc(raid_disks, sizeof(r->workers[0]));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (!r->done || !r->workers) {
+		stripe_reader_stop(r);
+		return NULL;
+	}
+	for (i = 0; i < raid_disks; i++) {
+		r->workers[i].r = r;
+		r->workers[i].dnum = i;
+		if (pthread_create(&r->workers[i].thread, NULL,
+				   stripe_reader_thread, &r->workers[i]))
+			break;
+		r->nworkers++;
+	}
+	if (r->nworkers < raid_disks) {
+		stripe_reader_stop(r);
+		return NULL;
+	}
+	return r;
+}
+
+/* Queue a stripe to be read into 'buf'. At most two can be outstanding */
+static void stripe_reader_queue(struct stripe_reader *r, char *buf,
+				unsigned long long offset, int *dmap)
+{
+	struct stripe_req *req;
+	int disk;
+
+	pthread_mutex_lock(&r->lock);
+	req = &r->req[r->queued & 1];
+	req->buf = buf;
+	req->offset = offset;
+	for (disk = 0; disk < r->raid_disks; disk++) {
+		req->block[dmap[disk]] = disk;
+		req->failed[disk] = 0;
+	}
+	r->queued++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Wait for the oldest queued stripe and copy out its failures */
+static void stripe_reader_wait(struct stripe_reader *r, int *failed)
+{
+	int d;
+
+	pthread_mutex_lock(&r->lock);
+	for (d = 0; d < r->raid_disks; d++)
+		while (r->done[d] <= r->collected)
+			pthread_cond_wait(&r->cond, &r->lock);
+	memcpy(failed, r->req[r->collected & 1].failed,
+	       r->raid_disks * sizeof(int));
+	r->collected++;
+	pthread_mutex_unlock(&r->lock);
+}
+#endif /* USE_PTHREADS */
+
+static char *spare_buf;
+static size_t spare_size;
+
 /*******************************************************************************
  * Function:	save_stripes
  * Description:
@@ -506,7 +1225,13 @@ int save_stripes(int *source, unsigned long long *offsets,
 	int data_disks = raid_disks - (level == 0 ? 0 : level <=5 ? 1 : 2);
 	int disk;
 	int i;
+	int rv;
 	unsigned long long length_test;
+	int *dmap, *bfailed;
+	char *spare = NULL;	/* second buffer for reading ahead */
+#ifdef USE_PTHREADS
+	struct stripe_reader *reader = NULL;
+#endif
 
 	if (!tables_ready)
 		make_tables();
@@ -533,28 +1258,71 @@ int save_stripes(int *source, unsigned long long *offsets,
 		abort();
 	}
 
+	dmap = malloc(raid_disks * sizeof(int));
+	bfailed = malloc(raid_disks * sizeof(int));
+	if (!dmap || !bfailed) {
+		rv = -1;
+		goto out;
+	}
+#ifdef USE_PTHREADS
+	if (raid_disks > 1)
+		reader = stripe_reader_start(source, offsets,
+					     raid_disks, chunk_size);
+	/* When the stripes go to 'dest' rather than being collected in
+	 * 'buf', the next stripe can be read into a second buffer while
+	 * the current one is written out.  That buffer is kept for the
+	 * next call, as a reshape calls us for every backup step.
+	 */
+	if (reader && dest && length > (unsigned long long)len) {
+		if (spare_buf == NULL ||
+		    spare_size < (size_t)raid_disks * chunk_size) {
+			free(spare_buf);
+			spare_size = (size_t)raid_disks * chunk_size;
+			if (posix_memalign((void**)&spare_buf, 4096, spare_size))
+				spare_buf = NULL;
+		}
+		spare = spare_buf;
+	}
+	if (reader) {
+		map_stripe(dmap, start/chunk_size/data_disks,
+			   raid_disks, data_disks, level, layout);
+		stripe_reader_queue(reader, buf,
+				    (start/chunk_size/data_disks)*chunk_size,
+				    dmap);
+	}
+#endif
+
 	while (length > 0) {
 		int failed = 0;
 		int fdisk[3], fblock[3];
-		for (disk = 0; disk < raid_disks ; disk++) {
-			unsigned long long offset;
-			int dnum;
-
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
-			if (source[dnum] < 0 ||
-			    lseek64(source[dnum], offsets[dnum]+offset, 0) < 0 ||
-			    read(source[dnum], buf+disk * chunk_size, chunk_size)
-			    != chunk_size)
-				if (failed <= 2) {
-					fdisk[failed] = dnum;
-					fblock[failed] = disk;
-					failed++;
-				}
+		unsigned long long stripe = start/chunk_size/data_disks;
+
+		map_stripe(dmap, stripe, raid_disks, data_disks, level, layout);
+#ifdef USE_PTHREADS
+		if (reader)
+			stripe_reader_wait(reader, bfailed);
+		else
+#endif
+			for (disk = 0; disk < raid_disks ; disk++)
+				bfailed[disk] = read_chunk(source, offsets,
+							   dmap[disk],
+							   stripe*chunk_size,
+							   buf + disk*chunk_size,
+							   chunk_size);
+		for (disk = 0; disk < raid_disks ; disk++)
+			if (bfailed[disk] && failed <= 2) {
+				fdisk[failed] = dmap[disk];
+				fblock[failed] = disk;
+				failed++;
+			}
+#ifdef USE_PTHREADS
+		if (spare && length > (unsigned long long)len) {
+			map_stripe(dmap, stripe+1,
+				   raid_disks, data_disks, level, layout);
+			stripe_reader_queue(reader, spare,
+					    (stripe+1)*chunk_size, dmap);
 		}
+#endif
 		if (failed == 0 || fblock[0] >= data_disks)
 			/* all data disks are good */
 			;
@@ -569,10 +1337,11 @@ int save_stripes(int *source, unsigned long long *offsets,
 
 			xor_blocks(buf + fblock[0]*chunk_size,
 				   bufs, data_disks, chunk_size);
-		} else if (failed > 2 || level != 6)
+		} else if (failed > 2 || level != 6) {
 			/* too much failure */
-			return -1;
-		else {
+			rv = -1;
+			goto out;
+		} else {
 			/* RAID6 computations needed. */
 			uint8_t *bufs[data_disks+4];
 			int qdisk;
@@ -654,16 +1423,41 @@ int save_stripes(int *source, unsigned long long *offsets,
 		}
 		if (dest) {
 			for (i = 0; i < nwrites; i++)
-				if (write(dest[i], buf, len) != len)
-					return -1;
+				if (write(dest[i], buf, len) != len) {
+					rv = -1;
+					goto out;
+				}
+			if (spare) {
+				char *t = buf;
+				buf = spare;
+				spare = t;
+			}
 		} else {
 			/* build next stripe in buffer */
 			buf += len;
 		}
 		length -= len;
 		start += len;
+#ifdef USE_PTHREADS
+		if (reader && !spare && length > 0) {
+			/* nowhere else to put it, so read it now */
+			map_stripe(dmap, start/chunk_size/data_disks,
+				   raid_disks, data_disks, level, layout);
+			stripe_reader_queue(reader, buf,
+					    (start/chunk_size/data_disks)*chunk_size,
+					    dmap);
+		}
+#endif
 	}
-	return 0;
+	rv = 0;
+out:
+#ifdef USE_PTHREADS
+	if (reader)
+		stripe_reader_stop(reader);
+#endif
+	free(dmap);
+	free(bfailed);
+	return rv;
 }
 
 /* Restore data:
@@ -0,0 +1,255 @@
+/*
+ * sbcache - remember which metadata was found on which device. Part of:
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* When a shelf of disks appears, udev runs "mdadm -I" for every one of
+ * them, and each run guesses the metadata type by trying every handler
+ * in turn - as do Assemble and RebuildMap for every device they look
+ * at.  The answer rarely changes, so we remember it.
+ *
+ * There is one small file per device in SBCACHE_DIR, named by the
+ * device number, holding a single line:
+ *   size serial metadata minor uuid events ctime level raid_disks crc
+ * 'size' and 'serial' make sure it is still the same device behind that
+ * number.  'metadata' and 'minor' say which handler to use, and the
+ * uuid and event count (with a few other details from the mdinfo) must
+ * still match what that handler then loads, else we go back to
+ * guessing.  'crc' covers the rest of the line so that a torn or
+ * mangled file is ignored rather than believed.
+ *
+ * Writing new metadata always goes through Kill() first, which forgets
+ * the device, so a stale entry can never hide newly created metadata.
+ * Nothing here is ever required: if SBCACHE_DIR cannot be written, or
+ * an entry is missing or wrong, we simply guess as before.
+ */
+#include	"mdadm.h"
+#include	<ctype.h>
+
+#ifndef SBCACHE_DIR
+#define SBCACHE_DIR MAP_DIR "/sbcache"
+#endif
+
+unsigned long crc32(
+	unsigned long crc,
+	const unsigned char *buf,
+	unsigned len);
+
+struct sbcache_ent {
+	unsigned long long size;
+	char serial[64];
+	char metadata[20];
+	int minor_version;
+	int uuid[4];
+	unsigned long long events;
+	long ctime;
+	int level;
+	int raid_disks;
+};
+
+/* A stable identity for the disk behind 'rdev', or "-" if sysfs
+ * doesn't offer one.  Partitions use the serial of their disk.
+ */
+static void dev_serial(dev_t rdev, char *serial, int len)
+{
+	static char *attrs[] = {
+		"device/wwid", "device/serial",
+		"../device/wwid", "../device/serial",
+		NULL
+	};
+	char path[100];
+	char buf[1024];
+	char *cp;
+	int i;
+
+	strcpy(serial, "-");
+	for (i = 0; attrs[i]; i++) {
+		sprintf(path, "/sys/dev/block/%d:%d/%s",
+			major(rdev), minor(rdev), attrs[i]);
+		if (load_sys(path, buf) == 0 && buf[0])
+			break;
+	}
+	if (!attrs[i])
+		return;
+	/* Keep it to one word */
+	for (cp = buf; *cp; cp++)
+		if (isspace(*cp))
+			*cp = '_';
+	snprintf(serial, len, "%.*s", len - 1, buf);
+}
+
+static int sbcache_path(int fd, char *path, struct sbcache_ent *ent)
+{
+	struct stat stb;
+
+	if (fstat(fd, &stb) < 0 || !S_ISBLK(stb.st_mode))
+		return 0;
+	sprintf(path, SBCACHE_DIR "/%d:%d",
+		major(stb.st_rdev), minor(stb.st_rdev));
+	if (ent) {
+		memset(ent, 0, sizeof(*ent));
+		if (!get_dev_size(fd, NULL, &ent->size))
+			return 0;
+		dev_serial(stb.st_rdev, ent->serial, sizeof(ent->serial));
+	}
+	return 1;
+}
+
+static int sbcache_format(struct sbcache_ent *ent, char *buf, int len)
+{
+	int n;
+
+	n = snprintf(buf, len, "%llu %s %s %d %08x:%08x:%08x:%08x %llu %ld %d %d",
+		     ent->size, ent->serial, ent->metadata,
+		     ent->minor_version,
+		     ent->uuid[0], ent->uuid[1], ent->uuid[2], ent->uuid[3],
+		     ent->events, ent->ctime, ent->level, ent->raid_disks);
+	if (n < 0 || n >= len)
+		return -1;
+	return n;
+}
+
+/* Read the entry for the device open on 'fd' into 'ent'.
+ * Returns 1 only if it is intact and still describes this device.
+ */
+static int sbcache_read(int fd, struct sbcache_ent *ent)
+{
+	struct sbcache_ent now;
+	char path[100];
+	char buf[1024], check[1024];
+	unsigned long crc;
+	int n;
+
+	if (!sbcache_path(fd, path, &now))
+		return 0;
+	if (load_sys(path, buf) < 0)
+		return 0;
+
+	memset(ent, 0, sizeof(*ent));
+	if (sscanf(buf, "%llu %63s %19s %d %x:%x:%x:%x %llu %ld %d %d %lx",
+		   &ent->size, ent->serial, ent->metadata,
+		   &ent->minor_version,
+		   &ent->uuid[0], &ent->uuid[1], &ent->uuid[2], &ent->uuid[3],
+		   &ent->events, &ent->ctime, &ent->level, &ent->raid_disks,
+		   &crc) != 13)
+		return 0;
+	n = sbcache_format(ent, check, sizeof(check));
+	if (n < 0 || crc32(0, (unsigned char *)check, n) != crc)
+		return 0;
+	return ent->size == now.size && strcmp(ent->serial, now.serial) == 0;
+}
+
+/* Like guess_super(), but try the metadata type recorded for this
+ * device first.  That costs a single ->load_super instead of one for
+ * every handler, and the result is only trusted if the superblock
+ * found is the one that was recorded.
+ */
+struct supertype *guess_super_cached(int fd)
+{
+	struct sbcache_ent ent;
+	struct supertype *st;
+	struct mdinfo info;
+	int i;
+
+	if (!sbcache_read(fd, &ent))
+		return guess_super(fd);
+
+	for (i = 0; superlist[i]; i++)
+		if (strcmp(superlist[i]->name, ent.metadata) == 0)
+			break;
+	if (!superlist[i])
+		return guess_super(fd);
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return guess_super(fd);
+	st->ss = superlist[i];
+	st->minor_version = ent.minor_version;
+	st->container_dev = NoMdDev;
+	st->ignore_hw_compat = 1;
+	if (st->ss->load_super(st, fd, NULL) == 0) {
+		int ok;
+
+		st->ss->getinfo_super(st, &info, NULL);
+		ok = (same_uuid(info.uuid, ent.uuid, 0) &&
+		      info.events == ent.events &&
+		      info.array.ctime == ent.ctime &&
+		      info.array.level == ent.level &&
+		      info.array.raid_disks == ent.raid_disks);
+		st->ss->free_super(st);
+		if (ok) {
+			st->ignore_hw_compat = 0;
+			return st;
+		}
+	}
+	free(st);
+	return guess_super(fd);
+}
+
+/* Record the superblock just loaded into 'st' from 'fd' */
+void sbcache_store(int fd, struct supertype *st)
+{
+	struct sbcache_ent ent;
+	struct mdinfo info;
+	char path[100], tmp[120];
+	char buf[1024];
+	int n, tfd;
+
+	if (!st || !st->sb || !st->ss->getinfo_super)
+		return;
+	if (!sbcache_path(fd, path, &ent))
+		return;
+	st->ss->getinfo_super(st, &info, NULL);
+	strncpy(ent.metadata, st->ss->name, sizeof(ent.metadata) - 1);
+	ent.minor_version = st->minor_version;
+	memcpy(ent.uuid, info.uuid, sizeof(ent.uuid));
+	ent.events = info.events;
+	ent.ctime = info.array.ctime;
+	ent.level = info.array.level;
+	ent.raid_disks = info.array.raid_disks;
+
+	n = sbcache_format(&ent, buf, sizeof(buf) - 20);
+	if (n < 0)
+		return;
+	n += sprintf(buf + n, " %lx\n", crc32(0, (unsigned char *)buf, n));
+
+	/* Many mdadm may be racing here; rename makes the update atomic */
+	(void)mkdir(MAP_DIR, 0755);
+	(void)mkdir(SBCACHE_DIR, 0700);
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+	tfd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (tfd < 0)
+		return;
+	if (write(tfd, buf, n) != n) {
+		close(tfd);
+		unlink(tmp);
+		return;
+	}
+	close(tfd);
+	if (rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+/* The metadata on 'fd' is about to change */
+void sbcache_forget(int fd)
+{
+	char path[100];
+
+	if (sbcache_path(fd, path, NULL))
+		unlink(path);
+}
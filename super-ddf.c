@@ -433,6 +433,10 @@ struct ddf_super {
 		struct disk_data disk;
 		struct vcl *vlist[0]; /* max_part in size */
 	} *dlist, *add_list;
+	struct parallel_pool *writers; /* mdmon: threads to write the disks */
+	struct ddf_writes *writes; /* mdmon: buffers for those writes */
+	struct ddf_writes *next_writes; /* ...bigger ones from the manager */
+	int writes_max; /* the manager's idea of the size of 'writes' */
 };
 
 #ifndef offsetof
@@ -765,6 +769,16 @@ static int load_super_ddf_all(struct supertype *st, int fd,
 
 static void free_super_ddf(struct supertype *st);
 
+static int sniff_super_ddf(struct sniff *sn)
+{
+	__u32 *magic;
+
+	if (sn->size <= 32*1024*1024 || (sn->size & 511))
+		return 0;
+	magic = sniff_data(sn, sn->size - 512, sizeof(*magic));
+	return !magic || *magic == DDF_HEADER_MAGIC;
+}
+
 static int load_super_ddf(struct supertype *st, int fd,
 			  char *devname)
 {
@@ -848,11 +862,20 @@ static int load_super_ddf(struct supertype *st, int fd,
 
 }
 
+#ifndef MDASSEMBLE
+static void ddf_free_writes(struct ddf_writes *ws);
+#endif
+
 static void free_super_ddf(struct supertype *st)
 {
 	struct ddf_super *ddf = st->sb;
 	if (ddf == NULL)
 		return;
+#ifndef MDASSEMBLE
+	parallel_pool_stop(ddf->writers);
+	ddf_free_writes(ddf->writes);
+	ddf_free_writes(ddf->next_writes);
+#endif
 	free(ddf->phys);
 	free(ddf->virt);
 	while (ddf->conflist) {
@@ -2328,116 +2351,250 @@ static int remove_from_super_ddf(struct supertype *st, mdu_disk_info_t *dk)
  */
 #define NULL_CONF_SZ	4096
 
-static int __write_init_super_ddf(struct supertype *st)
+/* Everything one disk needs written.  Only the headers differ between
+ * disks, as they record where the primary header and workspace are;
+ * everything else is shared and already has its crc set before any
+ * writing starts.
+ */
+struct ddf_write {
+	struct dl *d;
+	unsigned long long size;
+	struct ddf_header *primary;
+	struct ddf_header *anchor;
+	int ok;
+};
+
+struct ddf_write_set {
+	struct ddf_super *ddf;
+	struct ddf_write *w;
+};
+
+/* Room to write 'max' disks at once: a job each, and 1024 bytes each
+ * for that disk's copy of the primary and anchor headers
+ */
+struct ddf_writes {
+	int max;
+	struct ddf_write *w;
+	struct ddf_header *hdrs;
+};
+
+static void ddf_free_writes(struct ddf_writes *ws)
 {
+	if (!ws)
+		return;
+	free(ws->hdrs);
+	free(ws->w);
+	free(ws);
+}
 
-	struct ddf_super *ddf = st->sb;
+static struct ddf_writes *ddf_alloc_writes(int max)
+{
+	struct ddf_writes *ws = calloc(1, sizeof(*ws));
+
+	if (!ws)
+		return NULL;
+	ws->max = max;
+	ws->w = calloc(max, sizeof(*ws->w));
+	if (!ws->w ||
+	    posix_memalign((void**)&ws->hdrs, 512, max * 1024) != 0) {
+		ws->hdrs = NULL;
+		ddf_free_writes(ws);
+		return NULL;
+	}
+	return ws;
+}
+
+/* Filler for the unused config records.  It is static so that mdmon,
+ * which must not allocate while it writes metadata, never needs to.
+ */
+static char null_conf[NULL_CONF_SZ] __attribute__((aligned(4096)));
+
+static void ddf_write_disk(void *arg, int n)
+{
+	struct ddf_write_set *ws = arg;
+	struct ddf_super *ddf = ws->ddf;
+	struct ddf_write *w = &ws->w[n];
+	struct dl *d = w->d;
+	int fd = d->fd;
+	int n_config, conf_size;
 	int i;
-	struct dl *d;
-	int n_config;
-	int conf_size;
-	int attempts = 0;
-	int successes = 0;
-	unsigned long long size, sector;
-	char *null_aligned;
 
-	if (posix_memalign((void**)&null_aligned, 4096, NULL_CONF_SZ) != 0) {
-		return -ENOMEM;
+	lseek64(fd, (w->size - 16*1024*2) << 9, 0);
+	if (write(fd, w->primary, 512) < 0)
+		return;
+	if (write(fd, &ddf->controller, 512) < 0)
+		return;
+	if (write(fd, ddf->phys, ddf->pdsize) < 0)
+		return;
+	if (write(fd, ddf->virt, ddf->vdsize) < 0)
+		return;
+
+	/* Now write lots of config records. */
+	n_config = ddf->max_part;
+	conf_size = ddf->conf_rec_len * 512;
+	for (i = 0 ; i <= n_config ; i++) {
+		struct vcl *c = d->vlist[i];
+		if (i == n_config)
+			c = (struct vcl*)d->spare;
+
+		if (c) {
+			if (write(fd, &c->conf, conf_size) < 0)
+				return;
+		} else {
+			unsigned int togo = conf_size;
+			while (togo > NULL_CONF_SZ) {
+				if (write(fd, null_conf, NULL_CONF_SZ) < 0)
+					return;
+				togo -= NULL_CONF_SZ;
+			}
+			if (write(fd, null_conf, togo) < 0)
+				return;
+		}
 	}
-	memset(null_aligned, 0xff, NULL_CONF_SZ);
+	if (write(fd, &d->disk, 512) < 0)
+		return;
+
+	/* Maybe do the same for secondary */
+
+	lseek64(fd, (w->size-1)*512, SEEK_SET);
+	if (write(fd, w->anchor, 512) < 0)
+		return;
+	w->ok = 1;
+}
+
+/* Set up the write of one disk, leaving its headers in ddf->primary
+ * and ddf->anchor.
+ */
+static void ddf_prepare_disk(struct ddf_super *ddf, struct dl *d,
+			     struct ddf_write *w)
+{
+	unsigned long long size;
+	int n_config = ddf->max_part;
+	int conf_size = ddf->conf_rec_len * 512;
+	int i;
 
-	/* try to write updated metadata,
-	 * if we catch a failure move on to the next disk
+	w->d = d;
+	w->ok = 0;
+	/* We need to fill in the primary, (secondary) and workspace
+	 * lba's in the headers, set their checksums,
+	 * Also checksum phys, virt....
+	 *
+	 * Then write everything out, finally the anchor is written.
 	 */
-	for (d = ddf->dlist; d; d=d->next) {
-		int fd = d->fd;
+	if (!d->size && get_dev_size(d->fd, NULL, &size))
+		d->size = size / 512;
+	size = d->size;
+	w->size = size;
+	ddf->anchor.workspace_lba = __cpu_to_be64(size - 32*1024*2);
+	ddf->anchor.primary_lba = __cpu_to_be64(size - 16*1024*2);
+	ddf->anchor.seq = __cpu_to_be32(1);
+	memcpy(&ddf->primary, &ddf->anchor, 512);
+	memcpy(&ddf->secondary, &ddf->anchor, 512);
 
-		if (fd < 0)
-			continue;
+	ddf->anchor.openflag = 0xFF; /* 'open' means nothing */
+	ddf->anchor.seq = 0xFFFFFFFF; /* no sequencing in anchor */
+	ddf->anchor.crc = calc_crc(&ddf->anchor, 512);
 
-		attempts++;
-		/* We need to fill in the primary, (secondary) and workspace
-		 * lba's in the headers, set their checksums,
-		 * Also checksum phys, virt....
-		 *
-		 * Then write everything out, finally the anchor is written.
-		 */
-		get_dev_size(fd, NULL, &size);
-		size /= 512;
-		ddf->anchor.workspace_lba = __cpu_to_be64(size - 32*1024*2);
-		ddf->anchor.primary_lba = __cpu_to_be64(size - 16*1024*2);
-		ddf->anchor.seq = __cpu_to_be32(1);
-		memcpy(&ddf->primary, &ddf->anchor, 512);
-		memcpy(&ddf->secondary, &ddf->anchor, 512);
-
-		ddf->anchor.openflag = 0xFF; /* 'open' means nothing */
-		ddf->anchor.seq = 0xFFFFFFFF; /* no sequencing in anchor */
-		ddf->anchor.crc = calc_crc(&ddf->anchor, 512);
-
-		ddf->primary.openflag = 0;
-		ddf->primary.type = DDF_HEADER_PRIMARY;
-
-		ddf->secondary.openflag = 0;
-		ddf->secondary.type = DDF_HEADER_SECONDARY;
-
-		ddf->primary.crc = calc_crc(&ddf->primary, 512);
-		ddf->secondary.crc = calc_crc(&ddf->secondary, 512);
-
-		sector = size - 16*1024*2;
-		lseek64(fd, sector<<9, 0);
-		if (write(fd, &ddf->primary, 512) < 0)
-			continue;
+	ddf->primary.openflag = 0;
+	ddf->primary.type = DDF_HEADER_PRIMARY;
 
-		ddf->controller.crc = calc_crc(&ddf->controller, 512);
-		if (write(fd, &ddf->controller, 512) < 0)
-			continue;
+	ddf->secondary.openflag = 0;
+	ddf->secondary.type = DDF_HEADER_SECONDARY;
 
-		ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
+	ddf->primary.crc = calc_crc(&ddf->primary, 512);
+	ddf->secondary.crc = calc_crc(&ddf->secondary, 512);
 
-		if (write(fd, ddf->phys, ddf->pdsize) < 0)
-			continue;
+	w->primary = &ddf->primary;
+	w->anchor = &ddf->anchor;
 
-		ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
-		if (write(fd, ddf->virt, ddf->vdsize) < 0)
-			continue;
+	for (i = 0 ; i <= n_config ; i++) {
+		struct vcl *c = d->vlist[i];
+		if (i == n_config)
+			c = (struct vcl*)d->spare;
+		if (c)
+			c->conf.crc = calc_crc(&c->conf, conf_size);
+	}
+	d->disk.crc = calc_crc(&d->disk, 512);
+}
 
-		/* Now write lots of config records. */
-		n_config = ddf->max_part;
-		conf_size = ddf->conf_rec_len * 512;
-		for (i = 0 ; i <= n_config ; i++) {
-			struct vcl *c = d->vlist[i];
-			if (i == n_config)
-				c = (struct vcl*)d->spare;
-
-			if (c) {
-				c->conf.crc = calc_crc(&c->conf, conf_size);
-				if (write(fd, &c->conf, conf_size) < 0)
-					break;
-			} else {
-				unsigned int togo = conf_size;
-				while (togo > NULL_CONF_SZ) {
-					if (write(fd, null_aligned, NULL_CONF_SZ) < 0)
-						break;
-					togo -= NULL_CONF_SZ;
-				}
-				if (write(fd, null_aligned, togo) < 0)
-					break;
-			}
+static int __write_init_super_ddf(struct supertype *st, int parallel)
+{
+
+	struct ddf_super *ddf = st->sb;
+	int i;
+	struct dl *d;
+	int attempts = 0;
+	int successes = 0;
+	struct ddf_write_set ws;
+	struct ddf_writes *bufs, *own = NULL;
+
+	ws.ddf = ddf;
+	ws.w = NULL;
+
+	/* The shared records are the same for every disk */
+	ddf->controller.crc = calc_crc(&ddf->controller, 512);
+	ddf->phys->crc = calc_crc(ddf->phys, ddf->pdsize);
+	ddf->virt->crc = calc_crc(ddf->virt, ddf->vdsize);
+
+	/* Every disk is written at once, each with its own copy of the
+	 * headers.  mdmon must neither allocate nor start threads, so it
+	 * uses the threads and buffers the manager set up in
+	 * ddf_prepare_sync().  If those are too small for the disks we
+	 * now have (or mdadm is short of memory) we write one disk after
+	 * another.
+	 */
+	for (d = ddf->dlist; d; d=d->next)
+		if (d->fd >= 0)
+			attempts++;
+	bufs = ddf->writes;
+	if (!bufs || bufs->max < attempts) {
+		bufs = NULL;
+		if (parallel)
+			bufs = own = ddf_alloc_writes(attempts);
+	}
+	attempts = 0;
+	if (bufs)
+		ws.w = bufs->w;
+	if (!ws.w) {
+		struct ddf_write w;
+
+		/* a failure on one disk doesn't stop the others */
+		ws.w = &w;
+		for (d = ddf->dlist; d; d=d->next) {
+			if (d->fd < 0)
+				continue;
+			attempts++;
+			ddf_prepare_disk(ddf, d, &w);
+			ddf_write_disk(&ws, 0);
+			successes += w.ok;
 		}
-		if (i <= n_config)
-			continue;
-		d->disk.crc = calc_crc(&d->disk, 512);
-		if (write(fd, &d->disk, 512) < 0)
-			continue;
+		return attempts != successes;
+	}
 
-		/* Maybe do the same for secondary */
+	for (d = ddf->dlist; d; d=d->next) {
+		struct ddf_write *w = &ws.w[attempts];
 
-		lseek64(fd, (size-1)*512, SEEK_SET);
-		if (write(fd, &ddf->anchor, 512) < 0)
+		if (d->fd < 0)
 			continue;
-		successes++;
+		ddf_prepare_disk(ddf, d, w);
+		w->primary = bufs->hdrs + 2 * attempts;
+		w->anchor = bufs->hdrs + 2 * attempts + 1;
+		memcpy(w->primary, &ddf->primary, 512);
+		memcpy(w->anchor, &ddf->anchor, 512);
+		attempts++;
 	}
-	free(null_aligned);
+
+	/* try to write updated metadata to every disk at once,
+	 * a failure on one disk doesn't stop the others
+	 */
+	if (own)
+		run_parallel(attempts, ddf_write_disk, &ws);
+	else
+		parallel_pool_run(ddf->writers, attempts, ddf_write_disk, &ws);
+
+	for (i = 0; i < attempts; i++)
+		successes += ws.w[i].ok;
+	ddf_free_writes(own);
 
 	return attempts != successes;
 }
@@ -2491,7 +2648,7 @@ static int write_init_super_ddf(struct supertype *st)
 		struct dl *d;
 		for (d = ddf->dlist; d; d=d->next)
 			while (Kill(d->devname, NULL, 0, 1, 1) == 0);
-		return __write_init_super_ddf(st);
+		return __write_init_super_ddf(st, 1);
 	}
 }
 
@@ -3327,6 +3484,36 @@ static void ddf_set_disk(struct active_array *a, int n, int state)
 
 }
 
+/* Called by mdmon's manager, before it hands the monitor any updates,
+ * to make sure ddf_sync_metadata() has threads and buffers enough to
+ * write every disk at once.  The monitor takes new buffers from
+ * 'next_writes' when it next syncs.
+ */
+static void ddf_prepare_sync(struct supertype *st)
+{
+	struct ddf_super *ddf = st->sb;
+	struct ddf_writes *ws;
+	struct dl *d;
+	int cnt = 0;
+
+	if (!ddf || ddf->next_writes)
+		return;
+	for (d = ddf->dlist; d; d = d->next)
+		cnt++;
+	for (d = ddf->add_list; d; d = d->next)
+		cnt++;
+	if (cnt <= ddf->writes_max)
+		return;
+	/* leave room for a few more disks */
+	cnt += 4;
+	ws = ddf_alloc_writes(cnt);
+	if (!ws)
+		return;
+	ddf->writers = parallel_pool_grow(ddf->writers, cnt);
+	ddf->writes_max = cnt;
+	ddf->next_writes = ws;
+}
+
 static void ddf_sync_metadata(struct supertype *st)
 {
 
@@ -3338,10 +3525,15 @@ static void ddf_sync_metadata(struct supertype *st)
 	 * changes global data ....
 	 */
 	struct ddf_super *ddf = st->sb;
+	if (ddf->next_writes) {
+		ddf_free_writes(ddf->writes);
+		ddf->writes = ddf->next_writes;
+		ddf->next_writes = NULL;
+	}
 	if (!ddf->updates_pending)
 		return;
 	ddf->updates_pending = 0;
-	__write_init_super_ddf(st);
+	__write_init_super_ddf(st, 0);
 	dprintf("ddf: sync_metadata\n");
 }
 
@@ -3878,6 +4070,7 @@ struct superswitch super_ddf = {
 	.compare_super	= compare_super_ddf,
 
 	.load_super	= load_super_ddf,
+	.sniff_super	= sniff_super_ddf,
 	.init_super	= init_super_ddf,
 	.store_super	= store_super_ddf,
 	.free_super	= free_super_ddf,
@@ -3892,6 +4085,7 @@ struct superswitch super_ddf = {
 	.open_new       = ddf_open_new,
 	.set_array_state= ddf_set_array_state,
 	.set_disk       = ddf_set_disk,
+	.prepare_sync	= ddf_prepare_sync,
 	.sync_metadata  = ddf_sync_metadata,
 	.process_update	= ddf_process_update,
 	.prepare_update	= ddf_prepare_update,
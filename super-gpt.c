@@ -68,6 +68,18 @@ static void examine_gpt(struct supertype *st, char *homehost)
 }
 #endif /* MDASSEMBLE */
 
+static int sniff_gpt(struct sniff *sn)
+{
+	struct MBR *mbr = sniff_data(sn, 0, sizeof(*mbr));
+	struct GPT *gpt_head = sniff_data(sn, sizeof(*mbr), sizeof(*gpt_head));
+
+	if (!mbr || !gpt_head)
+		return 1;
+	return mbr->magic == MBR_SIGNATURE_MAGIC &&
+		mbr->parts[0].part_type == MBR_GPT_PARTITION_TYPE &&
+		gpt_head->magic == GPT_SIGNATURE_MAGIC;
+}
+
 static int load_gpt(struct supertype *st, int fd, char *devname)
 {
 	struct MBR *super;
@@ -211,6 +223,7 @@ struct superswitch gpt = {
 #endif
 	.match_metadata_desc = match_metadata_desc,
 	.load_super = load_gpt,
+	.sniff_super = sniff_gpt,
 	.store_super = store_gpt,
 	.getinfo_super = getinfo_gpt,
 	.free_super = free_gpt,
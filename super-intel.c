@@ -364,6 +364,8 @@ struct intel_super {
 	void *next_buf; /* for realloc'ing buf from the manager */
 	size_t next_len;
 	int updates_pending; /* count of pending updates for mdmon */
+	__u32 mpb_sum; /* checksum of 'anchor' as last written */
+	int mpb_sum_valid; /* ...and nothing but write_super has changed it since */
 	int current_vol; /* index of raid device undergoing creation */
 	unsigned long long create_offset; /* common start for 'current_vol' */
 	__u32 random; /* random data for seeding new family numbers */
@@ -376,6 +378,7 @@ struct intel_super {
 		char *devname;
 		struct imsm_disk disk;
 		int fd;
+		unsigned long long dsize; /* bytes, read once when 'fd' is */
 		int extent_cnt;
 		struct extent *e; /* for determining freespace @ create */
 		int raiddisk; /* slot to fill in autolayout */
@@ -384,6 +387,10 @@ struct intel_super {
 	struct dl *disk_mgmt_list; /* list of disks to add/remove while mdmon
 				      active */
 	struct dl *missing; /* disks removed while we weren't looking */
+	struct parallel_pool *writers; /* mdmon: threads to write the disks */
+	struct imsm_writes *writes; /* mdmon: buffers for those writes */
+	struct imsm_writes *next_writes; /* ...bigger ones from the manager */
+	int writes_max; /* the manager's idea of the size of 'writes' */
 	struct bbm_log *bbm_log;
 	struct intel_hba *hba; /* device path of the raid controller for this metadata */
 	const struct imsm_orom *orom; /* platform firmware support */
@@ -696,6 +703,22 @@ static __u32 __gen_imsm_checksum(struct imsm_super *mpb)
         return sum - __le32_to_cpu(mpb->check_sum);
 }
 
+/* Copy whole words into the anchor, returning how much that changes
+ * the sum of the anchor that __gen_imsm_checksum() would find
+ */
+static __u32 imsm_copy_csum(void *dest, void *src, size_t len)
+{
+	__u32 *d = dest;
+	__u32 *s = src;
+	__u32 delta = 0;
+
+	for (len /= sizeof(*d); len; len--, d++, s++) {
+		delta += __le32_to_cpu(*s) - __le32_to_cpu(*d);
+		*d = *s;
+	}
+	return delta;
+}
+
 static size_t sizeof_imsm_map(struct imsm_map *map)
 {
 	return sizeof(struct imsm_map) + sizeof(__u32) * (map->num_members - 1);
@@ -2387,7 +2410,9 @@ static int write_imsm_migr_rec(struct supertype *st)
 		fd = dev_open(nm, O_RDWR);
 		if (fd < 0)
 			continue;
-		get_dev_size(fd, NULL, &dsize);
+		dsize = sd->dsize;
+		if (!dsize)
+			get_dev_size(fd, NULL, &dsize);
 		if (lseek64(fd, dsize - MIGR_REC_POSITION, SEEK_SET) < 0) {
 			fprintf(stderr,
 				Name ": Cannot seek to anchor block: %s\n",
@@ -3263,6 +3288,7 @@ load_imsm_disk(int fd, struct intel_super *super, char *devname, int keep_fd)
 	dl->minor = minor(stb.st_rdev);
 	dl->next = super->disks;
 	dl->fd = keep_fd ? fd : -1;
+	get_dev_size(fd, NULL, &dl->dsize);
 	assert(super->disks == NULL);
 	super->disks = dl;
 	serialcpy(dl->serial, serial);
@@ -3728,8 +3754,17 @@ static void __free_imsm(struct intel_super *super, int free_disks)
 	super->hba = NULL;
 }
 
+#ifndef MDASSEMBLE
+static void imsm_free_writes(struct imsm_writes *ws);
+#endif
+
 static void free_imsm(struct intel_super *super)
 {
+#ifndef MDASSEMBLE
+	parallel_pool_stop(super->writers);
+	imsm_free_writes(super->writes);
+	imsm_free_writes(super->next_writes);
+#endif
 	__free_imsm(super, 1);
 	free(super);
 }
@@ -3830,7 +3865,7 @@ static int find_missing(struct intel_super *super)
 		if (dl)
 			continue;
 
-		dl = malloc(sizeof(*dl));
+		dl = calloc(1, sizeof(*dl));
 		if (!dl)
 			return 1;
 		dl->major = 0;
@@ -4401,6 +4436,16 @@ static int load_container_imsm(struct supertype *st, int fd, char *devname)
 }
 #endif
 
+static int sniff_super_imsm(struct sniff *sn)
+{
+	char *sig;
+
+	if (sn->size < 1024)
+		return 0;
+	sig = sniff_data(sn, sn->size - 512 * 2, MPB_SIG_LEN);
+	return !sig || strncmp(sig, MPB_SIGNATURE, MPB_SIG_LEN) == 0;
+}
+
 static int load_super_imsm(struct supertype *st, int fd, char *devname)
 {
 	struct intel_super *super;
@@ -4985,8 +5030,8 @@ static int add_to_super_imsm(struct supertype *st, mdu_disk_info_t *dk,
 		abort();
 	}
 
-	get_dev_size(fd, NULL, &size);
-	size /= 512;
+	get_dev_size(fd, NULL, &dd->dsize);
+	size = dd->dsize / 512;
 	serialcpy(dd->disk.serial, dd->serial);
 	set_total_blocks(&dd->disk, size);
 	if (__le32_to_cpu(dd->disk.total_blocks_hi) > 0) {
@@ -5047,23 +5092,30 @@ static int remove_from_super_imsm(struct supertype *st, mdu_disk_info_t *dk)
 	return 0;
 }
 
-static int store_imsm_mpb(int fd, struct imsm_super *mpb);
+static int store_imsm_mpb(int fd, unsigned long long dsize,
+			  struct imsm_super *mpb);
 
-static union {
-	char buf[512];
-	struct imsm_super anchor;
-} spare_record __attribute__ ((aligned(512)));
+/* The size of a member disk.  Metadata is written to the end of each
+ * disk every time mdmon commits a change, and there's no need to ask
+ * the kernel where that is each time.
+ */
+static unsigned long long imsm_dl_size(struct dl *d)
+{
+	if (!d->dsize)
+		get_dev_size(d->fd, NULL, &d->dsize);
+	return d->dsize;
+}
 
 /* spare records have their own family number and do not have any defined raid
  * devices
  */
-static int write_super_imsm_spares(struct intel_super *super, int doclose)
+static void imsm_spare_record(struct intel_super *super, struct dl *d,
+			      struct imsm_super *spare)
 {
 	struct imsm_super *mpb = super->anchor;
-	struct imsm_super *spare = &spare_record.anchor;
 	__u32 sum;
-	struct dl *d;
 
+	memset(spare, 0, 512);
 	spare->mpb_size = __cpu_to_le32(sizeof(struct imsm_super)),
 	spare->generation_num = __cpu_to_le32(1UL),
 	spare->attributes = MPB_ATTRIB_CHECKSUM_VERIFY;
@@ -5075,70 +5127,184 @@ static int write_super_imsm_spares(struct intel_super *super, int doclose)
 	snprintf((char *) spare->sig, MAX_SIGNATURE_LENGTH,
 		 MPB_SIGNATURE MPB_VERSION_RAID0);
 
-	for (d = super->disks; d; d = d->next) {
-		if (d->index != -1)
-			continue;
+	spare->disk[0] = d->disk;
+	if (__le32_to_cpu(d->disk.total_blocks_hi) > 0)
+		spare->attributes |= MPB_ATTRIB_2TB_DISK;
 
-		spare->disk[0] = d->disk;
-		if (__le32_to_cpu(d->disk.total_blocks_hi) > 0)
-			spare->attributes |= MPB_ATTRIB_2TB_DISK;
+	sum = __gen_imsm_checksum(spare);
+	spare->family_num = __cpu_to_le32(sum);
+	spare->orig_family_num = 0;
+	sum = __gen_imsm_checksum(spare);
+	spare->check_sum = __cpu_to_le32(sum);
+}
 
-		sum = __gen_imsm_checksum(spare);
-		spare->family_num = __cpu_to_le32(sum);
-		spare->orig_family_num = 0;
-		sum = __gen_imsm_checksum(spare);
-		spare->check_sum = __cpu_to_le32(sum);
+/* One disk's share of write_super_imsm() */
+struct imsm_write {
+	struct dl *d;
+	struct imsm_super *mpb;
+	void *migr_rec;	/* clear the migration record from here, or NULL */
+	int migr_err;
+	int err;
+};
 
-		if (store_imsm_mpb(d->fd, spare)) {
-			fprintf(stderr, "%s: failed for device %d:%d %s\n",
-				__func__, d->major, d->minor, strerror(errno));
-			return 1;
-		}
-		if (doclose) {
-			close(d->fd);
-			d->fd = -1;
+static void imsm_write_disk(void *arg, int i)
+{
+	struct imsm_write *w = (struct imsm_write *)arg + i;
+	int fd = w->d->fd;
+	unsigned long long dsize = imsm_dl_size(w->d);
+
+	if (w->migr_rec) {
+		if (lseek64(fd, dsize - 512, SEEK_SET) >= 0) {
+			if (write(fd, w->migr_rec,
+				  MIGR_REC_BUF_SIZE) != MIGR_REC_BUF_SIZE)
+				w->migr_err = errno;
 		}
 	}
 
-	return 0;
+	if (store_imsm_mpb(fd, dsize, w->mpb))
+		w->err = errno ? errno : EIO;
+}
+
+/* Fill in the write of one disk; returns 0 if the disk is not written.
+ * A spare gets a record of its own, built in the 512 byte 'spare' buffer.
+ */
+static int imsm_write_job(struct intel_super *super, struct dl *d,
+			  struct imsm_write *w, char *spare,
+			  int clear_migration_record)
+{
+	memset(w, 0, sizeof(*w));
+	if (d->index == -1) {
+		imsm_spare_record(super, d, (struct imsm_super *)spare);
+		w->mpb = (struct imsm_super *)spare;
+	} else if (d->index < 0 || is_failed(&d->disk))
+		return 0;
+	else {
+		w->mpb = super->anchor;
+		if (clear_migration_record)
+			w->migr_rec = super->migr_rec_buf;
+	}
+	w->d = d;
+	return 1;
+}
+
+/* Report how the write of one disk went; only a failed spare is fatal */
+static int imsm_write_done(struct imsm_write *w, int doclose)
+{
+	struct dl *d = w->d;
+	int rv = 0;
+
+	if (w->migr_err) {
+		errno = w->migr_err;
+		perror("Write migr_rec failed");
+	}
+	if (w->err) {
+		if (d->index == -1)
+			rv = 1;
+		fprintf(stderr,
+			"write_super_imsm: failed for device %d:%d (fd: %d)%s\n",
+			d->major, d->minor, d->fd, strerror(w->err));
+	}
+	if (doclose) {
+		close(d->fd);
+		d->fd = -1;
+	}
+	return rv;
+}
+
+/* Room to write 'max' disks at once: a job each, and a 512 byte
+ * buffer each for the record of a spare
+ */
+struct imsm_writes {
+	int max;
+	struct imsm_write *w;
+	char *spare_buf;
+};
+
+static void imsm_free_writes(struct imsm_writes *ws)
+{
+	if (!ws)
+		return;
+	free(ws->spare_buf);
+	free(ws->w);
+	free(ws);
 }
 
-static int write_super_imsm(struct supertype *st, int doclose)
+static struct imsm_writes *imsm_alloc_writes(int max)
+{
+	struct imsm_writes *ws = calloc(1, sizeof(*ws));
+
+	if (!ws)
+		return NULL;
+	ws->max = max;
+	ws->w = calloc(max, sizeof(*ws->w));
+	if (!ws->w ||
+	    posix_memalign((void**)&ws->spare_buf, 512, max * 512) != 0) {
+		ws->spare_buf = NULL;
+		imsm_free_writes(ws);
+		return NULL;
+	}
+	return ws;
+}
+
+/* Spare record for the serial writes, which must not allocate in mdmon */
+static char imsm_spare_buf[512] __attribute__((aligned(512)));
+
+static int write_super_imsm(struct supertype *st, int doclose, int parallel)
 {
 	struct intel_super *super = st->sb;
 	struct imsm_super *mpb = super->anchor;
 	struct dl *d;
 	__u32 generation;
-	__u32 sum;
-	int spares = 0;
+	__u32 sum = super->mpb_sum;
+	int incremental = super->mpb_sum_valid;
 	int i;
 	__u32 mpb_size = sizeof(struct imsm_super) - sizeof(struct imsm_disk);
 	int num_disks = 0;
 	int clear_migration_record = 1;
+	struct imsm_writes *ws, *own = NULL;
+	int ndisks = 0;
+	int cnt = 0;
+	int rv = 0;
 
 	/* 'generation' is incremented everytime the metadata is written */
+	/* mdmon rewrites the anchor from its copies of the disks and
+	 * devices many times over, usually to flip one or two state
+	 * bits.  When nothing else has touched the anchor since we last
+	 * wrote it, and the layout stays the same, the checksum follows
+	 * from what the copies below change rather than a fresh pass.
+	 */
+	super->mpb_sum_valid = 0;
+
 	generation = __le32_to_cpu(mpb->generation_num);
 	generation++;
+	sum += generation - __le32_to_cpu(mpb->generation_num);
 	mpb->generation_num = __cpu_to_le32(generation);
 
 	/* fix up cases where previous mdadm releases failed to set
 	 * orig_family_num
 	 */
-	if (mpb->orig_family_num == 0)
+	if (mpb->orig_family_num == 0) {
 		mpb->orig_family_num = mpb->family_num;
+		incremental = 0;
+	}
 
-	for (d = super->disks; d; d = d->next) {
-		if (d->index == -1)
-			spares++;
-		else {
-			mpb->disk[d->index] = d->disk;
+	for (d = super->disks; d; d = d->next)
+		if (d->index != -1)
 			num_disks++;
-		}
-	}
-	for (d = super->missing; d; d = d->next) {
-		mpb->disk[d->index] = d->disk;
+	for (d = super->missing; d; d = d->next)
 		num_disks++;
+	if (num_disks != mpb->num_disks)
+		incremental = 0;
+
+	for (d = super->disks; d; d = d->next) {
+		ndisks++;
+		if (d->index != -1)
+			sum += imsm_copy_csum(&mpb->disk[d->index], &d->disk,
+					      sizeof(d->disk));
 	}
+	for (d = super->missing; d; d = d->next)
+		sum += imsm_copy_csum(&mpb->disk[d->index], &d->disk,
+				      sizeof(d->disk));
 	mpb->num_disks = num_disks;
 	mpb_size += sizeof(struct imsm_disk) * mpb->num_disks;
 
@@ -5146,18 +5312,32 @@ static int write_super_imsm(struct supertype *st, int doclose)
 		struct imsm_dev *dev = __get_imsm_dev(mpb, i);
 		struct imsm_dev *dev2 = get_imsm_dev(super, i);
 		if (dev && dev2) {
-			imsm_copy_dev(dev, dev2);
-			mpb_size += sizeof_imsm_dev(dev, 0);
+			size_t len = sizeof_imsm_dev(dev2, 0);
+
+			if (len != sizeof_imsm_dev(dev, 0))
+				incremental = 0;
+			sum += imsm_copy_csum(dev, dev2, len);
+			mpb_size += len;
 		}
 		if (is_gen_migration(dev2))
 			clear_migration_record = 0;
 	}
 	mpb_size += __le32_to_cpu(mpb->bbm_log_size);
+	if (mpb_size != __le32_to_cpu(mpb->mpb_size))
+		incremental = 0;
 	mpb->mpb_size = __cpu_to_le32(mpb_size);
 
 	/* recalculate checksum */
-	sum = __gen_imsm_checksum(mpb);
+	if (!incremental)
+		sum = __gen_imsm_checksum(mpb);
+	else if (check_env("MDADM_VERIFY_CSUM") &&
+		 sum != __gen_imsm_checksum(mpb)) {
+		fprintf(stderr, Name ": WARNING - running checksum of imsm "
+			"anchor is wrong, using full sum\n");
+		sum = __gen_imsm_checksum(mpb);
+	}
 	mpb->check_sum = __cpu_to_le32(sum);
+	super->mpb_sum = sum;
 
 	if (super->clean_migration_record_by_mdmon) {
 		clear_migration_record = 1;
@@ -5166,38 +5346,49 @@ static int write_super_imsm(struct supertype *st, int doclose)
 	if (clear_migration_record)
 		memset(super->migr_rec_buf, 0, MIGR_REC_BUF_SIZE);
 
-	/* write the mpb for disks that compose raid devices */
-	for (d = super->disks; d ; d = d->next) {
-		if (d->index < 0 || is_failed(&d->disk))
-			continue;
-
-		if (clear_migration_record) {
-			unsigned long long dsize;
-
-			get_dev_size(d->fd, NULL, &dsize);
-			if (lseek64(d->fd, dsize - 512, SEEK_SET) >= 0) {
-				if (write(d->fd, super->migr_rec_buf,
-					MIGR_REC_BUF_SIZE) != MIGR_REC_BUF_SIZE)
-					perror("Write migr_rec failed");
-			}
+	/* Each disk is written from its own thread, so a commit takes
+	 * about as long as the slowest disk rather than the sum of them
+	 * all.  mdmon's monitor must neither allocate nor start threads,
+	 * so it uses the threads and buffers the manager set up in
+	 * imsm_prepare_sync().  If those are too small for the disks we
+	 * now have (or mdadm is short of memory) we write one disk after
+	 * another.
+	 */
+	ws = super->writes;
+	if (!ws || ws->max < ndisks) {
+		ws = NULL;
+		if (parallel)
+			ws = own = imsm_alloc_writes(ndisks);
+	}
+	if (!ws) {
+		struct imsm_write w;
+
+		for (d = super->disks; d ; d = d->next) {
+			if (!imsm_write_job(super, d, &w, imsm_spare_buf,
+					    clear_migration_record))
+				continue;
+			imsm_write_disk(&w, 0);
+			rv |= imsm_write_done(&w, doclose);
 		}
+		return rv;
+	}
 
-		if (store_imsm_mpb(d->fd, mpb))
-			fprintf(stderr,
-				"%s: failed for device %d:%d (fd: %d)%s\n",
-				__func__, d->major, d->minor,
-				d->fd, strerror(errno));
+	for (d = super->disks; d ; d = d->next)
+		if (imsm_write_job(super, d, &ws->w[cnt],
+				   ws->spare_buf + 512 * cnt,
+				   clear_migration_record))
+			cnt++;
 
-		if (doclose) {
-			close(d->fd);
-			d->fd = -1;
-		}
-	}
+	if (own)
+		run_parallel(cnt, imsm_write_disk, ws->w);
+	else
+		parallel_pool_run(super->writers, cnt, imsm_write_disk, ws->w);
 
-	if (spares)
-		return write_super_imsm_spares(super, doclose);
+	for (i = 0; i < cnt; i++)
+		rv |= imsm_write_done(&ws->w[i], doclose);
+	imsm_free_writes(own);
 
-	return 0;
+	return rv;
 }
 
 
@@ -5286,7 +5477,7 @@ static int write_init_super_imsm(struct supertype *st)
 		struct dl *d;
 		for (d = super->disks; d; d = d->next)
 			Kill(d->devname, NULL, 0, 1, 1);
-		return write_super_imsm(st, 1);
+		return write_super_imsm(st, 1, 1);
 	}
 }
 #endif
@@ -5300,7 +5491,7 @@ static int store_super_imsm(struct supertype *st, int fd)
 		return 1;
 
 #ifndef MDASSEMBLE
-	return store_imsm_mpb(fd, mpb);
+	return store_imsm_mpb(fd, 0, mpb);
 #else
 	return 1;
 #endif
@@ -7413,14 +7604,16 @@ static void imsm_set_disk(struct active_array *a, int n, int state)
 
 }
 
-static int store_imsm_mpb(int fd, struct imsm_super *mpb)
+/* 'dsize' is the size of the device in bytes, or 0 if it isn't known */
+static int store_imsm_mpb(int fd, unsigned long long dsize,
+			  struct imsm_super *mpb)
 {
 	void *buf = mpb;
 	__u32 mpb_size = __le32_to_cpu(mpb->mpb_size);
-	unsigned long long dsize;
 	unsigned long long sectors;
 
-	get_dev_size(fd, NULL, &dsize);
+	if (!dsize && !get_dev_size(fd, NULL, &dsize))
+		return 1;
 
 	if (mpb_size > 512) {
 		/* -1 to account for anchor */
@@ -7445,17 +7638,56 @@ static int store_imsm_mpb(int fd, struct imsm_super *mpb)
 	return 0;
 }
 
+/* Called by mdmon's manager, before it hands the monitor any updates,
+ * to make sure imsm_sync_metadata() has threads and buffers enough to
+ * write every disk at once.  The monitor takes new buffers from
+ * 'next_writes' as it does 'next_buf'.
+ */
+static void imsm_prepare_sync(struct supertype *st)
+{
+	struct intel_super *super = st->sb;
+	struct imsm_writes *ws;
+	struct dl *d;
+	int cnt = 0;
+
+	if (!super || super->next_writes)
+		return;
+	for (d = super->disks; d; d = d->next)
+		cnt++;
+	for (d = super->disk_mgmt_list; d; d = d->next)
+		cnt++;
+	if (cnt <= super->writes_max)
+		return;
+	/* leave room for a few more disks */
+	cnt += 4;
+	ws = imsm_alloc_writes(cnt);
+	if (!ws)
+		return;
+	super->writers = parallel_pool_grow(super->writers, cnt);
+	super->writes_max = cnt;
+	super->next_writes = ws;
+}
+
 static void imsm_sync_metadata(struct supertype *container)
 {
 	struct intel_super *super = container->sb;
 
 	dprintf("sync metadata: %d\n", super->updates_pending);
+	if (super->next_writes) {
+		imsm_free_writes(super->writes);
+		super->writes = super->next_writes;
+		super->next_writes = NULL;
+	}
 	if (!super->updates_pending)
 		return;
 
-	write_super_imsm(container, 0);
+	write_super_imsm(container, 0, 0);
 
 	super->updates_pending = 0;
+	/* Between here and the next sync the anchor only changes through
+	 * imsm_process_update(), so the next write can start from 'sum'.
+	 */
+	super->mpb_sum_valid = 1;
 }
 
 static struct dl *imsm_readd(struct intel_super *super, int idx, struct active_array *a)
@@ -8358,6 +8590,7 @@ static int apply_takeover_update(struct imsm_update_takeover *u,
 			du = (void *)space;
 			memcpy(du, super->disks, sizeof(*du));
 			du->fd = -1;
+			du->dsize = 0;
 			du->minor = 0;
 			du->major = 0;
 			du->index = (i * 2) + 1;
@@ -8420,6 +8653,9 @@ static void imsm_process_update(struct supertype *st,
 	struct imsm_super *mpb;
 	enum imsm_update_type type = *(enum imsm_update_type *) update->buf;
 
+	/* updates edit the anchor in place, so count it all again */
+	super->mpb_sum_valid = 0;
+
 	/* update requires a larger buf but the allocation failed */
 	if (super->next_len && !super->next_buf) {
 		super->next_len = 0;
@@ -10675,6 +10911,7 @@ struct superswitch super_imsm = {
 	.compare_super	= compare_super_imsm,
 
 	.load_super	= load_super_imsm,
+	.sniff_super	= sniff_super_imsm,
 	.init_super	= init_super_imsm,
 	.store_super	= store_super_imsm,
 	.free_super	= free_super_imsm,
@@ -10690,6 +10927,7 @@ struct superswitch super_imsm = {
 	.open_new	= imsm_open_new,
 	.set_array_state= imsm_set_array_state,
 	.set_disk	= imsm_set_disk,
+	.prepare_sync	= imsm_prepare_sync,
 	.sync_metadata	= imsm_sync_metadata,
 	.activate_spare = imsm_activate_spare,
 	.process_update = imsm_process_update,
@@ -68,6 +68,13 @@ static void examine_mbr(struct supertype *st, char *homehost)
 
 #endif /*MDASSEMBLE */
 
+static int sniff_mbr(struct sniff *sn)
+{
+	struct MBR *mbr = sniff_data(sn, 0, sizeof(*mbr));
+
+	return !mbr || mbr->magic == MBR_SIGNATURE_MAGIC;
+}
+
 static int load_super_mbr(struct supertype *st, int fd, char *devname)
 {
 	/* try to read an mbr
@@ -204,6 +211,7 @@ struct superswitch mbr = {
 #endif
 	.match_metadata_desc = match_metadata_desc,
 	.load_super = load_super_mbr,
+	.sniff_super = sniff_mbr,
 	.store_super = store_mbr,
 	.getinfo_super = getinfo_mbr,
 	.free_super = free_mbr,
@@ -837,6 +837,17 @@ static int compare_super0(struct supertype *st, struct supertype *tst)
 
 static void free_super0(struct supertype *st);
 
+static int sniff_super0(struct sniff *sn)
+{
+	__u32 *magic;
+
+	if (sn->size < MD_RESERVED_SECTORS*512)
+		return 0;
+	magic = sniff_data(sn, MD_NEW_SIZE_SECTORS(sn->size>>9) * 512ULL,
+			   sizeof(*magic));
+	return !magic || *magic == MD_SB_MAGIC;
+}
+
 static int load_super0(struct supertype *st, int fd, char *devname)
 {
 	/* try to read in the superblock
@@ -1204,6 +1215,7 @@ struct superswitch super0 = {
 	.store_super = store_super0,
 	.compare_super = compare_super0,
 	.load_super = load_super0,
+	.sniff_super = sniff_super0,
 	.match_metadata_desc = match_metadata_desc0,
 	.avail_size = avail_size0,
 	.add_internal_bitmap = add_internal_bitmap0,
@@ -98,6 +98,13 @@ struct mdp_superblock_1 {
 
 struct misc_dev_info {
 	__u64 device_size;
+	/* calc_sb_1_csum()'s share for dev_roles[0..roles_max), kept
+	 * current by set_role1() so that the whole array need not be
+	 * re-read each time the superblock is checksummed.
+	 */
+	__u64 roles_sum;
+	__u32 roles_max;
+	__u32 roles_valid;
 };
 
 /* feature_map bits */
@@ -112,12 +119,62 @@ struct misc_dev_info {
 #ifndef offsetof
 #define offsetof(t,f) ((size_t)&(((t*)0)->f))
 #endif
+static struct misc_dev_info *misc_info1(struct mdp_superblock_1 *sb)
+{
+	return (struct misc_dev_info *)((char*)sb + MAX_SB_SIZE + BM_SUPER_SIZE);
+}
+
+/* dev_roles[] as summed by calc_sb_1_csum: pairs of roles make up a
+ * 32bit word, and a lone role at the end is added as it is.
+ */
+static unsigned long long roles_sum1(struct mdp_superblock_1 *sb,
+				     unsigned int from, unsigned int to)
+{
+	unsigned long long sum = 0;
+
+	for (; from < to; from++)
+		sum += (unsigned long long)__le16_to_cpu(sb->dev_roles[from])
+			<< ((from & 1) * 16);
+	return sum;
+}
+
+/* All changes to dev_roles[] go through here so that the sum stays right */
+static void set_role1(struct mdp_superblock_1 *sb, unsigned int d, __u16 role)
+{
+	struct misc_dev_info *misc = misc_info1(sb);
+
+	if (misc->roles_valid && d < misc->roles_max) {
+		int shift = (d & 1) * 16;
+
+		misc->roles_sum -= (unsigned long long)
+			__le16_to_cpu(sb->dev_roles[d]) << shift;
+		misc->roles_sum += (unsigned long long)
+			__le16_to_cpu(role) << shift;
+	}
+	sb->dev_roles[d] = role;
+}
+
+static unsigned long long sum_sb1(struct mdp_superblock_1 *sb, int size)
+{
+	unsigned int *isuper = (unsigned int*)sb;
+	unsigned long long newcsum = 0;
+
+	for (; size>=4; size -= 4 ) {
+		newcsum += __le32_to_cpu(*isuper);
+		isuper++;
+	}
+
+	if (size == 2)
+		newcsum += __le16_to_cpu(*(unsigned short*) isuper);
+	return newcsum;
+}
+
 static unsigned int calc_sb_1_csum(struct mdp_superblock_1 * sb)
 {
+	struct misc_dev_info *misc = misc_info1(sb);
 	unsigned int disk_csum, csum;
 	unsigned long long newcsum;
-	int size = sizeof(*sb) + __le32_to_cpu(sb->max_dev)*2;
-	unsigned int *isuper = (unsigned int*)sb;
+	unsigned int max = __le32_to_cpu(sb->max_dev);
 
 /* make sure I can count... */
 	if (offsetof(struct mdp_superblock_1,data_offset) != 128 ||
@@ -128,14 +185,27 @@ static unsigned int calc_sb_1_csum(struct mdp_superblock_1 * sb)
 
 	disk_csum = sb->sb_csum;
 	sb->sb_csum = 0;
-	newcsum = 0;
-	for (; size>=4; size -= 4 ) {
-		newcsum += __le32_to_cpu(*isuper);
-		isuper++;
-	}
 
-	if (size == 2)
-		newcsum += __le16_to_cpu(*(unsigned short*) isuper);
+	/* The roles only need summing again where max_dev has grown */
+	if (!misc->roles_valid || misc->roles_max > max)
+		misc->roles_sum = roles_sum1(sb, 0, max);
+	else if (misc->roles_max < max)
+		misc->roles_sum += roles_sum1(sb, misc->roles_max, max);
+	misc->roles_max = max;
+	misc->roles_valid = 1;
+
+	newcsum = sum_sb1(sb, sizeof(*sb)) + misc->roles_sum;
+
+	if (check_env("MDADM_VERIFY_CSUM")) {
+		unsigned long long full = sum_sb1(sb, sizeof(*sb) + max*2);
+
+		if (full != newcsum) {
+			fprintf(stderr, Name ": WARNING - running checksum "
+				"of dev_roles is wrong, using full sum\n");
+			misc->roles_sum = roles_sum1(sb, 0, max);
+			newcsum = full;
+		}
+	}
 
 	csum = (newcsum & 0xffffffff) + (newcsum >> 32);
 	sb->sb_csum = disk_csum;
@@ -159,14 +229,16 @@ static void init_afd(struct align_fd *afd, int fd)
 		afd->blk_sz = 512;
 }
 
-static char abuf[4096+4096];
 static int aread(struct align_fd *afd, void *buf, int len)
 {
 	/* aligned read.
 	 * On devices with a 4K sector size, we need to read
 	 * the full sector and copy relevant bits into
-	 * the buffer
+	 * the buffer.
+	 * The bounce buffer is on the stack as superblocks
+	 * may be loaded from several threads at once.
 	 */
+	char abuf[4096+4096];
 	int bsize, iosize;
 	char *b;
 	int n;
@@ -179,10 +251,15 @@ static int aread(struct align_fd *afd, void *buf, int len)
 				"invalid block size\n");
 		return -1;
 	}
-	b = ROUND_UP_PTR((char *)abuf, 4096);
-
 	for (iosize = 0; iosize < len; iosize += bsize)
 		;
+	/* A whole number of sectors into an aligned buffer, as when
+	 * loading the superblock, needs no bounce.
+	 */
+	if (iosize == len && ((unsigned long)buf & (bsize-1)) == 0)
+		return read(afd->fd, buf, len);
+	b = ROUND_UP_PTR((char *)abuf, 4096);
+
 	n = read(afd->fd, b, iosize);
 	if (n <= 0)
 		return n;
@@ -201,6 +278,7 @@ static int awrite(struct align_fd *afd, void *buf, int len)
 	 * than the write.
 	 * The address must be sector-aligned.
 	 */
+	char abuf[4096+4096];
 	int bsize, iosize;
 	char *b;
 	int n;
@@ -212,10 +290,11 @@ static int awrite(struct align_fd *afd, void *buf, int len)
 				"invalid block size\n");
 		return -1;
 	}
-	b = ROUND_UP_PTR((char *)abuf, 4096);
-
 	for (iosize = 0; iosize < len ; iosize += bsize)
 		;
+	if (iosize == len && ((unsigned long)buf & (bsize-1)) == 0)
+		return write(afd->fd, buf, len);
+	b = ROUND_UP_PTR((char *)abuf, 4096);
 
 	if (len != iosize) {
 		n = read(afd->fd, b, iosize);
@@ -747,7 +826,7 @@ static int update_super1(struct supertype *st, struct mdinfo *info,
 		else
 			want = 0xFFFF;
 		if (sb->dev_roles[d] != __cpu_to_le16(want)) {
-			sb->dev_roles[d] = __cpu_to_le16(want);
+			set_role1(sb, d, __cpu_to_le16(want));
 			rv = 1;
 		}
 		if (info->reshape_active &&
@@ -785,8 +864,7 @@ static int update_super1(struct supertype *st, struct mdinfo *info,
 		if (rfd >= 0)
 			close(rfd);
 
-		sb->dev_roles[i] =
-			__cpu_to_le16(info->disk.raid_disk);
+		set_role1(sb, i, __cpu_to_le16(info->disk.raid_disk));
 
 		fd = open(devname, O_RDONLY);
 		if (fd >= 0) {
@@ -808,8 +886,8 @@ static int update_super1(struct supertype *st, struct mdinfo *info,
 		}
 	} else if (strcmp(update, "linear-grow-update") == 0) {
 		sb->raid_disks = __cpu_to_le32(info->array.raid_disks);
-		sb->dev_roles[info->disk.number] =
-			__cpu_to_le16(info->disk.raid_disk);
+		set_role1(sb, info->disk.number,
+			  __cpu_to_le16(info->disk.raid_disk));
 	} else if (strcmp(update, "resync") == 0) {
 		/* make sure resync happens */
 		sb->resync_offset = 0ULL;
@@ -849,8 +927,7 @@ static int update_super1(struct supertype *st, struct mdinfo *info,
 	    __le64_to_cpu(sb->super_offset) <
 	    __le64_to_cpu(sb->data_offset)) {
 		/* set data_size to device size less data_offset */
-		struct misc_dev_info *misc = (struct misc_dev_info*)
-			(st->sb + MAX_SB_SIZE + BM_SUPER_SIZE);
+		struct misc_dev_info *misc = misc_info1(sb);
 		printf("Size was %llu\n", (unsigned long long)
 		       __le64_to_cpu(sb->data_size));
 		sb->data_size = __cpu_to_le64(
@@ -951,6 +1028,7 @@ static int init_super1(struct supertype *st, mdu_array_info_t *info,
 	sb->max_dev = __cpu_to_le32((sbsize - sizeof(struct mdp_superblock_1)) / 2);
 
 	memset(sb->dev_roles, 0xff, MAX_SB_SIZE - sizeof(struct mdp_superblock_1));
+	misc_info1(sb)->roles_valid = 0;
 
 	return 1;
 }
@@ -967,15 +1045,14 @@ static int add_to_super1(struct supertype *st, mdu_disk_info_t *dk,
 			  int fd, char *devname)
 {
 	struct mdp_superblock_1 *sb = st->sb;
-	__u16 *rp = sb->dev_roles + dk->number;
 	struct devinfo *di, **dip;
 
 	if ((dk->state & 6) == 6) /* active, sync */
-		*rp = __cpu_to_le16(dk->raid_disk);
+		set_role1(sb, dk->number, __cpu_to_le16(dk->raid_disk));
 	else if ((dk->state & ~2) == 0) /* active or idle -> spare */
-		*rp = 0xffff;
+		set_role1(sb, dk->number, 0xffff);
 	else
-		*rp = 0xfffe;
+		set_role1(sb, dk->number, 0xfffe);
 
 	if (dk->number >= (int)__le32_to_cpu(sb->max_dev) &&
 	    __le32_to_cpu(sb->max_dev) < MAX_DEVS)
@@ -1303,6 +1380,27 @@ static int compare_super1(struct supertype *st, struct supertype *tst)
 	return 0;
 }
 
+static int sniff_super1(struct sniff *sn)
+{
+	unsigned long long dsize = sn->size >> 9;
+	unsigned long long offset[3];
+	int i;
+
+	if (dsize < 24)
+		return 0;
+	/* Same places as load_super1 looks for minor versions 0-2 */
+	offset[0] = ((dsize - 8*2) & ~(4*2-1ULL)) << 9;
+	offset[1] = 0;
+	offset[2] = 4*2 << 9;
+	for (i = 0; i < 3; i++) {
+		__u32 *magic = sniff_data(sn, offset[i], sizeof(*magic));
+
+		if (!magic || __le32_to_cpu(*magic) == MD_SB_MAGIC)
+			return 1;
+	}
+	return 0;
+}
+
 static int load_super1(struct supertype *st, int fd, char *devname)
 {
 	unsigned long long dsize;
@@ -1436,8 +1534,9 @@ static int load_super1(struct supertype *st, int fd, char *devname)
 
 	bsb = (struct bitmap_super_s *)(((char*)super)+MAX_SB_SIZE);
 
-	misc = (struct misc_dev_info*) (((char*)super)+MAX_SB_SIZE+BM_SUPER_SIZE);
+	misc = misc_info1(super);
 	misc->device_size = dsize;
+	misc->roles_valid = 0;
 
 	/* Now check on the bitmap superblock */
 	if ((__le32_to_cpu(super->feature_map)&MD_FEATURE_BITMAP_OFFSET) == 0)
@@ -1818,6 +1917,7 @@ struct superswitch super1 = {
 	.store_super = store_super1,
 	.compare_super = compare_super1,
 	.load_super = load_super1,
+	.sniff_super = sniff_super1,
 	.match_metadata_desc = match_metadata_desc1,
 	.avail_size = avail_size1,
 	.add_internal_bitmap = add_internal_bitmap1,
@@ -1041,6 +1041,62 @@ struct supertype *dup_super(struct supertype *orig)
 	return st;
 }
 
+void *sniff_data(struct sniff *sn, unsigned long long offset, int len)
+{
+	if (offset + len <= (unsigned long long)sn->head_len)
+		return sn->head + offset;
+	if (offset >= sn->tail_offset &&
+	    offset + len <= sn->tail_offset + sn->tail_len)
+		return sn->tail + (offset - sn->tail_offset);
+	return NULL;
+}
+
+/* Read the head and tail of the device for ->sniff_super.
+ * fd may be O_DIRECT, so buffers and offsets are 4K aligned.
+ * Returns 0 if nothing could be read and every handler must be tried.
+ */
+static int sniff_device(int fd, struct sniff *sn)
+{
+	/* Room for the tail to start up to 4K early for alignment */
+	int buflen = SNIFF_HEAD + SNIFF_TAIL + 4096;
+	char *buf;
+	int n;
+
+	memset(sn, 0, sizeof(*sn));
+	if (!get_dev_size(fd, NULL, &sn->size))
+		return 0;
+	if (posix_memalign((void**)&buf, 4096, buflen) != 0)
+		return 0;
+
+	ioctl(fd, BLKFLSBUF, 0); /* make sure we read current data */
+
+	sn->head = buf;
+	if (sn->size > SNIFF_TAIL)
+		sn->tail_offset = (sn->size - SNIFF_TAIL) & ~4095ULL;
+	if (sn->tail_offset <= SNIFF_HEAD) {
+		/* Small device: one read covers all of it */
+		sn->tail_offset = 0;
+		sn->tail = buf;
+	} else {
+		sn->tail = buf + SNIFF_HEAD;
+		buflen -= SNIFF_HEAD;
+		if (lseek64(fd, 0, 0) == 0 &&
+		    (n = read(fd, sn->head, SNIFF_HEAD)) > 0)
+			sn->head_len = n;
+	}
+	if (lseek64(fd, sn->tail_offset, 0) >= 0 &&
+	    (n = read(fd, sn->tail, buflen)) > 0)
+		sn->tail_len = n;
+	if (sn->tail == sn->head)
+		sn->head_len = sn->tail_len;
+
+	if (sn->head_len == 0 && sn->tail_len == 0) {
+		free(buf);
+		return 0;
+	}
+	return 1;
+}
+
 struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 {
 	/* try each load_super to find the best match,
@@ -1048,6 +1104,8 @@ struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 	 */
 	struct superswitch  *ss;
 	struct supertype *st;
+	struct sniff sn;
+	int sniffed;
 	time_t besttime = 0;
 	int bestsuper = -1;
 	int i;
@@ -1056,6 +1114,8 @@ struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 	memset(st, 0, sizeof(*st));
 	st->container_dev = NoMdDev;
 
+	sniffed = sniff_device(fd, &sn);
+
 	for (i=0 ; superlist[i]; i++) {
 		int rv;
 		ss = superlist[i];
@@ -1063,6 +1123,8 @@ struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 			continue;
 		if (guess_type == guess_partitions && ss->add_to_super != NULL)
 			continue;
+		if (sniffed && ss->sniff_super && !ss->sniff_super(&sn))
+			continue;
 		memset(st, 0, sizeof(*st));
 		st->ignore_hw_compat = 1;
 		rv = ss->load_super(st, fd, NULL);
@@ -1077,6 +1139,8 @@ struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 			ss->free_super(st);
 		}
 	}
+	if (sniffed)
+		free(sn.head);
 	if (bestsuper != -1) {
 		int rv;
 		memset(st, 0, sizeof(*st));
@@ -1092,6 +1156,424 @@ struct supertype *guess_super_type(int fd, enum guess_types guess_type)
 	return NULL;
 }
 
+/* Load a superblock into *stp, guessing the type if *stp is NULL.
+ * Returns 0 on success, 1 if no superblock was recognised and
+ * 2 if the superblock could not be loaded.
+ */
+static int probe_super(struct supertype **stp, int fd, int ignore_hw_compat,
+		       char *devname)
+{
+	struct supertype *st = *stp;
+	int rv;
+
+#ifndef MDASSEMBLE
+	if (!st && (st = guess_super_cached(fd)) == NULL)
+		return 1;
+#else
+	if (!st && (st = guess_super(fd)) == NULL)
+		return 1;
+#endif
+	*stp = st;
+	st->ignore_hw_compat = ignore_hw_compat;
+	rv = st->ss->load_super(st, fd, devname);
+	st->ignore_hw_compat = 0;
+#ifndef MDASSEMBLE
+	if (rv == 0)
+		sbcache_store(fd, st);
+#endif
+	return rv ? 2 : 0;
+}
+
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+#include	<pthread.h>
+
+/* Assembling or examining with a device list from mdadm.conf means
+ * opening every candidate and reading its superblock, and each of
+ * those reads waits on a different disk.  probe_devices() does that
+ * up front from a few threads so the disks seek together, and
+ * probe_load() hands the results to the (unchanged, serial) selection
+ * logic.  Anything the probe could not settle - containers, devices
+ * that could not be opened, or a superblock type that no longer
+ * matches what the caller is looking for - is simply loaded again
+ * in the usual way.
+ */
+#define PROBE_THREADS 16
+
+struct dev_probe {
+	struct mddev_dev *dv;
+	struct superswitch *ss;	/* type asked for, NULL to guess */
+	int minor_version;
+	struct supertype *st;
+	int rv;			/* from probe_super(), or -1 */
+};
+
+struct probe_set {
+	struct dev_probe *probes;
+	int cnt;
+	int next;		/* next to probe, then next to look up */
+	int ignore_hw_compat;
+	pthread_mutex_t lock;
+};
+
+static void *probe_thread(void *v)
+{
+	struct probe_set *ps = v;
+
+	while (1) {
+		struct dev_probe *p;
+		struct stat stb;
+		int fd;
+
+		pthread_mutex_lock(&ps->lock);
+		if (ps->next >= ps->cnt) {
+			pthread_mutex_unlock(&ps->lock);
+			break;
+		}
+		p = &ps->probes[ps->next++];
+		/* dev_open() may need map_dev(), which is not thread safe */
+		fd = dev_open(p->dv->devname, O_RDONLY);
+		pthread_mutex_unlock(&ps->lock);
+
+		if (fd < 0)
+			continue;
+		if (fstat(fd, &stb) == 0 && S_ISBLK(stb.st_mode) &&
+		    !must_be_container(fd)) {
+			struct supertype tmpl;
+
+			tmpl.ss = p->ss;
+			tmpl.minor_version = p->minor_version;
+			tmpl.max_devs = 0;
+			p->st = dup_super(p->ss ? &tmpl : NULL);
+			p->rv = probe_super(&p->st, fd, ps->ignore_hw_compat,
+					    NULL);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+struct probe_set *probe_devices(struct mddev_dev *devlist, char *devices,
+				struct supertype *st, int ignore_hw_compat)
+{
+	struct probe_set *ps;
+	struct mddev_dev *dv;
+	pthread_t threads[PROBE_THREADS];
+	int cnt = 0;
+	int nthreads;
+	int i;
+
+	for (dv = devlist; dv; dv = dv->next)
+		if (dv->used < 2 &&
+		    (!devices || match_oneof(devices, dv->devname)))
+			cnt++;
+	if (cnt < 2)
+		return NULL;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return NULL;
+	ps->probes = calloc(cnt, sizeof(ps->probes[0]));
+	if (!ps->probes) {
+		free(ps);
+		return NULL;
+	}
+	for (dv = devlist; dv; dv = dv->next) {
+		struct dev_probe *p;
+
+		if (dv->used >= 2 ||
+		    (devices && !match_oneof(devices, dv->devname)))
+			continue;
+		p = &ps->probes[ps->cnt++];
+		p->dv = dv;
+		p->ss = st ? st->ss : NULL;
+		p->minor_version = st ? st->minor_version : -1;
+		p->rv = -1;
+	}
+	ps->ignore_hw_compat = ignore_hw_compat;
+	pthread_mutex_init(&ps->lock, NULL);
+
+	nthreads = cnt < PROBE_THREADS ? cnt : PROBE_THREADS;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, probe_thread, ps))
+			break;
+	nthreads = i;
+	/* If no thread could be started, probe here instead */
+	if (nthreads == 0)
+		probe_thread(ps);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ps->lock);
+	ps->next = 0;
+	return ps;
+}
+
+void probe_free(struct probe_set *ps)
+{
+	int i;
+
+	if (!ps)
+		return;
+	for (i = 0; i < ps->cnt; i++) {
+		struct supertype *st = ps->probes[i].st;
+
+		if (st) {
+			if (st->sb)
+				st->ss->free_super(st);
+			free(st);
+		}
+	}
+	free(ps->probes);
+	free(ps);
+}
+
+static struct dev_probe *probe_find(struct probe_set *ps,
+				    struct mddev_dev *dv)
+{
+	int i;
+
+	/* Callers walk the list in order, so this is normally 'next' */
+	for (i = ps->next; i < ps->cnt; i++)
+		if (ps->probes[i].dv == dv)
+			break;
+	if (i == ps->cnt)
+		for (i = 0; i < ps->next; i++)
+			if (ps->probes[i].dv == dv)
+				break;
+	if (i == ps->cnt || ps->probes[i].dv != dv)
+		return NULL;
+	ps->next = i + 1;
+	return &ps->probes[i];
+}
+
+/* Can the probe stand in for loading into 'st' (NULL to guess)? */
+static int probe_matches(struct dev_probe *p, struct supertype *st)
+{
+	if (!st)
+		return p->ss == NULL;
+	if (p->ss)
+		return p->ss == st->ss &&
+			p->minor_version == st->minor_version;
+	/* The probe guessed.  If nothing was recognised at all, nothing
+	 * more specific will be either.  Otherwise the type it found
+	 * has to be the one wanted now.
+	 */
+	if (p->rv == 1)
+		return 1;
+	return p->st->ss == st->ss &&
+		(st->minor_version == -1 ||
+		 st->minor_version == p->st->minor_version);
+}
+#else
+struct probe_set *probe_devices(struct mddev_dev *devlist, char *devices,
+				struct supertype *st, int ignore_hw_compat)
+{
+	return NULL;
+}
+
+void probe_free(struct probe_set *ps)
+{
+}
+#endif /* USE_PTHREADS && !MDASSEMBLE */
+
+/* Like loading a superblock from 'fd' into *stp (or a guessed type if
+ * *stp is NULL), but use the result from probe_devices() when there
+ * is a suitable one.  Returns as probe_super().
+ */
+int probe_load(struct probe_set *ps, struct mddev_dev *dv,
+	       struct supertype **stp, int fd, int ignore_hw_compat,
+	       char *devname)
+{
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+	struct dev_probe *p = ps ? probe_find(ps, dv) : NULL;
+
+	if (p && p->rv >= 0 && ps->ignore_hw_compat == ignore_hw_compat &&
+	    probe_matches(p, *stp)) {
+		int rv = p->rv;
+
+		if (rv == 1 && *stp)
+			/* We were given a type, it just isn't there */
+			rv = 2;
+		else if (p->st) {
+			if (*stp)
+				free(*stp);
+			*stp = p->st;
+			p->st = NULL;
+		}
+		p->rv = -1;
+		return rv;
+	}
+#endif
+	return probe_super(stp, fd, ignore_hw_compat, devname);
+}
+
+/* A pool of threads to call fn(arg, i) for every i below cnt, several
+ * at once.  Metadata handlers use this to write to every member of a
+ * container together, so that a commit costs about one disk write
+ * rather than one per disk.  fn() must only touch what belongs to its
+ * own 'i'.
+ * Starting (or growing) a pool allocates and creates threads, but
+ * running one does neither, so mdmon's manager can set one up for the
+ * monitor to use.  A NULL pool runs everything in the caller.
+ */
+#if defined(USE_PTHREADS) && !defined(MDASSEMBLE)
+#define PARALLEL_THREADS 32
+#define PARALLEL_STACK (64*1024)
+
+struct parallel_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	unsigned long round;	/* bumped for each parallel_pool_run() */
+	int busy;		/* threads taking jobs from this round */
+	int stop;
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int cnt;
+	int next;
+	int nthreads;
+	pthread_t threads[PARALLEL_THREADS];
+};
+
+/* Called, and returns, with the lock held */
+static void parallel_work(struct parallel_pool *pool)
+{
+	while (pool->next < pool->cnt) {
+		int i = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->arg, i);
+		pthread_mutex_lock(&pool->lock);
+	}
+}
+
+static void *parallel_thread(void *v)
+{
+	struct parallel_pool *pool = v;
+	unsigned long round;
+
+	pthread_mutex_lock(&pool->lock);
+	round = pool->round;
+	while (1) {
+		while (!pool->stop && pool->round == round)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop)
+			break;
+		/* A thread that wakes late finds no jobs left */
+		round = pool->round;
+		pool->busy++;
+		parallel_work(pool);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Make sure 'pool' has enough threads for 'cnt' jobs at once, starting
+ * it if it is NULL.  New threads join in from the next run, so this
+ * is safe while another thread is running the pool.
+ * Returns the pool, or NULL if one could not be started.
+ */
+struct parallel_pool *parallel_pool_grow(struct parallel_pool *pool, int cnt)
+{
+	pthread_attr_t attr;
+
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool)
+			return NULL;
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->work, NULL);
+		pthread_cond_init(&pool->done, NULL);
+	}
+	/* The calling thread takes a share too */
+	if (cnt - 1 > PARALLEL_THREADS)
+		cnt = PARALLEL_THREADS + 1;
+	/* The work is a few writes, so needs little stack */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PARALLEL_STACK);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nthreads < cnt - 1 &&
+	       pthread_create(&pool->threads[pool->nthreads], &attr,
+			      parallel_thread, pool) == 0)
+		pool->nthreads++;
+	pthread_mutex_unlock(&pool->lock);
+	pthread_attr_destroy(&attr);
+	return pool;
+}
+
+void parallel_pool_run(struct parallel_pool *pool, int cnt,
+		       void (*fn)(void *arg, int i), void *arg)
+{
+	int i;
+
+	if (!pool || !pool->nthreads || cnt < 2) {
+		for (i = 0; i < cnt; i++)
+			fn(arg, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->cnt = cnt;
+	pool->next = 0;
+	pool->round++;
+	pthread_cond_broadcast(&pool->work);
+	parallel_work(pool);
+	/* Every job is taken, so wait for those still running */
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void parallel_pool_stop(struct parallel_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+#else
+struct parallel_pool *parallel_pool_grow(struct parallel_pool *pool, int cnt)
+{
+	return NULL;
+}
+
+void parallel_pool_run(struct parallel_pool *pool, int cnt,
+		       void (*fn)(void *arg, int i), void *arg)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		fn(arg, i);
+}
+
+void parallel_pool_stop(struct parallel_pool *pool)
+{
+}
+#endif /* USE_PTHREADS && !MDASSEMBLE */
+
+/* Run fn(arg, i) for every i below cnt with a pool of its own */
+void run_parallel(int cnt, void (*fn)(void *arg, int i), void *arg)
+{
+	struct parallel_pool *pool = NULL;
+
+	if (cnt > 1)
+		pool = parallel_pool_grow(NULL, cnt);
+	parallel_pool_run(pool, cnt, fn, arg);
+	parallel_pool_stop(pool);
+}
+
 /* Return size of device in bytes */
 int get_dev_size(int fd, char *dname, unsigned long long *sizep)
 {